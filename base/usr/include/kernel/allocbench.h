@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Sets how many cores take part, called once before any of them runs */
+void allocbench_init(uint64_t ncores);
+
+/* Runs every scenario, called at the same time by each of the cores */
+void allocbench_run(void);
+
+/* Provided by the platform: a slow but accurate clock in nanoseconds, used to calibrate the TSC */
+uint64_t allocbench_clock_ns(void);
@@ -15,15 +15,38 @@
 #define LAPIC_REG_LVT_TIMER 0x320
 #define LAPIC_REG_TIMER_DIV 0x3e0
 #define LAPIC_REG_TIMER_CURCNT 0x390
+#define LAPIC_TIMER_ONESHOT 0x00000
 #define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_TSC_DEADLINE 0x40000
 #define LAPIC_ICR_LOW 0x300
 #define LAPIC_ICR_HIGH 0x310
+#define LAPIC_ICR_PENDING (1 << 12) /* Delivery status, the previous IPI is not sent yet */
+
+/* Destination shorthands of lapic_issue_ipi() */
+#define LAPIC_IPI_SELF 1
+#define LAPIC_IPI_ALL 2
+#define LAPIC_IPI_ALL_BUT_SELF 3
+
+/* In x2APIC mode the registers are MSRs, the MMIO offset shifted right by 4 */
+#define X2APIC_MSR_BASE 0x800
+#define X2APIC_MSR_ICR 0x830 /* The whole ICR in one 64 bit write */
+#define X2APIC_MSR_SELF_IPI 0x83F
+
+/* If the LAPICs run in x2APIC mode, set by smp_init() from what Limine enabled */
+extern bool x2apic_enabled;
 
 static inline uint32_t lapic_read(uint32_t reg) {
+	if(x2apic_enabled) {
+		return (uint32_t)rdmsr(X2APIC_MSR_BASE + (reg >> 4));
+	}
 	return *(volatile uint32_t*)((uintptr_t)lapic_address + reg);
 }
 
 static inline void lapic_write(uint32_t reg, uint32_t val) {
+	if(x2apic_enabled) {
+		wrmsr(X2APIC_MSR_BASE + (reg >> 4), val);
+		return;
+	}
 	*(volatile uint32_t*)((uintptr_t)lapic_address + reg) = val;
 }
 
@@ -33,10 +56,17 @@ uint32_t ioapic_read(struct madt_ioapic* ioapic, uint32_t reg);
 void ioapic_write(struct madt_ioapic* ioapic, uint32_t reg, uint32_t value);
 void ioapic_irq_redirect(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool status);
 static struct madt_ioapic *ioapic_from_gsi(uint32_t gsi);
+void ioapic_reroute_isolated(void);
 void ioapic_set_gsi_redirect(uint32_t lapic_id, uint8_t vector, uint8_t gsi,
                               uint16_t flags, bool status);
 struct regs* lapic_timer_handler(struct regs* r);
 void lapic_timer_calibrate(uint64_t ns);
-void lapic_issue_ipi(uint16_t core, uint8_t vector, uint8_t shorthand, uint8_t delivery);
+void lapic_timer_init(void);
+void lapic_issue_ipi(uint32_t core, uint8_t vector, uint8_t shorthand, uint8_t delivery);
+void lapic_self_ipi(uint8_t vector);
 uint32_t lapic_get_current_count();
-uint64_t lapic_get_frequency();
\ No newline at end of file
+uint64_t lapic_get_frequency();
+void lapic_timer_oneshot(uint64_t ns);
+void lapic_timer_stop(void);
+void lapic_timer_print_stats(void);
+uint64_t tsc_get_khz(void);
\ No newline at end of file
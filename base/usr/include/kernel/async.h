@@ -0,0 +1,174 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+
+/* Tasks an executor runs before it looks at the queues of other cores again */
+#define ASYNC_BATCH 16
+
+enum async_poll {
+	ASYNC_PENDING, /* Waiting, polled again once woken */
+	ASYNC_READY, /* Finished */
+};
+
+/* States of a task */
+#define ASYNC_IDLE 0 /* Waiting to be woken */
+#define ASYNC_QUEUED 1 /* On the queue of an executor */
+#define ASYNC_RUNNING 2 /* Being polled */
+#define ASYNC_WOKEN 3 /* Woken while being polled, polled again right after */
+#define ASYNC_DONE 4
+
+struct async_task;
+
+/* Advances the task until it has to wait, must not sleep */
+typedef enum async_poll (*async_poll_t)(struct async_task* task);
+
+/**
+ * A stackless coroutine. Its state lives in the structure embedding the
+ * task, so a waiting task only costs the size of that structure
+ */
+struct async_task {
+	async_poll_t poll;
+
+	/* Line the poll function resumes at, see ASYNC_BEGIN() */
+	uint32_t resume;
+	volatile uint32_t state;
+
+	/* Next task on the queue of the executor */
+	struct async_task* next;
+
+	/* Core of the executor it last ran on, woken tasks are queued there */
+	uint64_t core;
+
+	/* Task woken once this one is done, see ASYNC_JOIN() */
+	struct async_task* volatile joiner;
+
+	/* Set by ASYNC_RETURN() */
+	int result;
+};
+
+/* Runs the tasks queued on one core, idle executors steal from busy ones */
+struct async_executor {
+	spinlock_t lock;
+	uint64_t core;
+	struct async_task* head;
+	struct async_task* tail;
+	volatile uint64_t nr_queued;
+
+	/* The executor thread sleeps here when there is nothing to run */
+	struct wait_queue wait;
+	volatile bool idle;
+
+	/* Statistics */
+	uint64_t polls;
+	uint64_t completed;
+	uint64_t stolen;
+};
+
+/* Set once the event happened, wakes the task waiting for it */
+struct async_event {
+	volatile bool set;
+	struct async_task* volatile waiter;
+};
+
+#define ASYNC_EVENT_INIT {false, NULL}
+
+/* A timer waking a task */
+struct async_sleep {
+	struct timer timer;
+	struct async_task* task;
+	volatile bool fired;
+};
+
+/* Get the structure embedding a task */
+#define async_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/**
+ * Poll functions are written as a switch over the resume line. Locals don't
+ * survive a wait, keep them in the structure embedding the task. Only one
+ * wait may be on a source line
+ */
+#define ASYNC_BEGIN(task) switch((task)->resume) { case 0:
+
+#define ASYNC_END(task) } (task)->resume = 0; return ASYNC_READY
+
+/* Finish the task with a result */
+#define ASYNC_RETURN(task, value) do { (task)->result = (value); (task)->resume = 0; return ASYNC_READY; } while(0)
+
+/* Wait until condition is true, it is checked again every time the task is woken */
+#define ASYNC_AWAIT(task, condition) do { \
+	(task)->resume = __LINE__; \
+	__attribute__((fallthrough)); \
+	case __LINE__: \
+	if(!(condition)) { \
+		return ASYNC_PENDING; \
+	} \
+} while(0)
+
+/* Let the other tasks of the executor run */
+#define ASYNC_YIELD(task) do { \
+	(task)->resume = __LINE__; \
+	async_wake(task); \
+	return ASYNC_PENDING; \
+	case __LINE__:; \
+} while(0)
+
+/* Wait for an event, see async_event_signal() */
+#define ASYNC_WAIT_EVENT(task, event) do { \
+	async_event_watch((event), (task)); \
+	ASYNC_AWAIT(task, (event)->set); \
+} while(0)
+
+/* Wait for ns nanoseconds */
+#define ASYNC_SLEEP(task, sleep, ns) do { \
+	async_sleep_start((sleep), (task), (ns)); \
+	ASYNC_AWAIT(task, (sleep)->fired); \
+} while(0)
+
+/* Wait for a spawned task to finish */
+#define ASYNC_JOIN(task, child) do { \
+	async_watch((task), (child)); \
+	ASYNC_AWAIT(task, async_done(child)); \
+} while(0)
+
+/* Wait for all of n spawned tasks to finish */
+#define ASYNC_JOIN_ALL(task, children, n) do { \
+	async_watch_all((task), (children), (n)); \
+	ASYNC_AWAIT(task, async_first_pending((children), (n)) < 0); \
+} while(0)
+
+/**
+ * Wait for the first of n spawned tasks to finish and store its index. The
+ * others keep running, the memory holding them must stay valid until they
+ * are joined as well
+ */
+#define ASYNC_SELECT(task, children, n, index) do { \
+	async_watch_all((task), (children), (n)); \
+	ASYNC_AWAIT(task, ((index) = async_first_done((children), (n))) >= 0); \
+} while(0)
+
+static inline bool async_done(struct async_task* task) {
+	return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == ASYNC_DONE;
+}
+
+void async_init(void);
+void async_task_init(struct async_task* task, async_poll_t poll);
+void async_spawn(struct async_task* task);
+void async_spawn_on(uint64_t core, struct async_task* task);
+void async_wake(struct async_task* task);
+
+void async_watch(struct async_task* task, struct async_task* child);
+void async_watch_all(struct async_task* task, struct async_task** children, uint64_t n);
+int64_t async_first_done(struct async_task** children, uint64_t n);
+int64_t async_first_pending(struct async_task** children, uint64_t n);
+
+void async_event_init(struct async_event* event);
+void async_event_watch(struct async_event* event, struct async_task* task);
+void async_event_signal(struct async_event* event);
+void async_sleep_start(struct async_sleep* sleep, struct async_task* task, uint64_t ns);
+
+void async_print_stats(void);
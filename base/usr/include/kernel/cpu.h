@@ -1,10 +1,14 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 #include <kernel/mmu.h>
 #include <stdbool.h>
 #include <kernel/types.h>
 #include <kernel/msr.h>
+#include <kernel/topology.h>
+#include <kernel/cputime.h>
+#include <kernel/percpu.h>
 
 extern uint64_t coreCount;
 
@@ -32,21 +36,81 @@ static inline uint64_t read_cr4(void) {
     return cr4_value;
 }
 
+struct thread;
+struct runqueue;
+
 typedef struct core {
 	/* Local APIC Id */
 	uint32_t lapic_id;
 
 	/* If our core is the one that ran start */
 	bool bsp;
+
+	/* Index of the core, see cpu_core() */
+	uint64_t id;
+
+	/* Points to this structure, so the gs relative core can be used as a normal pointer */
+	struct core* self;
+
+	/* Thread running on the core and the core's run queue (see sched.c) */
+	struct thread* current_thread;
+	struct runqueue* rq;
+
+	/* Timer interrupts taken and times the idle thread left hlt (see lapic.c) */
+	uint64_t timer_irqs;
+	uint64_t idle_wakeups;
+	uint64_t timer_irqs_last;
+	uint64_t idle_wakeups_last;
+
+	/* Non-zero while the running code must not be preempted (see preempt.c) */
+	volatile uint32_t preempt_count;
+
+	/* Start of the current and the longest non-preemptible section, kept with PREEMPT_DEBUG */
+	uint64_t preempt_start;
+	void* preempt_start_ip;
+	uint64_t preempt_max;
+	void* preempt_max_ip;
+
+	/* Thread whose FPU state was last restored on the core (see fpu.c) */
+	struct thread* fpu_owner;
+
+	/* Package, die, core and SMT sibling of the core, and the caches it shares */
+	struct cpu_topology topo;
+
+	/* TSC ticks spent in every state, only written by the core itself (see cputime.c) */
+	uint64_t cputime[CPUTIME_STATES];
+	uint64_t cputime_last[CPUTIME_STATES]; /* At the last cputime_print_stats() */
+	uint64_t cputime_stamp;
+	uint32_t cputime_state;
+	uint32_t cputime_irq_prev; /* State the running interrupt returns to */
+
+	/* KVM steal time area of the core and the nanoseconds of it already accounted */
+	struct kvm_steal_time* steal_time;
+	uint64_t steal_ns;
 } core_t;
 
+/* The core structure is per-core like any other variable in .percpu */
+DECLARE_PER_CPU(core_t, percpu_core);
+
+/* Get the core with index i */
+static inline core_t* cpu_core(uint64_t i) {
+	return per_cpu_ptr(percpu_core, i);
+}
+
+/* Get the core we are running on */
+static inline core_t* this_core(void) {
+	return this_cpu_read(percpu_core.self);
+}
+
 typedef struct cpu_info {
 	char* vendorId; /* Vendor, Ex: Intel, AMD, Qemu */
 	char* cpuName; /* The whole model name */
-	uint32_t coreCount; /* The number of cores on the CPU */
+	uint32_t coreCount; /* The number of physical cores, set by topology_init() */
 	uint64_t cpuFeatures;
 } cpu_info_t;
 
+extern cpu_info_t* cpu_info;
+
 extern uint32_t bsp_lapic_id;
 
 static inline bool interrupt_state(void) {
@@ -96,6 +160,12 @@ static void fatal(void) {
 	asm volatile("1: hlt; jmp 1b");
 }
 
+static inline uint64_t rdtsc(void) {
+	uint32_t low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
 static inline void* read_gs_register() {
 	return (void*)rdmsr(0xC0000101);
 }
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Highest number of cores a mask can hold */
+#define CPUMASK_MAX_CORES 256
+
+/* Set of cores, indexed like cpu_core() */
+typedef struct cpumask {
+	uint64_t bits[CPUMASK_MAX_CORES / 64];
+} cpumask_t;
+
+static inline void cpumask_clear_all(cpumask_t* mask) {
+	for(uint64_t i = 0; i < CPUMASK_MAX_CORES / 64; i++) {
+		mask->bits[i] = 0;
+	}
+}
+
+static inline void cpumask_set_all(cpumask_t* mask) {
+	for(uint64_t i = 0; i < CPUMASK_MAX_CORES / 64; i++) {
+		mask->bits[i] = ~(uint64_t)0;
+	}
+}
+
+static inline void cpumask_set(cpumask_t* mask, uint64_t core) {
+	mask->bits[core / 64] |= (uint64_t)1 << (core % 64);
+}
+
+static inline void cpumask_clear(cpumask_t* mask, uint64_t core) {
+	mask->bits[core / 64] &= ~((uint64_t)1 << (core % 64));
+}
+
+static inline bool cpumask_test(const cpumask_t* mask, uint64_t core) {
+	return (mask->bits[core / 64] >> (core % 64)) & 1;
+}
+
+/* Remove the cores in other from mask */
+static inline void cpumask_andnot(cpumask_t* mask, const cpumask_t* other) {
+	for(uint64_t i = 0; i < CPUMASK_MAX_CORES / 64; i++) {
+		mask->bits[i] &= ~other->bits[i];
+	}
+}
+
+/* Get the lowest core in the mask, CPUMASK_MAX_CORES if it is empty */
+static inline uint64_t cpumask_first(const cpumask_t* mask) {
+	for(uint64_t i = 0; i < CPUMASK_MAX_CORES / 64; i++) {
+		if(mask->bits[i] != 0) {
+			return i * 64 + __builtin_ctzll(mask->bits[i]);
+		}
+	}
+	return CPUMASK_MAX_CORES;
+}
+
+/* Number of cores in the mask, the kernel is not linked with libgcc's popcount */
+static inline uint64_t cpumask_weight(const cpumask_t* mask) {
+	uint64_t weight = 0;
+	for(uint64_t i = 0; i < CPUMASK_MAX_CORES / 64; i++) {
+		for(uint64_t bits = mask->bits[i]; bits != 0; bits &= bits - 1) {
+			weight++;
+		}
+	}
+	return weight;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* What a core spends its time on */
+enum cputime_state {
+	CPUTIME_USER, /* Interrupted in ring 3 */
+	CPUTIME_KERNEL,
+	CPUTIME_HARDIRQ,
+	CPUTIME_SOFTIRQ, /* Timer functions, run at the end of the timer interrupt */
+	CPUTIME_IDLE,
+	CPUTIME_STEAL, /* The hypervisor ran something else on the CPU */
+	CPUTIME_STATES,
+};
+
+/* KVM paravirtual steal time */
+#define KVM_CPUID_SIGNATURE 0x40000000
+#define KVM_CPUID_FEATURES 0x40000001
+#define KVM_FEATURE_STEAL_TIME (1 << 5)
+#define MSR_KVM_STEAL_TIME 0x4b564d03
+#define KVM_MSR_ENABLED 1
+
+/* Updated by the hypervisor with the nanoseconds the vCPU was runnable but not running */
+struct kvm_steal_time {
+	uint64_t steal;
+	uint32_t version; /* Odd while an update is in progress */
+	uint32_t flags;
+	uint8_t preempted;
+	uint8_t pad0[3];
+	uint32_t pad[11];
+} __attribute__((aligned(64)));
+
+struct regs;
+struct thread;
+
+void cputime_init_core(void);
+uint32_t cputime_enter(uint32_t state);
+void cputime_exit(uint32_t prev);
+void cputime_irq_enter(struct regs* r);
+void cputime_irq_exit(void);
+void cputime_switch(struct thread* next, bool idle);
+uint64_t cputime_to_ns(uint64_t ticks);
+void cputime_print_stats(void);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct node {
 	struct node* previous;
@@ -9,8 +10,10 @@ typedef struct node {
 } node_t;
 
 node_t* dlist_create_empty();
+void dlist_create_empty_bulk(node_t** heads, size_t count);
 uint64_t dlist_get_length(node_t* head);
 void dlist_push(node_t* head, void* value); // Push from last
+void dlist_push_bulk(node_t* head, void** values, size_t count); // Push many from last
 node_t* dlist_pop(node_t* head); // Pop from last
 void dlist_push_at(node_t* head, void* value, uint64_t index);
 node_t* dlist_pop_at(node_t* head, uint64_t index);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/cpu.h>
+
+/* XCR0 state components */
+#define XSTATE_X87 (1 << 0)
+#define XSTATE_SSE (1 << 1)
+#define XSTATE_AVX (1 << 2)
+#define XSTATE_OPMASK (1 << 5)
+#define XSTATE_ZMM_HI256 (1 << 6)
+#define XSTATE_HI16_ZMM (1 << 7)
+#define XSTATE_AVX512 (XSTATE_OPMASK | XSTATE_ZMM_HI256 | XSTATE_HI16_ZMM)
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+#define MSR_XSS 0xDA0
+
+struct thread;
+
+/* Size of the save area of every thread */
+extern uint64_t fpu_state_size;
+
+void fpu_init(void);
+void fpu_switch(struct thread* prev, struct thread* next);
+void fpu_device_not_available(struct regs* r);
+void fpu_thread_free(struct thread* thread);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/cpu.h>
+
+/* Bits of runqueue.idle_state */
+#define IDLE_POLLING (1 << 0) /* The idle thread waits in MWAIT on idle_state, a store wakes it */
+#define IDLE_WAKE (1 << 1) /* Set by the core waking it */
+
+/* Time idle_measure_wakeups() gives the cores between two wakeups */
+#define IDLE_MEASURE_GAP_NS 1000000
+
+/* CPUID leaf 5, MONITOR/MWAIT */
+#define CPUID_MWAIT_LEAF 5
+#define CPUID_MWAIT_ECX_EXTENSIONS (1 << 0)
+
+/* CPUID leaf 6, the LAPIC timer keeps running in deep C-states */
+#define CPUID_POWER_LEAF 6
+#define CPUID_POWER_EAX_ARAT (1 << 2)
+
+void idle_init(void);
+void idle_wait(void);
+void idle_wake(core_t* core);
+void idle_ipi_received(void);
+void idle_measure_wakeups(uint64_t rounds);
+void idle_print_stats(void);
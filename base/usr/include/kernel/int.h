@@ -26,7 +26,10 @@ struct idt_pointer {
 
 typedef struct regs* (*irq_t)(struct regs* r);
 
-#define IRQ_COUNT 2
+#define IRQ_COUNT 3
+
+/* Sent to all other cores by panic(), handled without an irq handler */
+#define HALT_IPI_VECTOR 255
 extern irq_t *irqs;
 
 void idt_init(void);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/cpumask.h>
+
+/* Kernel command line option listing the cores to isolate, like isolcpus=2-3,6 */
+#define ISOLATION_CMDLINE "isolcpus="
+
+/* Cores kept free of kernel noise, and the cores doing the housekeeping instead */
+extern cpumask_t cpu_isolated;
+extern cpumask_t cpu_housekeeping;
+
+static inline bool core_isolated(uint64_t core) {
+	return cpumask_test(&cpu_isolated, core);
+}
+
+void isolation_init(void);
+uint32_t isolation_irq_lapic(uint32_t lapic_id);
@@ -6,6 +6,7 @@
 void printf_init(void);
 
 void kprintf(const char* fmt, ...);
+void kprintf_panic(void);
 
 static inline void clear_screen(void) {
 	kprintf("\033[2J");
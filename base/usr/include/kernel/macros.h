@@ -8,4 +8,9 @@
 #define __initvar __section(".init.data")
 #define __initconst __section(".init.rodata")
 
+/* Size of a cache line on every x86_64 CPU we run on */
+#define CACHELINE_SIZE 64
+
+#define __cacheline_aligned __attribute__((__aligned__(CACHELINE_SIZE)))
+
 #define malloc_t(type) (type*)malloc(sizeof(type))
\ No newline at end of file
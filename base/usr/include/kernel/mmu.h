@@ -47,7 +47,19 @@ void mmu_switch_pagemap(pagemap_t* pagemap);
 uint64_t clean_reclaimable_memory(void);
 
 /* Malloc */
+#define KMALLOC_CACHE_ALIGNED (1 << 0) /* Start on a cache line and share it with no other allocation */
+
 void slab_init(void);
 void *malloc(size_t size);
+void *kmalloc(size_t size, int flags);
+void *aligned_alloc(size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
 void *realloc(void *addr, size_t new_size);
-void free(void *addr);
\ No newline at end of file
+void free(void *addr);
+size_t kmalloc_bulk(size_t size, size_t count, void **out);
+void kfree_bulk(size_t count, void **ptrs);
+void kmalloc_profile_dump(size_t top);
+
+#ifdef KMALLOC_PROFILE
+extern volatile uint64_t kmalloc_profile_sample_rate;
+#endif
\ No newline at end of file
@@ -13,6 +13,7 @@
 #define MSR_FSBASE 0xC0000100
 #define MSR_GSBASE 0xC0000101
 #define MSR_KERNELGSBASE 0xC0000102
+#define MSR_TSC_DEADLINE 0x6E0
 
 static inline uint64_t rdmsr(uint32_t msr) {
 	uint32_t edx = 0, eax = 0;
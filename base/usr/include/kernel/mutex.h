@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/wait.h>
+
+/* Times a contended mutex is polled while its owner runs before the thread sleeps */
+#define MUTEX_SPIN_LIMIT 4096
+
+struct thread;
+
+/* Sleeping lock, spins while the owner is running on another core */
+struct mutex {
+	struct thread* volatile owner;
+	struct wait_queue wait;
+};
+
+#define MUTEX_INIT {NULL, WAIT_QUEUE_INIT}
+
+/* Counting semaphore */
+struct semaphore {
+	volatile int64_t count;
+	struct wait_queue wait;
+};
+
+#define SEMAPHORE_INIT(count) {(count), WAIT_QUEUE_INIT}
+
+void mutex_init(struct mutex* mutex);
+void mutex_lock(struct mutex* mutex);
+bool mutex_try_lock(struct mutex* mutex);
+void mutex_unlock(struct mutex* mutex);
+bool mutex_is_locked(struct mutex* mutex);
+
+void semaphore_init(struct semaphore* sem, int64_t count);
+void semaphore_down(struct semaphore* sem);
+bool semaphore_try_down(struct semaphore* sem);
+void semaphore_up(struct semaphore* sem);
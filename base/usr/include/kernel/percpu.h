@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/macros.h>
+
+/**
+ * Per-core variables, see percpu.c
+ *
+ * Defined in the .percpu section, every core gets its own copy of it and
+ * %gs is based so that %gs:&var is the copy of the running core. this_cpu
+ * accessors are single instructions that can't be torn by a migration,
+ * pointers to a copy need preemption disabled to stay this core's.
+ */
+#define DEFINE_PER_CPU(type, name) __attribute__((section(".percpu"))) __typeof__(type) name
+#define DEFINE_PER_CPU_ALIGNED(type, name) __attribute__((section(".percpu"))) __cacheline_aligned __typeof__(type) name
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) name
+
+/* The copy of the kernel image is used by the BSP until percpu_init() */
+extern char __percpu_start[];
+extern char __percpu_end[];
+
+/* Add to the address of a variable in .percpu to get the copy of a core */
+extern uintptr_t* percpu_offsets;
+DECLARE_PER_CPU(uintptr_t, percpu_offset);
+
+#define per_cpu_ptr(var, core) ((__typeof__(var)*)((uintptr_t)&(var) + percpu_offsets[core]))
+#define per_cpu(var, core) (*per_cpu_ptr(var, core))
+
+#define this_cpu_read(var) ({ \
+	__typeof__(var) __val; \
+	asm volatile ("mov %%gs:%c1, %0" : "=r"(__val) : "i"(&(var))); \
+	__val; \
+})
+
+#define this_cpu_write(var, val) \
+	asm volatile ("mov %1, %%gs:%c0" :: "i"(&(var)), "r"((__typeof__(var))(val)) : "memory")
+
+#define this_cpu_add(var, val) \
+	asm volatile ("add %1, %%gs:%c0" :: "i"(&(var)), "r"((__typeof__(var))(val)) : "memory")
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+#define this_cpu_ptr(var) ((__typeof__(var)*)((uintptr_t)&(var) + this_cpu_read(percpu_offset)))
+
+void percpu_init(void);
+void percpu_enter(uint64_t core);
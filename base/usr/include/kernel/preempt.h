@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <kernel/cpu.h>
+
+/* Set once the BSP runs on its core structure, nothing is counted before */
+extern volatile bool preempt_ready;
+
+/* Get the preempt count of this core, read in one instruction so the core can't change in between */
+static inline uint32_t preempt_count(void) {
+	if(!preempt_ready) {
+		return 0;
+	}
+
+	uint32_t count;
+	asm volatile ("movl %%gs:%c1, %0" : "=r"(count) : "i"(&percpu_core.preempt_count));
+	return count;
+}
+
+/* If the running code may be switched away from by an interrupt */
+static inline bool preemptible(void) {
+	return preempt_count() == 0 && interrupt_state();
+}
+
+void preempt_count_add(void* ip);
+void preempt_disable(void);
+void preempt_enable(void);
+void preempt_enable_no_resched(void);
+void preempt_print_stats(void);
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Intrusive red-black tree, the user walks the tree to find where a node goes */
+struct rb_node {
+	struct rb_node* parent;
+	struct rb_node* left;
+	struct rb_node* right;
+	bool red;
+};
+
+struct rb_root {
+	struct rb_node* node;
+};
+
+#define RB_ROOT_INIT { .node = NULL }
+
+/* Get the structure an rb_node is embedded in */
+#define rb_entry(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/* Attach node as a leaf at link, a child pointer of parent, then call rb_insert_color() */
+static inline void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link) {
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->red = true;
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node* node, struct rb_root* root);
+void rb_erase(struct rb_node* node, struct rb_root* root);
+struct rb_node* rb_first(struct rb_root* root);
+struct rb_node* rb_next(struct rb_node* node);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/preempt.h>
+#include <kernel/workqueue.h>
+
+/* A grace period still waiting on cores after this long sends them an IPI */
+#define RCU_FORCE_QS_NS 10000000
+
+struct regs;
+
+/* Set by rcu_init() once all cores are up, call_rcu() and synchronize_rcu() can't be used before */
+extern volatile bool rcu_ready;
+
+/* Embedded in an object freed with call_rcu() */
+struct rcu_head {
+	struct rcu_head* next;
+	void (*func)(struct rcu_head* head);
+};
+
+/* Callbacks of one core, see rcu.c */
+struct rcu_data {
+	/* Queued since the last grace period was requested */
+	struct rcu_head* next;
+	struct rcu_head** next_tail;
+
+	/* Run once grace period wait_gp completed */
+	struct rcu_head* wait;
+	uint64_t wait_gp;
+
+	/* Odd while the core runs code, even while it is idle */
+	uint64_t dynticks;
+
+	/* The running grace period waits for a quiescent state of this core */
+	volatile bool need_qs;
+
+	struct work work;
+
+	/* Statistics */
+	uint64_t queued;
+	uint64_t invoked;
+};
+
+/**
+ * Read-side critical sections only keep the core from switching, a grace
+ * period ends once every core went through a context switch, idle, user mode
+ * or an interrupt of preemptible code. Sections with interrupts or preemption
+ * disabled are read-side sections as well.
+ */
+static inline void rcu_read_lock(void) {
+	preempt_disable();
+}
+
+static inline void rcu_read_unlock(void) {
+	preempt_enable();
+}
+
+/* Load a pointer published with rcu_assign_pointer() */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+/* Publish a pointer, the object is initialized before readers can see it */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+void rcu_init(void);
+void call_rcu(struct rcu_head* head, void (*func)(struct rcu_head* head));
+void synchronize_rcu(void);
+
+void rcu_qs(void);
+void rcu_idle_enter(void);
+void rcu_idle_exit(void);
+void rcu_irq_enter(struct regs* r);
+void rcu_print_stats(void);
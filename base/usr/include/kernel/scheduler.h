@@ -1,7 +1,65 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <kernel/dlist.h>
 #include <kernel/mmu.h>
+#include <kernel/cpu.h>
+#include <kernel/spinlock.h>
+#include <kernel/cpumask.h>
+#include <kernel/timer.h>
+#include <kernel/rbtree.h>
+#include <kernel/macros.h>
+#include <kernel/cputime.h>
+
+/* Size of the kernel stack of every thread */
+#define THREAD_STACK_SIZE (32 * 1024)
+
+/* Time between two load updates of a busy core, idle cores get none */
+#define SCHED_TICK_NS 10000000
+
+/* Default fair class tunables, see sched_fair_tune() */
+#define SCHED_LATENCY_NS 6000000 /* Every runnable thread runs once within this */
+#define SCHED_MIN_GRANULARITY_NS 750000 /* Shortest slice a thread gets */
+#define SCHED_WAKEUP_GRANULARITY_NS 1000000 /* vruntime lead a woken thread needs to preempt */
+
+/* Nice levels, a level lower gets about 1.25 times the CPU time */
+#define NICE_MIN -20
+#define NICE_MAX 19
+#define NICE_0_WEIGHT 1024
+
+/* Real-time priorities, higher runs first */
+#define RT_PRIO_MIN 1
+#define RT_PRIO_MAX 99
+#define RT_PRIO_LEVELS (RT_PRIO_MAX + 1)
+
+/* Time a SCHED_RR thread runs before others of its priority get a turn */
+#define SCHED_RR_TIMESLICE_NS 100000000
+
+/* Limits of the deadline class parameters */
+#define SCHED_DL_RUNTIME_MIN 10000
+#define SCHED_DL_PERIOD_MAX 1000000000
+
+/* Share of every core deadline threads may reserve, in percent */
+#define SCHED_DL_BW_LIMIT 95
+
+/* Reserved bandwidth is fixed point with this many fraction bits */
+#define SCHED_DL_BW_SHIFT 20
+
+/* Ticks between two balancing passes of a core */
+#define SCHED_BALANCE_TICKS 10
+
+/* Most threads pulled from another core in one balancing pass */
+#define SCHED_BALANCE_MAX_PULL 4
+
+/* Load averages are fixed point with this many fraction bits */
+#define SCHED_LOAD_SHIFT 10
+
+/* Every tick the load average moves 1/2^SCHED_LOAD_DECAY of the way to the current load */
+#define SCHED_LOAD_DECAY 3
+
+/* Vector the reschedule IPI is sent on */
+#define SCHED_IPI_VECTOR 33
 
 struct process {
 	const char* name;
@@ -12,12 +70,290 @@ struct process {
 	pagemap_t* pagemap;
 };
 
+/* Callee saved registers, saved and restored by context_switch (see switch.S) */
 struct context_regs {
-	uint64_t rbx, rbp, r12, r13, r14, r15, rip;
+	uint64_t rbx, rbp, r12, r13, r14, r15, rip, rsp;
+};
+
+enum sched_policy {
+	SCHED_NORMAL, /* Fair class */
+	SCHED_FIFO, /* Real-time, runs until it blocks or a higher priority preempts it */
+	SCHED_RR, /* Real-time, like SCHED_FIFO with a time slice among its priority */
+	SCHED_DEADLINE, /* Earliest deadline first with a runtime budget every period */
+};
+
+/* Priorities of the classes as seen across cores, higher runs first (see sched_prio()) */
+#define SCHED_PRIO_IDLE 0
+#define SCHED_PRIO_FAIR 1
+#define SCHED_PRIO_RT SCHED_PRIO_FAIR /* Plus the real-time priority */
+#define SCHED_PRIO_DL (SCHED_PRIO_RT + RT_PRIO_LEVELS)
+
+struct sched_class;
+struct worker;
+
+enum thread_state {
+	THREAD_READY, /* On a run queue */
+	THREAD_RUNNING, /* Running on a core */
+	THREAD_BLOCKED, /* Waiting for something, not on a run queue */
+	THREAD_DEAD, /* Exited, freed once no core is using its stack */
 };
 
 struct thread {
 	int tid;
 	struct process* parent;
 	struct context_regs context;
-};
\ No newline at end of file
+
+	const char* name;
+	volatile enum thread_state state;
+
+	/* Set while a core is running on the stack of the thread */
+	volatile bool on_cpu;
+
+	/* Kernel stack */
+	void* stack;
+
+	/* Entry point and its argument */
+	void (*entry)(void* arg);
+	void* arg;
+
+	/* Index of the core whose run queue the thread is on */
+	uint64_t core;
+
+	/* Cores the thread may run on */
+	cpumask_t affinity;
+
+	/* FPU save area, allocated on first use, and the core it was last restored on */
+	void* fpu_state;
+	uint64_t fpu_core;
+
+	/* Class picking the thread and its policy */
+	const struct sched_class* sched_class;
+	enum sched_policy policy;
+
+	/* Node in the tree of the fair or deadline class, and if the thread is queued */
+	struct rb_node run_node;
+	bool on_rq;
+
+	/* Real-time class: priority, links in the list of the priority and time left of a SCHED_RR slice */
+	int rt_priority;
+	struct thread* rt_prev;
+	struct thread* rt_next;
+	uint64_t rt_slice;
+
+	/* Deadline class parameters */
+	uint64_t dl_runtime;
+	uint64_t dl_deadline;
+	uint64_t dl_period;
+
+	/* Budget left and absolute deadline of the current period */
+	int64_t dl_budget;
+	uint64_t dl_abs_deadline;
+
+	/* Out of budget, and if it waits for dl_timer to be queued again */
+	bool dl_throttled;
+	bool dl_parked;
+	struct timer dl_timer;
+
+	/* Runtime weighted by the nice level, relative to min_vruntime of its run queue */
+	uint64_t vruntime;
+	uint64_t weight;
+	int nice;
+
+	/* Set if the thread is a workqueue worker */
+	struct worker* worker;
+
+	/* TSC ticks the thread spent in every state, see cputime.c */
+	uint64_t cputime[CPUTIME_STATES];
+
+	/* Time accounting in clock_ns() time */
+	uint64_t exec_start;
+	uint64_t sum_exec_runtime;
+	uint64_t slice_start; /* sum_exec_runtime when the thread was last picked */
+	uint64_t slice; /* Length of the current slice */
+};
+
+/* Fair class threads of a core, ordered by vruntime (see fair.c) */
+struct fair_rq {
+	struct rb_root tasks;
+	struct rb_node* leftmost;
+	uint64_t nr_running;
+
+	/* Never moves backwards, woken and migrated threads are placed relative to it */
+	uint64_t min_vruntime;
+
+	/* Sum of the weights of the queued threads */
+	uint64_t load_weight;
+};
+
+/* Real-time threads of a core, a FIFO list for every priority (see rt.c) */
+struct rt_rq {
+	struct thread* heads[RT_PRIO_LEVELS];
+	struct thread* tails[RT_PRIO_LEVELS];
+	uint64_t bitmap[(RT_PRIO_LEVELS + 63) / 64];
+	uint64_t nr_running;
+};
+
+/* Deadline threads of a core, ordered by absolute deadline (see deadline.c) */
+struct dl_rq {
+	struct rb_root tasks;
+	struct rb_node* leftmost;
+	uint64_t nr_running;
+};
+
+/* Levels of the topology a core balances at, closest first (see domain.c) */
+enum sched_domain_level {
+	SD_SMT, /* Threads of one core */
+	SD_L2, /* Cores sharing an L2 */
+	SD_LLC, /* Cores sharing the last level cache */
+	SD_PACKAGE,
+	SD_SYSTEM,
+	SD_LEVELS,
+};
+
+/* Cores a core balances with at one level, every domain spans its child */
+struct sched_domain {
+	cpumask_t span;
+	enum sched_domain_level level;
+
+	/* Load the busiest core must carry over ours before threads are pulled, in percent */
+	uint32_t imbalance_pct;
+};
+
+/* Per core run queue, every class queues its threads on its own */
+struct runqueue {
+	spinlock_t lock;
+	struct dl_rq dl;
+	struct rt_rq rt;
+	struct fair_rq fair;
+
+	/* Threads queued in all classes */
+	uint64_t nr_running;
+
+	/* sched_prio() of the running thread, read by other cores to push threads */
+	volatile int curr_prio;
+
+	/* Run when nothing else is ready */
+	struct thread* idle;
+
+	/* Thread switched away from, handled by sched_finish_switch() */
+	struct thread* prev;
+	bool prev_requeue;
+	bool prev_preempted;
+
+	/* Fires at the end of the slice of the running thread or at the next load update */
+	struct timer tick_timer;
+	volatile bool need_resched;
+
+	/* Set on an isolated core running a thread alone without the tick, under the lock */
+	bool tick_stopped;
+
+	/* Decaying average of the threads queued or running, see SCHED_LOAD_SHIFT */
+	uint64_t load_avg;
+	uint64_t ticks;
+	uint64_t next_tick;
+
+	/* Statistics */
+	uint64_t switches;
+	uint64_t preemptions;
+	uint64_t steals; /* Threads taken by the idle core */
+	uint64_t balance_pulls; /* Threads taken by periodic balancing */
+	uint64_t rt_pulls; /* Real-time threads taken before picking */
+	uint64_t migrations; /* Threads that arrived from another core */
+	uint64_t tick_stops; /* Times the isolated core went without the tick */
+
+	/* If the core is taking threads */
+	volatile bool online;
+
+	/* Scheduling domains of the core, lowest level first, and its SMT siblings including itself */
+	struct sched_domain domains[SD_LEVELS];
+	uint32_t nr_domains;
+	cpumask_t smt_siblings;
+
+	/* Wakeups of the idle thread and their latency in TSC ticks, see idle.c */
+	volatile uint64_t wake_stamp;
+	uint64_t mwait_wakeups;
+	uint64_t mwait_wake_tsc;
+	uint64_t ipi_wakeups;
+	uint64_t ipi_wake_tsc;
+
+	/* Monitored by the idle thread, alone in its cache line so other writes don't wake it */
+	volatile uint32_t idle_state __cacheline_aligned;
+} __cacheline_aligned;
+
+/* Flags of the enqueue operation of a class */
+#define ENQUEUE_WAKEUP (1 << 0) /* Woken from sleep, gets some credit for it */
+#define ENQUEUE_NEW (1 << 1) /* Never ran, starts a slice behind */
+#define ENQUEUE_HEAD (1 << 2) /* Preempted, goes back to the front of its real-time priority */
+#define ENQUEUE_REPLENISH (1 << 3) /* Deadline thread got its budget back */
+#define ENQUEUE_PULL (1 << 4) /* Taken by a core about to pick, don't preempt */
+
+/* Enqueue flags that let the thread preempt one of its own class */
+#define ENQUEUE_PREEMPT (ENQUEUE_WAKEUP | ENQUEUE_NEW | ENQUEUE_REPLENISH)
+
+/* A scheduling class, the run queue lock is held for all of these */
+struct sched_class {
+	void (*enqueue)(struct runqueue* rq, struct thread* thread, uint64_t from_core, int flags);
+	void (*dequeue)(struct runqueue* rq, struct thread* thread);
+
+	/* Get the thread that runs next, pick_next also takes it off the queue */
+	struct thread* (*peek)(struct runqueue* rq);
+	struct thread* (*pick_next)(struct runqueue* rq);
+
+	/* Take a queued thread that may run on core dst off the queue */
+	struct thread* (*steal)(struct runqueue* rq, uint64_t dst);
+
+	/* Charge the running thread for delta nanoseconds */
+	void (*update_curr)(struct runqueue* rq, struct thread* curr, uint64_t delta);
+
+	/* Nanoseconds until the running thread should be checked again, 0 to preempt it */
+	uint64_t (*tick)(struct runqueue* rq, struct thread* curr);
+
+	/* Check if a thread just queued should preempt the running thread of the same class */
+	bool (*wakeup_preempt)(struct runqueue* rq, struct thread* curr, struct thread* thread);
+};
+
+/* Classes in the order they are picked from */
+extern const struct sched_class dl_sched_class;
+extern const struct sched_class rt_sched_class;
+extern const struct sched_class fair_sched_class;
+
+/* Real-time and deadline threads queued on all cores */
+extern volatile uint64_t sched_nr_rt_queued;
+
+extern struct process kernel_process;
+
+void fair_set_weight(struct runqueue* rq, struct thread* thread, int nice);
+void sched_fair_tune(uint64_t latency_ns, uint64_t min_granularity_ns, uint64_t wakeup_granularity_ns);
+int rt_highest_prio(struct runqueue* rq);
+bool dl_admit(struct thread* thread, uint64_t runtime, uint64_t period);
+void dl_release(struct thread* thread);
+void dl_replenish_timer(void* arg);
+
+void context_switch(struct context_regs* from, struct context_regs* to);
+__attribute__((noreturn)) void context_load(struct context_regs* to);
+
+void sched_init_domains(void);
+void sched_init(void);
+__attribute__((noreturn)) void sched_enter(void);
+__attribute__((noreturn)) void sched_start(void (*init)(void* arg), void* arg);
+void schedule(void);
+void preempt_schedule(void);
+void sched_finish_switch(void);
+void sched_requeue(struct thread* thread, int flags);
+struct regs* sched_tick(struct regs* r);
+void sched_print_stats(void);
+
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg);
+struct thread* thread_create_on(uint64_t core, const char* name, void (*entry)(void* arg), void* arg);
+bool thread_set_affinity(struct thread* thread, const cpumask_t* affinity);
+void thread_yield(void);
+void thread_set_nice(struct thread* thread, int nice);
+bool thread_set_policy(struct thread* thread, enum sched_policy policy, int priority);
+bool thread_set_deadline(struct thread* thread, uint64_t runtime, uint64_t deadline, uint64_t period);
+bool thread_wake(struct thread* thread);
+__attribute__((noreturn)) void thread_exit(void);
+
+/* Get the thread running on this core */
+static inline struct thread* thread_current(void) {
+	return this_core()->current_thread;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Only run the shrinker when an allocation is about to fail (its cache is expensive to rebuild) */
+#define SHRINKER_LAST_RESORT (1 << 0)
+
+/**
+ * \struct shrinker
+ * \brief A cache that can give frames back under memory pressure
+ *
+ * count and scan are called without any allocator lock held, but possibly
+ * with a lock of the caller that is allocating. They must not allocate memory
+ * and must not spin on a lock that an allocating path could be holding.
+*/
+struct shrinker {
+	const char* name; /*!< Name printed with the stats */
+	uint64_t (*count)(struct shrinker* shrinker); /*!< Frames that scan could free right now */
+	uint64_t (*scan)(struct shrinker* shrinker, uint64_t nr_frames); /*!< Free up to nr_frames frames, returns frames freed */
+	uint32_t flags; /*!< SHRINKER_* flags */
+
+	/* Stats, updated by the reclaim path */
+	uint64_t calls; /*!< Number of times scan was called */
+	uint64_t requested; /*!< Frames asked for over all calls */
+	uint64_t reclaimed; /*!< Frames actually freed over all calls */
+
+	struct shrinker* next;
+};
+
+/* Frame allocator watermarks, in frames */
+extern uint64_t mmu_watermark_low;
+extern uint64_t mmu_watermark_high;
+
+void shrinker_register(struct shrinker* shrinker);
+void shrinker_unregister(struct shrinker* shrinker);
+uint64_t shrink_caches(uint64_t nr_frames, bool direct);
+void shrinker_print_stats(void);
+
+void mmu_reclaim_wake(void);
+void mmu_reclaim_background(void);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/cpumask.h>
+
+/* Vector of the cross-core function call IPI */
+#define SMP_CALL_VECTOR 34
+
+/* Flags of struct smp_call */
+#define SMP_CALL_LOCKED (1 << 0) /* Queued or running, the slot can't be reused yet */
+#define SMP_CALL_SYNC (1 << 1) /* The caller waits, unlocked once the function returned */
+
+typedef void (*smp_call_func_t)(void* arg);
+
+/* A function queued on the call queue of a core, see smpcall.c */
+struct smp_call {
+	struct smp_call* next;
+	smp_call_func_t func;
+	void* arg;
+	volatile uint32_t flags;
+};
+
+void smp_call_init(void);
+void smp_call_flush(void);
+void smp_call_function_single(uint64_t core, smp_call_func_t func, void* arg, bool wait);
+void smp_call_function_many(const cpumask_t* mask, smp_call_func_t func, void* arg, bool wait);
+void smp_call_function(smp_call_func_t func, void* arg, bool wait);
+void smp_call_print_stats(void);
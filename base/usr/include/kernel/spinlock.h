@@ -13,5 +13,12 @@ static inline bool spinlock_test_and_acq(spinlock_t* lock) {
 	return __sync_bool_compare_and_swap(&lock->lock, 0, 1);
 }
 
-bool spinlock_acquire(spinlock_t* lock);
-void spinlock_release(spinlock_t* lock, bool int_state);
\ No newline at end of file
+/* Only disable preemption, for locks never taken by interrupt handlers */
+void spinlock_acquire(spinlock_t* lock);
+bool spinlock_try_acquire(spinlock_t* lock);
+void spinlock_release(spinlock_t* lock);
+
+/* Also disable interrupts, for locks shared with interrupt handlers */
+bool spinlock_acquire_irqsave(spinlock_t* lock);
+bool spinlock_try_acquire_irqsave(spinlock_t* lock, bool* int_state);
+void spinlock_release_irqrestore(spinlock_t* lock, bool int_state);
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <kernel/rcu.h>
 
 typedef struct ksym_func {
 	char* name; /* Address to the name (use malloc for the string) */
@@ -15,8 +16,17 @@ typedef struct stack_frame {
 	uint64_t rip;
 } stack_frame_t;
 
-extern ksym_func_t* function_table;
+/* The functions of the kernel, sorted like the ELF symbol table */
+struct ksym_table {
+	struct rcu_head rcu; /* Freed with call_rcu() once dropped */
+	size_t size; /* Bytes allocated */
+	uint64_t count;
+	ksym_func_t funcs[];
+};
+
+extern struct ksym_table* function_table;
 
 void symbols_init(void);
+const char* kernel_cmdline(void);
 ksym_func_t* symbols_search(uintptr_t addr);
 void stacktrace(void);
\ No newline at end of file
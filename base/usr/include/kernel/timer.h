@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/spinlock.h>
+
+/* Resolution of the timer wheel */
+#define TIMER_TICK_NS 1000000
+
+/* Every level has this many slots, and is 2^TIMER_LEVEL_SHIFT times coarser than the one below */
+#define TIMER_WHEEL_SIZE 64
+#define TIMER_LEVEL_SHIFT 3
+#define TIMER_WHEEL_LEVELS 6
+
+/* Slack timer_sleep() gives, so sleeps can share a wakeup */
+#define TIMER_SLEEP_SLACK_NS 50000
+
+/* Timer flags */
+#define TIMER_PINNED (1 << 0) /* Stays on the core that armed it, even when it goes idle */
+#define TIMER_HRES (1 << 1) /* Expires exactly at its deadline, never rounded to the wheel */
+
+struct timer_base;
+
+struct timer {
+	/* Deadline in clock_ns() time, may expire up to slack later */
+	uint64_t expires;
+	uint64_t slack;
+
+	/* Called from the timer interrupt of the core, must not sleep */
+	void (*func)(void* arg);
+	void* arg;
+	uint32_t flags;
+
+	/* Wheel slot, hres list or expired list the timer is on */
+	struct timer* next;
+	struct timer** pprev;
+	uint32_t index;
+
+	/* Core the timer is pending on, NULL if it is not */
+	struct timer_base* volatile base;
+};
+
+/* Timers of one core */
+struct timer_base {
+	spinlock_t lock;
+	uint64_t core;
+
+	/* Next wheel tick to be processed */
+	uint64_t clk;
+	struct timer* slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE];
+	uint64_t pending[TIMER_WHEEL_LEVELS];
+
+	/* High resolution timers, sorted by deadline */
+	struct timer* hres;
+
+	/* Timer whose function is running */
+	struct timer* volatile running;
+
+	/* Deadline the LAPIC timer is armed for, UINT64_MAX if it is stopped */
+	uint64_t programmed;
+
+	/* Statistics */
+	uint64_t fired;
+	uint64_t interrupts;
+	uint64_t migrated;
+};
+
+uint64_t clock_ns(void);
+
+void timer_init(void);
+void timer_setup(struct timer* timer, void (*func)(void* arg), void* arg, uint32_t flags);
+void timer_arm(struct timer* timer, uint64_t expires, uint64_t slack);
+bool timer_cancel(struct timer* timer);
+bool timer_pending(struct timer* timer);
+
+void timer_interrupt(void);
+void timer_program_next(void);
+void timer_core_idle(void);
+void timer_print_stats(void);
+
+void timer_sleep(uint64_t ns);
+void timer_sleep_slack(uint64_t ns, uint64_t slack);
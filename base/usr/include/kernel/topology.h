@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+/* CPUID leaves describing the topology */
+#define CPUID_LEAF_CACHE 0x4
+#define CPUID_LEAF_TOPOLOGY 0xB
+#define CPUID_LEAF_TOPOLOGY_V2 0x1F
+#define CPUID_LEAF_AMD_CACHE 0x8000001D
+
+/* Level types of leaves 0xB and 0x1F */
+#define TOPOLOGY_LEVEL_INVALID 0
+#define TOPOLOGY_LEVEL_SMT 1
+#define TOPOLOGY_LEVEL_CORE 2
+#define TOPOLOGY_LEVEL_MODULE 3
+#define TOPOLOGY_LEVEL_TILE 4
+#define TOPOLOGY_LEVEL_DIE 5
+
+/* Where a core sits in the machine, decoded from its APIC id (see topology.c) */
+struct cpu_topology {
+	uint32_t package;
+	uint32_t die; /* Within the package */
+	uint32_t core; /* Within the die, modules and tiles are counted as part of it */
+	uint32_t thread; /* SMT sibling within the core */
+
+	/* Cores with the same id share the cache, unique across packages */
+	uint32_t l2;
+	uint32_t llc;
+
+	/* Unique across the machine, for comparing cores */
+	uint32_t core_uid;
+	uint32_t die_uid;
+};
+
+void topology_init(void);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+struct thread;
+
+/* A thread sleeping on a wait queue, lives on its stack */
+struct waiter {
+	struct thread* thread;
+	struct waiter* next;
+	bool queued;
+};
+
+/* Threads waiting for something, woken in FIFO order */
+struct wait_queue {
+	spinlock_t lock;
+	struct waiter* head;
+	struct waiter* tail;
+};
+
+#define WAIT_QUEUE_INIT {SPINLOCK_ZERO, NULL, NULL}
+
+/* Completion is done for every waiter from now on */
+#define COMPLETION_ALL UINT64_MAX
+
+/* Something threads can wait to happen */
+struct completion {
+	volatile uint64_t done;
+	struct wait_queue wait;
+};
+
+#define COMPLETION_INIT {0, WAIT_QUEUE_INIT}
+
+void wait_queue_init(struct wait_queue* wq);
+void wait_queue_sleep_locked(struct wait_queue* wq, bool int_state);
+bool wait_queue_sleep_locked_until(struct wait_queue* wq, bool int_state, uint64_t deadline);
+bool wake_up_one(struct wait_queue* wq);
+uint64_t wake_up_all(struct wait_queue* wq);
+
+/**
+ * wait_event: Sleep until condition is true
+ *
+ * The condition is checked with the lock of the wait queue held, so a wake up
+ * after it was made true is never missed. It must not sleep itself. Only for
+ * threads, not interrupt handlers or the idle thread
+ */
+#define wait_event(wq, condition) do { \
+	for(;;) { \
+		bool __int_state = spinlock_acquire_irqsave(&(wq)->lock); \
+		if(condition) { \
+			spinlock_release_irqrestore(&(wq)->lock, __int_state); \
+			break; \
+		} \
+		wait_queue_sleep_locked((wq), __int_state); \
+	} \
+} while(0)
+
+/**
+ * wait_event_timeout: Sleep until condition is true or ns have passed
+ *
+ * Same rules as wait_event()
+ *
+ * @return The condition, false if it timed out
+ */
+#define wait_event_timeout(wq, condition, ns) ({ \
+	uint64_t __deadline = clock_ns() + (ns); \
+	bool __done; \
+	for(;;) { \
+		bool __int_state = spinlock_acquire_irqsave(&(wq)->lock); \
+		if(condition) { \
+			spinlock_release_irqrestore(&(wq)->lock, __int_state); \
+			__done = true; \
+			break; \
+		} \
+		if(!wait_queue_sleep_locked_until((wq), __int_state, __deadline)) { \
+			__done = (condition); \
+			break; \
+		} \
+	} \
+	__done; \
+})
+
+void completion_init(struct completion* completion);
+void wait_for_completion(struct completion* completion);
+bool wait_for_completion_timeout(struct completion* completion, uint64_t ns);
+bool try_wait_for_completion(struct completion* completion);
+void complete(struct completion* completion);
+void complete_all(struct completion* completion);
+void reinit_completion(struct completion* completion);
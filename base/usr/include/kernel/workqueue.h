@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+/* Workers of a pool that may wait idle, more exit */
+#define WQ_MAX_IDLE_WORKERS 2
+
+/* Most workers a pool runs at once */
+#define WQ_MAX_WORKERS 64
+
+/* Workqueue flags */
+#define WQ_UNBOUND (1 << 0) /* Work runs on any core, as many items at once as there are idle workers */
+
+struct work;
+struct worker_pool;
+
+typedef void (*work_func_t)(struct work* work);
+
+/* A function to run in a worker thread, may sleep */
+struct work {
+	work_func_t func;
+	struct work* next;
+
+	/* Pool the work was last queued on */
+	struct worker_pool* volatile pool;
+
+	/* Set from queueing until the function starts running */
+	volatile bool pending;
+};
+
+/* Work queued once a timer expires */
+struct delayed_work {
+	struct work work;
+	struct timer timer;
+	struct workqueue* wq;
+};
+
+#define WORK_INIT(fn) { .func = (fn), .next = NULL, .pool = NULL, .pending = false }
+
+struct workqueue {
+	const char* name;
+	uint32_t flags;
+};
+
+/* A thread running work of a pool */
+struct worker {
+	struct thread* thread;
+	struct worker_pool* pool;
+
+	/* Next idle worker of the pool */
+	struct worker* next;
+
+	/* Only written by the worker itself */
+	bool idle;
+
+	/* Blocked while running work, see wq_worker_sleeping() */
+	volatile bool sleeping;
+};
+
+/* Workers and queued work of a core, or of all cores for the unbound pool */
+struct worker_pool {
+	spinlock_t lock;
+	uint64_t core;
+	bool unbound;
+
+	struct work* head;
+	struct work* tail;
+
+	/* Workers waiting for work */
+	struct worker* idle;
+	uint64_t nr_idle;
+	uint64_t nr_workers;
+
+	/* Workers neither idle nor blocked */
+	volatile uint64_t nr_running;
+
+	/* A worker is creating another one */
+	bool creating;
+
+	/* Statistics */
+	uint64_t processed;
+	uint64_t created;
+};
+
+extern struct workqueue system_wq;
+extern struct workqueue system_unbound_wq;
+
+void workqueue_init(void);
+void work_init(struct work* work, work_func_t func);
+void delayed_work_init(struct delayed_work* dwork, work_func_t func);
+
+bool queue_work(struct workqueue* wq, struct work* work);
+bool queue_work_on(uint64_t core, struct workqueue* wq, struct work* work);
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, uint64_t delay_ns);
+bool cancel_work(struct work* work);
+bool cancel_delayed_work(struct delayed_work* dwork);
+void workqueue_print_stats(void);
+
+/* Scheduler hooks */
+void wq_worker_sleeping(struct thread* thread);
+void wq_worker_waking_up(struct thread* thread);
@@ -7,4 +7,6 @@
 typedef int64_t ptrdiff_t;
 typedef uint64_t size_t;
 
+#define offsetof(type, member) __builtin_offsetof(type, member)
+
 #endif
\ No newline at end of file
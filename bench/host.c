@@ -0,0 +1,69 @@
+/**
+ * host.c: Runs the allocator benchmark as a Linux process
+ * 
+ * Usage: allocbench [threads] [arena MiB]
+ * 
+ * Every thread plays one core. Build with `make` in this folder, it is a
+ * normal binary for perf, valgrind and the sanitizers.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+/* The kernel side, built with the kernel headers */
+void mock_frames_init(void* arena, uint64_t size, uint8_t* map);
+void slab_init(void);
+void allocbench_init(uint64_t ncores);
+void allocbench_run(void);
+
+uint64_t host_clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t nthreads = 0;
+
+static void* bench_thread(void* arg) {
+	(void)arg;
+	allocbench_run();
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	nthreads = argc > 1 ? strtoull(argv[1], NULL, 0) : (uint64_t)sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t arena_size = (argc > 2 ? strtoull(argv[2], NULL, 0) : 4096) << 20;
+
+	void* arena = mmap(NULL, arena_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	uint8_t* map = calloc(arena_size / 4096 / 8, 1);
+	if(arena == MAP_FAILED || map == NULL || nthreads == 0) {
+		fprintf(stderr, "allocbench: can't set up %lu threads with a %lu MiB arena\n",
+			nthreads, arena_size >> 20);
+		return 1;
+	}
+
+	mock_frames_init(arena, arena_size, map);
+	slab_init();
+	allocbench_init(nthreads);
+
+	pthread_t* threads = calloc(nthreads, sizeof(pthread_t));
+	for(uint64_t i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, bench_thread, NULL);
+	}
+	for(uint64_t i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("allocbench: process peak RSS %ld KiB\n", usage.ru_maxrss);
+	return 0;
+}
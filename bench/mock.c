@@ -0,0 +1,131 @@
+/**
+ * mock.c: Kernel services the allocator needs, for running it as a Linux process
+ * 
+ * Compiled with the kernel headers. Frames come from one big anonymous
+ * mapping: "physical" addresses are offsets into it and the HHDM offset is
+ * the address of the mapping.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <limine.h>
+#include <kernel/mmu.h>
+#include <kernel/spinlock.h>
+#include <kernel/symbols.h>
+#include <kernel/shrinker.h>
+#include <kernel/workqueue.h>
+#include <kernel/preempt.h>
+
+/* From the C library, the kernel headers don't declare them */
+int vprintf(const char* fmt, va_list args);
+
+/* From host.c */
+uint64_t host_clock_ns(void);
+
+/* Frame allocator state, defined in mmu.c */
+extern uint8_t* bitmap;
+extern uint64_t nframes;
+extern uint64_t total_memory;
+extern uint64_t usedMemory;
+extern uint64_t freeMemory;
+
+/* Per thread, the benchmark threads stand in for cores */
+static __thread uint32_t mock_preempt_count = 0;
+
+/* Section bounds that mmu_init() would map */
+char text_start[1], text_end[1];
+char rodata_start[1], rodata_end[1];
+char data_start[1], data_end[1];
+
+/* Only referenced by KMALLOC_PROFILE builds */
+bool hpet_initialized = false;
+uint64_t hpet_timer_since(void) {
+	return host_clock_ns();
+}
+
+static struct limine_hhdm_response hhdm_response;
+
+/* Hand the frame allocator an arena of size bytes at arena, with its bitmap in map */
+void mock_frames_init(void* arena, uint64_t size, uint8_t* map) {
+	hhdm_response.offset = (uint64_t)arena;
+	hhdm_request.response = &hhdm_response;
+
+	total_memory = size;
+	nframes = size / PAGE_SIZE;
+	bitmap = map;
+	usedMemory = 0;
+	freeMemory = size;
+
+	mmu_watermark_low = nframes / 128;
+	mmu_watermark_high = mmu_watermark_low * 2;
+}
+
+/* No interrupts to disable and no preemption in a process, only the count is kept */
+volatile bool preempt_ready = false;
+
+void preempt_disable(void) {
+	mock_preempt_count++;
+}
+
+void preempt_enable(void) {
+	mock_preempt_count--;
+}
+
+void spinlock_acquire(spinlock_t* lock) {
+	preempt_disable();
+	while(!spinlock_test_and_acq(lock)) {
+		asm volatile ("pause");
+	}
+}
+
+bool spinlock_try_acquire(spinlock_t* lock) {
+	preempt_disable();
+	if(!spinlock_test_and_acq(lock)) {
+		preempt_enable();
+		return false;
+	}
+	return true;
+}
+
+void spinlock_release(spinlock_t* lock) {
+	__atomic_store_n(&lock->lock, 0, __ATOMIC_SEQ_CST);
+	preempt_enable();
+}
+
+bool spinlock_acquire_irqsave(spinlock_t* lock) {
+	spinlock_acquire(lock);
+	return false;
+}
+
+bool spinlock_try_acquire_irqsave(spinlock_t* lock, bool* int_state) {
+	*int_state = false;
+	return spinlock_try_acquire(lock);
+}
+
+void spinlock_release_irqrestore(spinlock_t* lock, bool int_state) {
+	spinlock_release(lock);
+}
+
+void kprintf(const char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+ksym_func_t* symbols_search(uintptr_t addr) {
+	return NULL;
+}
+
+/* Nothing runs queued work in a process, background reclaim stays off as before workqueues */
+struct workqueue system_unbound_wq = { .name = "unbound", .flags = WQ_UNBOUND };
+
+bool queue_work(struct workqueue* wq, struct work* work) {
+	return false;
+}
+
+uint64_t allocbench_clock_ns(void) {
+	return host_clock_ns();
+}
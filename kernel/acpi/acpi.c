@@ -84,11 +84,13 @@ bool apic_enabled;
 
 /* Initialize ACPI, Find and add all lapic, ioapic, ioiapic_so, lapic_nmi, ioapic_nmi to their respective lists */
 void __init acpi_init(void) {
-	madt_lapic = dlist_create_empty();
-	madt_ioapic = dlist_create_empty();
-	madt_ioapic_so = dlist_create_empty();
-	madt_ioapic_nmi = dlist_create_empty();
-	madt_lapic_nmi = dlist_create_empty();
+	node_t* lists[5];
+	dlist_create_empty_bulk(lists, 5);
+	madt_lapic = lists[0];
+	madt_ioapic = lists[1];
+	madt_ioapic_so = lists[2];
+	madt_ioapic_nmi = lists[3];
+	madt_lapic_nmi = lists[4];
 
 	/* System has no ACPI, panic because we cant access some crucial tables */
 	if(rsdp_request.response->address == NULL) panic("System has no ACPI", NULL);
@@ -0,0 +1,444 @@
+/**
+ * allocbench.c: Allocator benchmark and stress scenarios
+ * 
+ * The same scenarios run in the kernel (ALLOC_BENCH builds, on all cores at
+ * boot) and in the hosted harness in bench/ (Linux threads on a mock frame
+ * source). Every participating core calls allocbench_run(), the cores meet at
+ * a barrier around every scenario and the first core prints the results.
+ */
+
+#ifdef ALLOC_BENCH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <memory.h>
+#include <kernel/allocbench.h>
+#include <kernel/mmu.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+#include <kernel/misc.h>
+
+#ifdef _KERNEL_
+#include <kernel/hpet.h>
+#endif
+
+/* Bytes of frames in use, kept by mmu.c */
+extern uint64_t usedMemory;
+
+#define BENCH_MAX_CORES 64
+
+/* Every BENCH_SAMPLE_EVERY operation is timed, up to BENCH_SAMPLES per core and scenario */
+#define BENCH_SAMPLE_EVERY 16
+#define BENCH_SAMPLES 4096
+
+/* Slots of the ring between a producer and a consumer core */
+#define BENCH_RING_SIZE 256
+
+struct bench_core {
+	uint64_t index; /* Core number inside the benchmark, 0 prints the results */
+	uint64_t ops; /* Operations done in the current scenario */
+	uint64_t seed; /* xorshift state */
+	bool sense; /* Barrier sense */
+	size_t nsamples;
+	uint64_t samples[BENCH_SAMPLES]; /* Latencies in cycles */
+};
+
+struct bench_ring {
+	volatile uint64_t head; /* Written by the producer */
+	volatile uint64_t tail __cacheline_aligned; /* Written by the consumer */
+	void* volatile slots[BENCH_RING_SIZE] __cacheline_aligned;
+};
+
+static uint64_t bench_ncores = 0;
+static uint64_t bench_participants = 0;
+static uint64_t bench_tickets = 0;
+static struct bench_core* bench_cores[BENCH_MAX_CORES];
+static struct bench_ring* bench_rings[BENCH_MAX_CORES / 2];
+
+static volatile uint64_t barrier_count = 0;
+static volatile bool barrier_sense = false;
+
+static uint64_t peak_used = 0;
+static uint64_t cycles_per_us = 0;
+
+static inline uint64_t bench_cycles(void) {
+	uint32_t low, high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void bench_pause(void) {
+	asm volatile ("pause");
+}
+
+static inline uint64_t bench_random(struct bench_core* c) {
+	c->seed ^= c->seed << 13;
+	c->seed ^= c->seed >> 7;
+	c->seed ^= c->seed << 17;
+	return c->seed;
+}
+
+/* Sense reversing barrier between all benchmark cores */
+static void bench_barrier(struct bench_core* c) {
+	c->sense = !c->sense;
+	if(__atomic_add_fetch(&barrier_count, 1, __ATOMIC_ACQ_REL) == bench_ncores) {
+		barrier_count = 0;
+		__atomic_store_n(&barrier_sense, c->sense, __ATOMIC_RELEASE);
+	} else {
+		while(__atomic_load_n(&barrier_sense, __ATOMIC_ACQUIRE) != c->sense) {
+			bench_pause();
+		}
+	}
+}
+
+static inline void bench_track_peak(void) {
+	uint64_t used = __atomic_load_n(&usedMemory, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&peak_used, __ATOMIC_RELAXED);
+	while(used > peak && !__atomic_compare_exchange_n(&peak_used, &peak, used, true,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void bench_count(struct bench_core* c, uint64_t start) {
+	if(start != 0 && c->nsamples < BENCH_SAMPLES) {
+		c->samples[c->nsamples++] = bench_cycles() - start;
+	}
+	if((c->ops++ & 255) == 0) {
+		bench_track_peak();
+	}
+}
+
+static inline uint64_t bench_start(struct bench_core* c) {
+	return (c->ops % BENCH_SAMPLE_EVERY) == 0 ? bench_cycles() : 0;
+}
+
+/* Allocate and free while counting operations and sampling their latency */
+static void* bench_malloc(struct bench_core* c, size_t size) {
+	uint64_t start = bench_start(c);
+	void* ret = malloc(size);
+	bench_count(c, start);
+
+	/* Touch the memory, like a real user would */
+	*(volatile uint8_t*)ret = 1;
+	return ret;
+}
+
+static void bench_free(struct bench_core* c, void* addr, size_t size) {
+	uint64_t start = bench_start(c);
+	free(addr);
+	bench_count(c, start);
+}
+
+/* The same object size over and over, with a short FIFO of live objects */
+#define CHURN_ITERATIONS 200000
+#define CHURN_LIVE 32
+static void scenario_churn(struct bench_core* c) {
+	void* live[CHURN_LIVE] = { NULL };
+	for(uint64_t i = 0; i < CHURN_ITERATIONS; i++) {
+		size_t slot = i % CHURN_LIVE;
+		if(live[slot] != NULL) bench_free(c, live[slot], 64);
+		live[slot] = bench_malloc(c, 64);
+	}
+	for(size_t i = 0; i < CHURN_LIVE; i++) {
+		if(live[i] != NULL) bench_free(c, live[i], 64);
+	}
+}
+
+/* Even cores allocate, the next odd core frees what they allocated */
+#define XCORE_ITEMS 100000
+#define XCORE_SIZE 128
+static void scenario_xcore(struct bench_core* c) {
+	/* Odd core out frees its own objects */
+	if(c->index == bench_ncores - 1 && (bench_ncores % 2) != 0) {
+		for(uint64_t i = 0; i < XCORE_ITEMS; i++) {
+			bench_free(c, bench_malloc(c, XCORE_SIZE), XCORE_SIZE);
+		}
+		return;
+	}
+
+	struct bench_ring* ring = bench_rings[c->index / 2];
+	if((c->index % 2) == 0) {
+		for(uint64_t i = 0; i < XCORE_ITEMS; i++) {
+			void* obj = bench_malloc(c, XCORE_SIZE);
+			while(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == BENCH_RING_SIZE) {
+				bench_pause();
+			}
+			ring->slots[ring->head % BENCH_RING_SIZE] = obj;
+			__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		}
+	} else {
+		for(uint64_t i = 0; i < XCORE_ITEMS; i++) {
+			while(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+				bench_pause();
+			}
+			void* obj = ring->slots[ring->tail % BENCH_RING_SIZE];
+			__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+			bench_free(c, obj, XCORE_SIZE);
+		}
+	}
+}
+
+/* Mostly small sizes of every class, now and then a few pages */
+static size_t bench_mixed_size(struct bench_core* c) {
+	uint64_t r = bench_random(c);
+	if((r & 63) == 0) return PAGE_SIZE + (r >> 8) % (PAGE_SIZE * 2);
+	return 8 + (r >> 8) % 1017;
+}
+
+#define MIXED_ITERATIONS 200000
+#define MIXED_SLOTS 512
+static void scenario_mixed(struct bench_core* c) {
+	void** slots = malloc(sizeof(void*) * MIXED_SLOTS);
+	size_t* sizes = malloc(sizeof(size_t) * MIXED_SLOTS);
+	memset(slots, 0, sizeof(void*) * MIXED_SLOTS);
+
+	for(uint64_t i = 0; i < MIXED_ITERATIONS; i++) {
+		size_t slot = bench_random(c) % MIXED_SLOTS;
+		if(slots[slot] != NULL) {
+			bench_free(c, slots[slot], sizes[slot]);
+			slots[slot] = NULL;
+		} else {
+			sizes[slot] = bench_mixed_size(c);
+			slots[slot] = bench_malloc(c, sizes[slot]);
+		}
+	}
+
+	for(size_t i = 0; i < MIXED_SLOTS; i++) {
+		if(slots[i] != NULL) bench_free(c, slots[i], sizes[i]);
+	}
+	free(slots);
+	free(sizes);
+}
+
+/* Page allocations of 1 to 64 pages, these go through the frame allocator */
+#define LARGE_ITERATIONS 4000
+#define LARGE_SLOTS 16
+static void scenario_large(struct bench_core* c) {
+	void* slots[LARGE_SLOTS] = { NULL };
+	size_t sizes[LARGE_SLOTS];
+
+	for(uint64_t i = 0; i < LARGE_ITERATIONS; i++) {
+		size_t slot = bench_random(c) % LARGE_SLOTS;
+		if(slots[slot] != NULL) bench_free(c, slots[slot], sizes[slot]);
+		sizes[slot] = PAGE_SIZE * (1 + bench_random(c) % 64);
+		slots[slot] = bench_malloc(c, sizes[slot]);
+	}
+
+	for(size_t i = 0; i < LARGE_SLOTS; i++) {
+		if(slots[i] != NULL) bench_free(c, slots[i], sizes[i]);
+	}
+}
+
+/**
+ * Fragmentation aging: every round fills memory with small objects, frees a
+ * random half and allocates bigger ones in the holes. One in eight objects
+ * survives into the next rounds, like long lived kernel objects do, so the
+ * peak resident memory shows how badly the slabs fragment.
+ */
+#define AGING_ROUNDS 8
+#define AGING_OBJECTS 2048
+static void scenario_aging(struct bench_core* c) {
+	void** objects = malloc(sizeof(void*) * AGING_OBJECTS * 2);
+	size_t* sizes = malloc(sizeof(size_t) * AGING_OBJECTS * 2);
+	void** survivors = malloc(sizeof(void*) * AGING_OBJECTS * AGING_ROUNDS / 4);
+	size_t* survivor_sizes = malloc(sizeof(size_t) * AGING_OBJECTS * AGING_ROUNDS / 4);
+	size_t nsurvivors = 0;
+
+	for(int round = 0; round < AGING_ROUNDS; round++) {
+		for(size_t i = 0; i < AGING_OBJECTS; i++) {
+			sizes[i] = 8 + bench_random(c) % 249;
+			objects[i] = bench_malloc(c, sizes[i]);
+		}
+
+		for(size_t i = 0; i < AGING_OBJECTS; i++) {
+			if((bench_random(c) & 1) == 0) {
+				bench_free(c, objects[i], sizes[i]);
+				objects[i] = NULL;
+			}
+		}
+
+		for(size_t i = AGING_OBJECTS; i < AGING_OBJECTS * 2; i++) {
+			sizes[i] = 256 + bench_random(c) % 769;
+			objects[i] = bench_malloc(c, sizes[i]);
+		}
+
+		for(size_t i = 0; i < AGING_OBJECTS * 2; i++) {
+			if(objects[i] == NULL) continue;
+			if((bench_random(c) & 7) == 0) {
+				survivors[nsurvivors] = objects[i];
+				survivor_sizes[nsurvivors++] = sizes[i];
+			} else {
+				bench_free(c, objects[i], sizes[i]);
+			}
+		}
+	}
+
+	for(size_t i = 0; i < nsurvivors; i++) {
+		bench_free(c, survivors[i], survivor_sizes[i]);
+	}
+	free(objects);
+	free(sizes);
+	free(survivors);
+	free(survivor_sizes);
+}
+
+static const struct {
+	const char* name;
+	void (*run)(struct bench_core* c);
+} scenarios[] = {
+	{ "churn", scenario_churn },
+	{ "xcore", scenario_xcore },
+	{ "mixed", scenario_mixed },
+	{ "large", scenario_large },
+	{ "aging", scenario_aging },
+};
+
+/* Heapsort, the samples of all cores are too many for an insertion sort */
+static void bench_sift(uint64_t* a, size_t root, size_t n) {
+	for(;;) {
+		size_t child = root * 2 + 1;
+		if(child >= n) return;
+		if(child + 1 < n && a[child + 1] > a[child]) child++;
+		if(a[root] >= a[child]) return;
+		uint64_t tmp = a[root];
+		a[root] = a[child];
+		a[child] = tmp;
+		root = child;
+	}
+}
+
+static void bench_sort(uint64_t* a, size_t n) {
+	for(size_t i = n / 2; i > 0; i--) bench_sift(a, i - 1, n);
+	for(size_t end = n; end > 1; end--) {
+		uint64_t tmp = a[0];
+		a[0] = a[end - 1];
+		a[end - 1] = tmp;
+		bench_sift(a, 0, end - 1);
+	}
+}
+
+static inline uint64_t cycles_to_ns(uint64_t cycles) {
+	return cycles_per_us == 0 ? cycles : (cycles * 1000) / cycles_per_us;
+}
+
+/* Merge the latency samples of all cores and print the results of a scenario */
+static void bench_report(const char* name, uint64_t cycles, uint64_t used_before) {
+	uint64_t ops = 0;
+	size_t nsamples = 0;
+	for(uint64_t i = 0; i < bench_ncores; i++) {
+		ops += bench_cores[i]->ops;
+		nsamples += bench_cores[i]->nsamples;
+	}
+
+	uint64_t* samples = malloc(sizeof(uint64_t) * (nsamples + 1));
+	size_t n = 0;
+	for(uint64_t i = 0; i < bench_ncores; i++) {
+		memcpy(&samples[n], bench_cores[i]->samples, bench_cores[i]->nsamples * sizeof(uint64_t));
+		n += bench_cores[i]->nsamples;
+	}
+	bench_sort(samples, n);
+
+	uint64_t ns = cycles_to_ns(cycles);
+	uint64_t ops_per_second = ns == 0 ? 0 : (ops * 1000000000) / ns;
+
+#define PERCENTILE(p) (n == 0 ? 0 : cycles_to_ns(samples[MIN((n * (p)) / 1000, n - 1)]))
+	kprintf("allocbench: %s: %lu ops in %lu us, %lu ops/s, latency p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu %s, peak resident +%lu KiB\n",
+		name, ops, ns / 1000, ops_per_second,
+		PERCENTILE(500), PERCENTILE(900), PERCENTILE(990), PERCENTILE(999), PERCENTILE(1000),
+		cycles_per_us == 0 ? "cycles" : "ns",
+		peak_used > used_before ? (peak_used - used_before) / 1024 : 0);
+#undef PERCENTILE
+
+	free(samples);
+}
+
+/* Measure the TSC against the platform clock for 10ms */
+static void bench_calibrate(void) {
+	uint64_t start_ns = allocbench_clock_ns();
+	uint64_t start = bench_cycles();
+	if(start_ns == 0 && allocbench_clock_ns() == 0) return; /* No clock, report cycles */
+
+	uint64_t now_ns;
+	do {
+		now_ns = allocbench_clock_ns();
+	} while(now_ns - start_ns < 10000000);
+
+	cycles_per_us = ((bench_cycles() - start) * 1000) / (now_ns - start_ns);
+}
+
+/**
+ * allocbench_init()
+ * 
+ * Sets up the benchmark, called before any core (or thread) enters allocbench_run()
+ * so all of them see the core count before the first barrier
+ * 
+ * @param ncores The number of cores taking part
+*/
+void allocbench_init(uint64_t ncores) {
+	bench_participants = ncores;
+	bench_ncores = MIN(ncores, BENCH_MAX_CORES);
+}
+
+/**
+ * allocbench_run()
+ * 
+ * Runs all the scenarios, must be called by the cores (or threads) given to allocbench_init() at the same time
+*/
+void allocbench_run(void) {
+	uint64_t index = __atomic_fetch_add(&bench_tickets, 1, __ATOMIC_ACQ_REL);
+	if(index >= BENCH_MAX_CORES) return;
+
+	struct bench_core* c = kmalloc(sizeof(struct bench_core), KMALLOC_CACHE_ALIGNED);
+	c->index = index;
+	c->seed = 0x9E3779B97F4A7C15ull * (index + 1);
+	c->sense = false;
+	bench_cores[index] = c;
+
+	if((index % 2) == 0) {
+		bench_rings[index / 2] = kmalloc(sizeof(struct bench_ring), KMALLOC_CACHE_ALIGNED);
+	}
+
+	/* Wait until everyone got its ticket */
+	while(__atomic_load_n(&bench_tickets, __ATOMIC_ACQUIRE) < bench_participants) {
+		bench_pause();
+	}
+	bench_barrier(c);
+
+	if(index == 0) {
+		bench_calibrate();
+		kprintf("allocbench: %lu cores, %lu cycles/us\n", bench_ncores, cycles_per_us);
+	}
+
+	for(size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+		uint64_t used_before = 0, start = 0;
+
+		c->ops = 0;
+		c->nsamples = 0;
+		if(index == 0) {
+			used_before = peak_used = usedMemory;
+		}
+		bench_barrier(c);
+
+		if(index == 0) start = bench_cycles();
+		scenarios[s].run(c);
+		bench_barrier(c);
+
+		if(index == 0) {
+			bench_report(scenarios[s].name, bench_cycles() - start, used_before);
+		}
+		bench_barrier(c);
+	}
+
+	if((index % 2) == 0) free(bench_rings[index / 2]);
+	bench_barrier(c);
+	free(c);
+}
+
+#ifdef _KERNEL_
+/* The HPET counter keeps running across hpet_sleep() */
+uint64_t allocbench_clock_ns(void) {
+	return hpet_initialized ? hpet_timer_since() : 0;
+}
+#endif
+
+#endif
@@ -10,6 +10,22 @@
 #include <stdbool.h>
 #include <kernel/hpet.h>
 #include <kernel/apic.h>
+#include <kernel/allocbench.h>
+#include <kernel/scheduler.h>
+#include <kernel/workqueue.h>
+#include <kernel/async.h>
+#include <kernel/preempt.h>
+#include <kernel/timer.h>
+#include <kernel/shrinker.h>
+#include <kernel/mmu.h>
+#include <kernel/idle.h>
+#include <memory.h>
+
+/* How often kinit prints the kernel statistics */
+#define KINIT_STATS_NS 10000000000ULL
+
+/* Wakeups of each way idle_measure_wakeups() sends every core at boot */
+#define KINIT_WAKE_ROUNDS 100
 
 extern void debug_printf_init(void);
 extern void gdt_init(void);
@@ -33,10 +49,26 @@ static volatile LIMINE_REQUESTS_START_MARKER;
 __attribute__((used, section(".requests_end_marker")))
 static volatile LIMINE_REQUESTS_END_MARKER;
 
-void kinit_func(void) {
+void kinit_func(void* arg) {
+	/* All cores are scheduling, start the workers and async executors */
+	workqueue_init();
+	async_init();
+
 	kprintf("Reclaimed a total of %lu bytes\n", clean_reclaimable_memory());
+
+	/* Get wakeup latencies of both MWAIT and the IPI into the statistics */
+	idle_measure_wakeups(KINIT_WAKE_ROUNDS);
 	for(;;) {
-		kprintf("x");
+		timer_sleep(KINIT_STATS_NS);
+		sched_print_stats();
+		timer_print_stats();
+		workqueue_print_stats();
+		async_print_stats();
+		lapic_timer_print_stats();
+		shrinker_print_stats();
+#ifdef KMALLOC_PROFILE
+		kmalloc_profile_dump(16);
+#endif
 	}
 }
 
@@ -63,10 +95,15 @@ void _start(void) {
 	/* Initialize the slab allocator */
 	slab_init();
 
-	core_bsp = malloc(sizeof(core_bsp));
+	/* The BSP runs on the per-core variables in the kernel image until smp_init() */
+	core_bsp = &percpu_core;
 	core_bsp->bsp = true;
 	core_bsp->lapic_id = 0;
-	set_gs_register(core_bsp);
+	core_bsp->self = core_bsp;
+	set_gs_register(NULL);
+
+	/* Spinlocks count in the core structure from now on */
+	preempt_ready = true;
 
 	/* Initialize printf */
 	printf_init();
@@ -106,6 +143,11 @@ void _start(void) {
 	/* Initialize multicore */
 	smp_init();
 
-	/* All done, hang the system */
-	asm ("1: hlt; jmp 1b");
+#ifdef ALLOC_BENCH
+	/* The APs are already waiting in the benchmark */
+	allocbench_run();
+#endif
+
+	/* Continue in kinit, the boot stack is left for good */
+	sched_start(kinit_func, NULL);
 }
\ No newline at end of file
@@ -12,9 +12,29 @@
 #include <kernel/macros.h>
 #include <memory.h>
 #include <kernel/hpet.h>
+#include <kernel/percpu.h>
+#include <kernel/misc.h>
 
 spinlock_t printlock = SPINLOCK_ZERO;
 
+/* Core holding printlock */
+static core_t* volatile print_owner = NULL;
+
+/* Set once the kernel panics */
+static volatile bool print_panic = false;
+
+/* Text of interrupt handlers waiting for the printlock holder of the core */
+#define PRINT_RING_SIZE 4096
+
+struct print_ring {
+	char buffer[PRINT_RING_SIZE];
+	uint64_t head; /* Written by interrupt handlers */
+	uint64_t tail; /* Written by the printlock holder */
+	uint64_t dropped;
+};
+
+static DEFINE_PER_CPU(struct print_ring, print_ring);
+
 /* To crash if no framebuffers */
 extern void fatal(void);
 
@@ -88,26 +108,104 @@ void __init printf_init(void) {
 	context->cursor_enabled = false;
 }
 
+/* Write formatted text out, printlock is held or the kernel is panicking */
+static void print_write(const char* buffer, size_t length) {
+	flanterm_write(context, buffer, length);
+
+#ifdef SERIAL_LOG
+	for(size_t i = 0; i < length; i++) {
+		outportb(COM1, buffer[i]);
+	}
+#endif
+}
+
+/* Save text of an interrupt handler that interrupted the printlock holder of this core */
+static void print_defer(const char* buffer, size_t length) {
+	struct print_ring* ring = this_cpu_ptr(print_ring);
+	uint64_t head = ring->head;
+	if(head + length - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > PRINT_RING_SIZE) {
+		ring->dropped += length;
+		return;
+	}
+
+	for(size_t i = 0; i < length; i++) {
+		ring->buffer[(head + i) % PRINT_RING_SIZE] = buffer[i];
+	}
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+/* Print the deferred text of this core, printlock is held */
+static void print_drain(void) {
+	struct print_ring* ring = this_cpu_ptr(print_ring);
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+
+	while(tail != head) {
+		uint64_t offset = tail % PRINT_RING_SIZE;
+		uint64_t length = MIN(head - tail, PRINT_RING_SIZE - offset);
+		print_write(&ring->buffer[offset], length);
+		tail += length;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if(dropped != 0) {
+		char note[64];
+		int length = snprintf(note, sizeof(note), "[%lu bytes of interrupt output dropped]\n", dropped);
+		print_write(note, MIN((size_t)length, sizeof(note) - 1));
+	}
+}
+
+/* Called by panic(), its prints go out even if this core was interrupted while printing */
+void kprintf_panic(void) {
+	print_panic = true;
+}
+
 /**
  * kprintf: Print to framebuffer, also prints to serial if SERIAL_LOG parameter is passed at compile time
+ *
+ * printlock only disables preemption, so rendering keeps interrupts enabled.
+ * An interrupt handler that interrupted the holder on this core can't wait
+ * for it, its text goes to a ring of the core that the holder prints before
+ * it lets go of the lock.
  */
 void kprintf(const char* fmt, ...) {
-	bool int_state = spinlock_acquire(&printlock);
-
 	char buffer[1024];
 
 	va_list args;
 	va_start(args, fmt);
 
-	int length = vsnprintf(buffer, 1024, fmt, args);
+	int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
 	va_end(args);
-	flanterm_write(context, buffer, length);
-
-#ifdef SERIAL_LOG
-	for(int i = 0; i <= length; i++) {
-		outportb(COM1, buffer[i]);
+	if(length <= 0) {
+		return;
+	}
+	length = MIN((size_t)length, sizeof(buffer) - 1);
+
+	if(!interrupt_state() && print_owner == this_core()) {
+		if(print_panic) {
+			print_write(buffer, length);
+		} else {
+			print_defer(buffer, length);
+		}
+		return;
 	}
-#endif
 
-	spinlock_release(&printlock, int_state);
-}
\ No newline at end of file
+	spinlock_acquire(&printlock);
+	print_owner = this_core();
+	print_write(buffer, length);
+
+	/* Text deferred after the last check would wait for the next kprintf, so check with interrupts disabled */
+	for(;;) {
+		print_drain();
+		bool int_state = interrupt_toggle(false);
+		struct print_ring* ring = this_cpu_ptr(print_ring);
+		if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+			print_owner = NULL;
+			spinlock_release(&printlock);
+			interrupt_toggle(int_state);
+			return;
+		}
+		interrupt_toggle(int_state);
+	}
+}
@@ -10,6 +10,11 @@
 #include <kernel/spinlock.h>
 #include <memory.h>
 #include <kernel/macros.h>
+#include <kernel/kprintf.h>
+#include <kernel/symbols.h>
+#include <kernel/rcu.h>
+#include <kernel/hpet.h>
+#include <kernel/shrinker.h>
 
 #define SIZEOF_ARRAY(ARRAY) (sizeof(ARRAY) / sizeof(ARRAY[0]))
 #define DIV_ROUNDUP(VALUE, DIV) \
@@ -22,18 +27,43 @@ struct slab {
     spinlock_t lock;
     void **first_free;
     size_t ent_size;
+    size_t color_next; /* Color (in cache lines) that the next slab page starts its objects at */
+    size_t empty_pages; /* Pages with no object allocated, the shrinker can give them back */
 };
 
 struct slab_header {
     struct slab *slab;
+    uint32_t inuse; /* Objects of this page that are allocated */
 };
 
+/* inuse value of a page that the shrinker is taking off the free list */
+#define SLAB_PAGE_RECLAIMING UINT32_MAX
+
 struct alloc_metadata {
     size_t pages;
     size_t size;
 };
 
-static struct slab slabs[10];
+/**
+ * Slab size classes
+ *
+ * Every class is either a power of two up to a cache line or a multiple of a
+ * cache line, so no object straddles two cache lines and objects of 64 bytes
+ * or more never share one. This is a heuristic and hasn't been measured yet,
+ * the 192 and 384 classes halve the waste between the larger powers of two.
+ * Tune it with the size histogram of kmalloc_profile_dump() (KMALLOC_PROFILE
+ * builds) once there is a real workload to profile.
+ */
+static const size_t slab_sizes[] = {
+    8, 16, 32, 64, 128, 192, 256, 384, 512, 1024
+};
+
+static struct slab slabs[SIZEOF_ARRAY(slab_sizes)];
+
+/* Alignment that every object of a slab is guaranteed to have */
+static inline size_t slab_align(size_t ent_size) {
+    return ent_size < CACHELINE_SIZE ? ent_size : CACHELINE_SIZE;
+}
 
 static inline struct slab *slab_for(size_t size) {
     for (size_t i = 0; i < SIZEOF_ARRAY(slabs); i++) {
@@ -45,104 +75,601 @@ static inline struct slab *slab_for(size_t size) {
     return NULL;
 }
 
-static void create_slab(struct slab *slab, size_t ent_size) {
-    slab->lock = (spinlock_t)SPINLOCK_ZERO;
-    slab->first_free = (void**)(mmu_request_frame() + HHDM_HIGHER_HALF);
-    slab->ent_size = ent_size;
+/* Smallest slab whose objects are at least alignment aligned */
+static inline struct slab *slab_for_aligned(size_t size, size_t alignment) {
+    for (size_t i = 0; i < SIZEOF_ARRAY(slabs); i++) {
+        struct slab *slab = &slabs[i];
+        if (slab->ent_size >= size && slab_align(slab->ent_size) >= alignment) {
+            return slab;
+        }
+    }
+    return NULL;
+}
 
-    size_t header_offset = ALIGN_UP(sizeof(struct slab_header), ent_size);
+/**
+ * Add a page of objects to a slab, the slab lock must be held
+ *
+ * The space left over at the end of a page is used to shift where the objects
+ * start, by one more cache line for every new page. This way the first objects
+ * of different pages don't all land in the same L1 sets.
+ */
+static void slab_grow(struct slab *slab) {
+    uintptr_t page = mmu_request_frame() + HHDM_HIGHER_HALF;
+    size_t ent_size = slab->ent_size;
+
+    size_t header_offset = ALIGN_UP(sizeof(struct slab_header), slab_align(ent_size));
     size_t available_size = PAGE_SIZE - header_offset;
+    size_t count = available_size / ent_size;
+
+    size_t colors = (available_size - count * ent_size) / CACHELINE_SIZE + 1;
+    size_t color = (slab->color_next % colors) * CACHELINE_SIZE;
+    slab->color_next++;
 
-    struct slab_header *slab_ptr = (struct slab_header *)slab->first_free;
+    struct slab_header *slab_ptr = (struct slab_header *)page;
     slab_ptr->slab = slab;
-    slab->first_free = (void **)((uintptr_t)slab->first_free + header_offset);
+    slab_ptr->inuse = 0;
+    slab->empty_pages++;
 
-    void **arr = (void **)slab->first_free;
-    size_t max = available_size / ent_size - 1;
+    void **arr = (void **)(page + header_offset + color);
+    size_t max = count - 1;
     size_t fact = ent_size / sizeof(void *);
 
     for (size_t i = 0; i < max; i++) {
         arr[i * fact] = &arr[(i + 1) * fact];
     }
-    arr[max * fact] = NULL;
+    arr[max * fact] = slab->first_free;
+    slab->first_free = arr;
 }
 
-static void *alloc_from_slab(struct slab *slab) {
-    bool int_state = spinlock_acquire(&slab->lock);
+static void create_slab(struct slab *slab, size_t ent_size) {
+    slab->lock = (spinlock_t)SPINLOCK_ZERO;
+    slab->first_free = NULL;
+    slab->ent_size = ent_size;
+    slab->color_next = 0;
+    slab->empty_pages = 0;
 
+    slab_grow(slab);
+}
+
+/* Take an object off a slab, the slab lock must be held */
+static inline void *slab_pop(struct slab *slab) {
     if (slab->first_free == NULL) {
-        create_slab(slab, slab->ent_size);
+        slab_grow(slab);
     }
 
     void **old_free = slab->first_free;
     slab->first_free = *old_free;
+
+    /* The next allocation dereferences the new head, start loading it now */
+    if (slab->first_free != NULL) {
+        __builtin_prefetch(slab->first_free, 1);
+    }
+
     memset(old_free, 0, slab->ent_size);
 
-    spinlock_release(&slab->lock, int_state);
+    struct slab_header *header = (struct slab_header *)((uintptr_t)old_free & ~0xfff);
+    if (header->inuse++ == 0) {
+        slab->empty_pages--;
+    }
+
     return old_free;
 }
 
+/* Put an object back on a slab, the slab lock must be held */
+static inline void slab_push(struct slab *slab, void *addr) {
+    void **new_head = addr;
+    *new_head = slab->first_free;
+    slab->first_free = new_head;
+
+    struct slab_header *header = (struct slab_header *)((uintptr_t)addr & ~0xfff);
+    if (--header->inuse == 0) {
+        slab->empty_pages++;
+    }
+}
+
+static void *alloc_from_slab(struct slab *slab) {
+    spinlock_acquire(&slab->lock);
+    void *ret = slab_pop(slab);
+    spinlock_release(&slab->lock);
+    return ret;
+}
+
 static void free_in_slab(struct slab *slab, void *addr) {
-    bool int_state = spinlock_acquire(&slab->lock);
+    spinlock_acquire(&slab->lock);
 
     if (addr == NULL) {
         goto cleanup;
     }
 
-    void **new_head = addr;
-    *new_head = slab->first_free;
-    slab->first_free = new_head;
+    slab_push(slab, addr);
 
 cleanup:
-    spinlock_release(&slab->lock, int_state);
+    spinlock_release(&slab->lock);
 }
 
-void __init slab_init(void) {
-    create_slab(&slabs[0], 8);
-    create_slab(&slabs[1], 16);
-    create_slab(&slabs[2], 24);
-    create_slab(&slabs[3], 32);
-    create_slab(&slabs[4], 48);
-    create_slab(&slabs[5], 64);
-    create_slab(&slabs[6], 128);
-    create_slab(&slabs[7], 256);
-    create_slab(&slabs[8], 512);
-    create_slab(&slabs[9], 1024);
+/**
+ * Give up to nr_pages empty pages of a slab back to the frame allocator
+ *
+ * The free list runs through all pages, so the objects of an empty page are
+ * scattered over it. The first object seen of an empty page marks the page
+ * as reclaiming, and every object of a reclaiming page is unlinked. Once the
+ * whole list was walked the marked pages have no object left on it. The slab
+ * lock must be held.
+ */
+static size_t slab_shrink(struct slab *slab, size_t nr_pages) {
+    struct slab_header *reclaim = NULL;
+    size_t marked = 0;
+
+    void **prev = (void **)&slab->first_free;
+    for (void **obj = slab->first_free; obj != NULL; obj = *prev) {
+        struct slab_header *header = (struct slab_header *)((uintptr_t)obj & ~0xfff);
+
+        if (header->inuse == 0 && marked < nr_pages) {
+            header->inuse = SLAB_PAGE_RECLAIMING;
+            marked++;
+
+            /* The page is going away, its slab pointer can link the reclaimed pages */
+            header->slab = (struct slab *)reclaim;
+            reclaim = header;
+        }
+
+        if (header->inuse == SLAB_PAGE_RECLAIMING) {
+            *prev = *obj;
+        } else {
+            prev = obj;
+        }
+    }
+
+    while (reclaim != NULL) {
+        struct slab_header *next = (struct slab_header *)reclaim->slab;
+        mmu_free_frames((void *)((uintptr_t)reclaim - HHDM_HIGHER_HALF), 1);
+        reclaim = next;
+    }
+
+    slab->empty_pages -= marked;
+    return marked;
 }
 
-void *malloc(size_t size) {
-    struct slab *slab = slab_for(size);
-    if (slab != NULL) {
-        return alloc_from_slab(slab);
+/* Every slab keeps one empty page so that alloc/free around a page boundary does not thrash */
+static uint64_t slab_shrinker_count(struct shrinker *shrinker) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < SIZEOF_ARRAY(slabs); i++) {
+        size_t empty = __atomic_load_n(&slabs[i].empty_pages, __ATOMIC_RELAXED);
+        if (empty > 1) {
+            count += empty - 1;
+        }
+    }
+    return count;
+}
+
+static uint64_t slab_shrinker_scan(struct shrinker *shrinker, uint64_t nr_frames) {
+    uint64_t freed = 0;
+    for (size_t i = 0; i < SIZEOF_ARRAY(slabs) && freed < nr_frames; i++) {
+        struct slab *slab = &slabs[i];
+
+        /* The allocation that needs memory may be growing this very slab */
+        if (!spinlock_try_acquire(&slab->lock)) {
+            continue;
+        }
+
+        if (slab->empty_pages > 1) {
+            size_t want = slab->empty_pages - 1;
+            if (want > nr_frames - freed) {
+                want = nr_frames - freed;
+            }
+            freed += slab_shrink(slab, want);
+        }
+
+        spinlock_release(&slab->lock);
+    }
+    return freed;
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .count = slab_shrinker_count,
+    .scan = slab_shrinker_scan,
+};
+
+#ifdef KMALLOC_PROFILE
+/**
+ * Allocation-site profiler
+ *
+ * One in kmalloc_profile_sample_rate allocations records the caller's return
+ * address and size. Sampled allocations are remembered in an address table so
+ * that free() can take them off their call site again, which gives live bytes
+ * and live objects per call site. Counts are scaled by the sample rate when
+ * dumped, so they are estimates unless the rate is 1.
+ */
+
+/* Number of distinct call sites that can be tracked, must be a power of 2 */
+#define PROFILE_SITES 256
+
+/* Number of sampled allocations that can be live at once, must be a power of 2 */
+#define PROFILE_TRACKED 4096
+
+/* Biggest top N that kmalloc_profile_dump() will print */
+#define PROFILE_DUMP_MAX 32
+
+/* The size histogram has one bucket per 8 bytes up to the largest slab, and one for the rest */
+#define PROFILE_SIZE_STEP 8
+#define PROFILE_SIZE_BUCKETS (1024 / PROFILE_SIZE_STEP + 2)
+
+#ifndef KMALLOC_PROFILE_SAMPLE
+#define KMALLOC_PROFILE_SAMPLE 64
+#endif
+
+struct alloc_site {
+    uintptr_t caller; /* Return address of the malloc() call, 0 if the slot is free */
+    uint64_t live_bytes; /* Sampled bytes not freed yet */
+    uint64_t live_objects; /* Sampled allocations not freed yet */
+    uint64_t allocs; /* Sampled allocations in total */
+    uint64_t allocs_last_dump; /* allocs at the time of the last dump, used for the rate */
+};
+
+struct tracked_alloc {
+    uintptr_t addr; /* Address returned to the caller, 0 if the slot is free */
+    size_t size;
+    struct alloc_site *site;
+};
+
+/* Can be changed at runtime, 0 stops sampling new allocations */
+volatile uint64_t kmalloc_profile_sample_rate = KMALLOC_PROFILE_SAMPLE;
+
+static spinlock_t profile_lock = SPINLOCK_ZERO;
+static struct alloc_site profile_sites[PROFILE_SITES];
+static struct tracked_alloc profile_tracked[PROFILE_TRACKED];
+static uint64_t profile_tracked_count = 0;
+static uint64_t profile_counter = 0;
+static uint64_t profile_dropped = 0;
+static uint64_t profile_last_dump_ns = 0;
+static uint64_t profile_sizes[PROFILE_SIZE_BUCKETS];
+
+static inline size_t profile_hash(uintptr_t value) {
+    /* Fibonacci hashing, the low bits of addresses and return addresses are mostly equal */
+    return (size_t)((value * 0x9E3779B97F4A7C15ull) >> 40);
+}
+
+/* Find the site of a caller or create it, profile_lock must be held */
+static struct alloc_site *profile_site(uintptr_t caller) {
+    size_t index = profile_hash(caller) & (PROFILE_SITES - 1);
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        struct alloc_site *site = &profile_sites[(index + i) & (PROFILE_SITES - 1)];
+        if (site->caller == caller) {
+            return site;
+        }
+        if (site->caller == 0) {
+            site->caller = caller;
+            return site;
+        }
+    }
+    return NULL;
+}
+
+static void profile_alloc(void *addr, size_t size, uintptr_t caller) {
+    uint64_t rate = kmalloc_profile_sample_rate;
+    if (rate == 0 || addr == NULL) {
+        return;
+    }
+    if (__atomic_fetch_add(&profile_counter, 1, __ATOMIC_RELAXED) % rate != 0) {
+        return;
+    }
+
+    spinlock_acquire(&profile_lock);
+
+    struct alloc_site *site = profile_site(caller);
+    if (site == NULL || profile_tracked_count >= PROFILE_TRACKED / 2) {
+        /* Keep the address table at most half full so probing stays short */
+        profile_dropped++;
+        goto cleanup;
+    }
+
+    size_t index = profile_hash((uintptr_t)addr) & (PROFILE_TRACKED - 1);
+    while (profile_tracked[index].addr != 0) {
+        index = (index + 1) & (PROFILE_TRACKED - 1);
     }
+    profile_tracked[index] = (struct tracked_alloc){
+        .addr = (uintptr_t)addr,
+        .size = size,
+        .site = site,
+    };
+    profile_tracked_count++;
+
+    site->live_bytes += size;
+    site->live_objects++;
+    site->allocs++;
 
+    size_t bucket = DIV_ROUNDUP(size, PROFILE_SIZE_STEP);
+    profile_sizes[bucket < PROFILE_SIZE_BUCKETS ? bucket : PROFILE_SIZE_BUCKETS - 1]++;
+
+cleanup:
+    spinlock_release(&profile_lock);
+}
+
+/* Find a sampled allocation, profile_lock must be held */
+static struct tracked_alloc *profile_lookup(void *addr) {
+    size_t index = profile_hash((uintptr_t)addr) & (PROFILE_TRACKED - 1);
+    while (profile_tracked[index].addr != 0) {
+        if (profile_tracked[index].addr == (uintptr_t)addr) {
+            return &profile_tracked[index];
+        }
+        index = (index + 1) & (PROFILE_TRACKED - 1);
+    }
+    return NULL;
+}
+
+static void profile_free(void *addr) {
+    if (__atomic_load_n(&profile_tracked_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    spinlock_acquire(&profile_lock);
+
+    struct tracked_alloc *tracked = profile_lookup(addr);
+    if (tracked == NULL) {
+        goto cleanup;
+    }
+
+    tracked->site->live_bytes -= tracked->size;
+    tracked->site->live_objects--;
+    profile_tracked_count--;
+
+    /* Backward shift deletion, keeps the probe chains intact without tombstones */
+    size_t hole = tracked - profile_tracked;
+    size_t next = (hole + 1) & (PROFILE_TRACKED - 1);
+    while (profile_tracked[next].addr != 0) {
+        size_t home = profile_hash(profile_tracked[next].addr) & (PROFILE_TRACKED - 1);
+        if (((next - home) & (PROFILE_TRACKED - 1)) >= ((next - hole) & (PROFILE_TRACKED - 1))) {
+            profile_tracked[hole] = profile_tracked[next];
+            hole = next;
+        }
+        next = (next + 1) & (PROFILE_TRACKED - 1);
+    }
+    profile_tracked[hole].addr = 0;
+
+cleanup:
+    spinlock_release(&profile_lock);
+}
+
+/* An allocation was resized in place */
+static void profile_resize(void *addr, size_t new_size) {
+    if (__atomic_load_n(&profile_tracked_count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    spinlock_acquire(&profile_lock);
+    struct tracked_alloc *tracked = profile_lookup(addr);
+    if (tracked != NULL) {
+        tracked->site->live_bytes = tracked->site->live_bytes - tracked->size + new_size;
+        tracked->size = new_size;
+    }
+    spinlock_release(&profile_lock);
+}
+
+/**
+ * kmalloc_profile_dump()
+ *
+ * Prints the call sites holding the most live heap memory
+ *
+ * @param top The number of call sites to print
+ */
+void kmalloc_profile_dump(size_t top) {
+    struct alloc_site snapshot[PROFILE_DUMP_MAX];
+    size_t found = 0;
+
+    if (top > PROFILE_DUMP_MAX) {
+        top = PROFILE_DUMP_MAX;
+    }
+
+    uint64_t now = hpet_initialized ? hpet_timer_since() : 0;
+
+    /* Copy the biggest sites out, kprintf may allocate so it can't run under profile_lock */
+    spinlock_acquire(&profile_lock);
+    bool taken[PROFILE_SITES] = { false };
+    for (; found < top; found++) {
+        struct alloc_site *best = NULL;
+        for (size_t i = 0; i < PROFILE_SITES; i++) {
+            struct alloc_site *site = &profile_sites[i];
+            if (site->caller == 0 || taken[i]) {
+                continue;
+            }
+            if (best == NULL || site->live_bytes > best->live_bytes) {
+                best = site;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        taken[best - profile_sites] = true;
+        snapshot[found] = *best;
+    }
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        profile_sites[i].allocs_last_dump = profile_sites[i].allocs;
+    }
+    uint64_t elapsed = now - profile_last_dump_ns;
+    profile_last_dump_ns = now;
+    uint64_t dropped = profile_dropped;
+    uint64_t sizes[PROFILE_SIZE_BUCKETS];
+    memcpy(sizes, profile_sizes, sizeof(sizes));
+    spinlock_release(&profile_lock);
+
+    uint64_t rate = kmalloc_profile_sample_rate == 0 ? 1 : kmalloc_profile_sample_rate;
+    kprintf("kmalloc: Top %lu allocation sites (1 in %lu sampled, %lu samples dropped)\n",
+        found, rate, dropped);
+    for (size_t i = 0; i < found; i++) {
+        struct alloc_site *site = &snapshot[i];
+        uint64_t interval = (site->allocs - site->allocs_last_dump) * rate;
+        uint64_t per_second = elapsed != 0 ? (interval * 1000000000) / elapsed : 0;
+        rcu_read_lock();
+        ksym_func_t *func = symbols_search(site->caller);
+        kprintf("kmalloc:   %s+0x%lx: %lu bytes live in %lu objects, %lu allocs (%lu/s)\n",
+            (func == NULL || func->name == NULL) ? "[unknown]" : func->name,
+            func == NULL ? site->caller : site->caller - func->addr,
+            site->live_bytes * rate, site->live_objects * rate, interval, per_second);
+        rcu_read_unlock();
+    }
+
+    /* Size histogram, used to pick slab_sizes */
+    kprintf("kmalloc: Allocation sizes:\n");
+    for (size_t i = 0; i < PROFILE_SIZE_BUCKETS; i++) {
+        if (sizes[i] == 0) {
+            continue;
+        }
+        size_t size = i * PROFILE_SIZE_STEP;
+        struct slab *slab = slab_for(size);
+        if (i == PROFILE_SIZE_BUCKETS - 1 || slab == NULL) {
+            kprintf("kmalloc:   > %lu bytes: %lu allocs, pages\n", size - PROFILE_SIZE_STEP, sizes[i] * rate);
+        } else {
+            kprintf("kmalloc:   %lu-%lu bytes: %lu allocs, slab %lu\n", i == 0 ? 0 : size - PROFILE_SIZE_STEP + 1,
+                size, sizes[i] * rate, slab->ent_size);
+        }
+    }
+}
+#else
+static inline void profile_alloc(void *addr, size_t size, uintptr_t caller) {}
+static inline void profile_free(void *addr) {}
+static inline void profile_resize(void *addr, size_t new_size) {}
+
+void kmalloc_profile_dump(size_t top) {
+    kprintf("kmalloc: Built without KMALLOC_PROFILE\n");
+}
+#endif
+
+void __init slab_init(void) {
+    for (size_t i = 0; i < SIZEOF_ARRAY(slabs); i++) {
+        create_slab(&slabs[i], slab_sizes[i]);
+    }
+
+    shrinker_register(&slab_shrinker);
+}
+
+/**
+ * Allocate whole pages, preceded by a page holding the metadata
+ *
+ * Page allocations are always page aligned, for bigger alignments more frames
+ * are requested and the ones before and after the aligned range are given back.
+ */
+static void *alloc_pages(size_t size, size_t alignment) {
     size_t page_count = DIV_ROUNDUP(size, PAGE_SIZE);
-    void *ret = (void*)(mmu_request_frames(page_count + 1) + HHDM_HIGHER_HALF);
+    size_t slack = alignment > PAGE_SIZE ? alignment / PAGE_SIZE - 1 : 0;
+
+    uintptr_t phys = mmu_request_frames(page_count + 1 + slack);
+    uintptr_t ret = phys + HHDM_HIGHER_HALF;
+
+    if (slack != 0) {
+        uintptr_t aligned = ALIGN_UP(ret + PAGE_SIZE, alignment) - PAGE_SIZE;
+        size_t lead = (aligned - ret) / PAGE_SIZE;
+        if (lead != 0) {
+            mmu_free_frames((void *)phys, lead);
+        }
+        if (slack - lead != 0) {
+            mmu_free_frames((void *)(phys + (lead + page_count + 1) * PAGE_SIZE), slack - lead);
+        }
+        ret = aligned;
+    }
 
     struct alloc_metadata *metadata = (struct alloc_metadata *)ret;
 
     metadata->pages = page_count;
     metadata->size = size;
 
-    return (void*)((uintptr_t)ret + PAGE_SIZE);
+    return (void*)(ret + PAGE_SIZE);
+}
+
+static void *malloc_uninstrumented(size_t size) {
+    struct slab *slab = slab_for(size);
+    if (slab != NULL) {
+        return alloc_from_slab(slab);
+    }
+
+    return alloc_pages(size, PAGE_SIZE);
+}
+
+static void *aligned_alloc_uninstrumented(size_t alignment, size_t size) {
+    /* Alignment has to be a power of two */
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    if (alignment <= CACHELINE_SIZE) {
+        struct slab *slab = slab_for_aligned(size, alignment);
+        if (slab != NULL) {
+            return alloc_from_slab(slab);
+        }
+    }
+
+    return alloc_pages(size, alignment);
+}
+
+void *malloc(size_t size) {
+    void *ret = malloc_uninstrumented(size);
+    profile_alloc(ret, size, (uintptr_t)__builtin_return_address(0));
+    return ret;
+}
+
+/**
+ * kmalloc()
+ *
+ * malloc with allocation flags
+ *
+ * @param size The size of the allocation
+ * @param flags KMALLOC_* flags, KMALLOC_CACHE_ALIGNED gives an object
+ *              starting on a cache line that shares no cache line with another
+ *              allocation, for data written by different cores
+ */
+void *kmalloc(size_t size, int flags) {
+    void *ret;
+    if ((flags & KMALLOC_CACHE_ALIGNED) != 0) {
+        ret = aligned_alloc_uninstrumented(CACHELINE_SIZE, ALIGN_UP(size, CACHELINE_SIZE));
+    } else {
+        ret = malloc_uninstrumented(size);
+    }
+    profile_alloc(ret, size, (uintptr_t)__builtin_return_address(0));
+    return ret;
+}
+
+/**
+ * aligned_alloc()
+ *
+ * Allocate memory aligned to a power of two, the memory is freed with free()
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The size of the allocation
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *ret = aligned_alloc_uninstrumented(alignment, size);
+    profile_alloc(ret, size, (uintptr_t)__builtin_return_address(0));
+    return ret;
+}
+
+/* Same as aligned_alloc() with the arguments of the traditional memalign */
+void *memalign(size_t alignment, size_t size) {
+    void *ret = aligned_alloc_uninstrumented(alignment, size);
+    profile_alloc(ret, size, (uintptr_t)__builtin_return_address(0));
+    return ret;
 }
 
 void *realloc(void *addr, size_t new_size) {
+    uintptr_t caller = (uintptr_t)__builtin_return_address(0);
     if (addr == NULL) {
-        return malloc(new_size);
+        void *ret = malloc_uninstrumented(new_size);
+        profile_alloc(ret, new_size, caller);
+        return ret;
     }
 
     if (((uintptr_t)addr & 0xfff) == 0) {
         struct alloc_metadata *metadata = (struct alloc_metadata *)((uintptr_t)addr - PAGE_SIZE);
         if (DIV_ROUNDUP(metadata->size, PAGE_SIZE) == DIV_ROUNDUP(new_size, PAGE_SIZE)) {
             metadata->size = new_size;
+            profile_resize(addr, new_size);
             return addr;
         }
 
-        void *new_addr = malloc(new_size);
+        void *new_addr = malloc_uninstrumented(new_size);
         if (new_addr == NULL) {
             return NULL;
         }
+        profile_alloc(new_addr, new_size, caller);
 
         if (metadata->size > new_size) {
             memcpy(new_addr, addr, new_size);
@@ -158,16 +685,19 @@ void *realloc(void *addr, size_t new_size) {
     struct slab *slab = slab_header->slab;
 
     if (new_size > slab->ent_size) {
-        void *new_addr = malloc(new_size);
+        void *new_addr = malloc_uninstrumented(new_size);
         if (new_addr == NULL) {
             return NULL;
         }
+        profile_alloc(new_addr, new_size, caller);
 
         memcpy(new_addr, addr, slab->ent_size);
+        profile_free(addr);
         free_in_slab(slab, addr);
         return new_addr;
     }
 
+    profile_resize(addr, new_size);
     return addr;
 }
 
@@ -176,6 +706,8 @@ void free(void *addr) {
         return;
     }
 
+    profile_free(addr);
+
     if (((uintptr_t)addr & 0xfff) == 0) {
         struct alloc_metadata *metadata = (struct alloc_metadata *)((uintptr_t)addr - PAGE_SIZE);
         mmu_free_frames((void *)((uintptr_t)metadata - HHDM_HIGHER_HALF), metadata->pages + 1);
@@ -185,3 +717,83 @@ void free(void *addr) {
     struct slab_header *slab_header = (struct slab_header *)((uintptr_t)addr & ~0xfff);
     free_in_slab(slab_header->slab, addr);
 }
+
+/**
+ * kmalloc_bulk()
+ *
+ * Allocate many objects of the same size. Slab objects are all taken under a
+ * single acquisition of the slab lock.
+ *
+ * @param size The size of every object
+ * @param count The number of objects
+ * @param out Array of at least count pointers that receives the objects
+ *
+ * @returns The number of objects allocated, count unless memory ran out
+ */
+size_t kmalloc_bulk(size_t size, size_t count, void **out) {
+    uintptr_t caller = (uintptr_t)__builtin_return_address(0);
+    struct slab *slab = slab_for(size);
+    size_t i = 0;
+
+    if (slab != NULL) {
+        spinlock_acquire(&slab->lock);
+        for (; i < count; i++) {
+            out[i] = slab_pop(slab);
+        }
+        spinlock_release(&slab->lock);
+    } else {
+        for (; i < count; i++) {
+            out[i] = alloc_pages(size, PAGE_SIZE);
+            if (out[i] == NULL) {
+                break;
+            }
+        }
+    }
+
+    for (size_t j = 0; j < i; j++) {
+        profile_alloc(out[j], size, caller);
+    }
+    return i;
+}
+
+/**
+ * kfree_bulk()
+ *
+ * Free many objects at once. Runs of objects from the same slab are freed
+ * under a single acquisition of the slab lock, NULL entries are skipped.
+ *
+ * @param count The number of pointers
+ * @param ptrs The objects to free
+ */
+void kfree_bulk(size_t count, void **ptrs) {
+    struct slab *locked = NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        void *addr = ptrs[i];
+        if (addr == NULL) {
+            continue;
+        }
+
+        profile_free(addr);
+
+        if (((uintptr_t)addr & 0xfff) == 0) {
+            struct alloc_metadata *metadata = (struct alloc_metadata *)((uintptr_t)addr - PAGE_SIZE);
+            mmu_free_frames((void *)((uintptr_t)metadata - HHDM_HIGHER_HALF), metadata->pages + 1);
+            continue;
+        }
+
+        struct slab *slab = ((struct slab_header *)((uintptr_t)addr & ~0xfff))->slab;
+        if (slab != locked) {
+            if (locked != NULL) {
+                spinlock_release(&locked->lock);
+            }
+            spinlock_acquire(&slab->lock);
+            locked = slab;
+        }
+        slab_push(slab, addr);
+    }
+
+    if (locked != NULL) {
+        spinlock_release(&locked->lock);
+    }
+}
@@ -13,6 +13,8 @@
 #include <kernel/kprintf.h>
 #include <kernel/cpu.h>
 #include <kernel/macros.h>
+#include <kernel/shrinker.h>
+#include <kernel/misc.h>
 
 spinlock_t mmu_lock = SPINLOCK_ZERO;
 
@@ -74,6 +76,13 @@ uint64_t freeMemory = 0; /* Amount of memory free */
 /* A variable to keep track of the next last allocated frame */
 uintptr_t lastFrame = 0;
 
+/* Background reclaim starts below the low watermark and stops at the high one, in frames */
+uint64_t mmu_watermark_low = 0;
+uint64_t mmu_watermark_high = 0;
+
+/* How many times a failing allocation shrinks caches and retries */
+#define MMU_DIRECT_RECLAIM_TRIES 2
+
 /* kernel pagemap */
 pagemap_t* mmu_kernel_pagemap = NULL;
 
@@ -87,6 +96,29 @@ extern char text_start[], text_end[];
 extern char rodata_start[], rodata_end[];
 extern char data_start[], data_end[];
 
+/* Bitmap helpers, mmu_lock must be held */
+static inline bool frame_test(uint64_t index) {
+	return (bitmap[index / 8] & (1 << (index % 8))) != 0;
+}
+
+static inline void frame_set(uint64_t index) {
+	/* Set the bitIndex bit to 1 by ORing it */
+	bitmap[index / 8] |= (1 << (index % 8));
+
+	/* Update memory usage info */
+	usedMemory += 4096;
+	freeMemory -= 4096;
+}
+
+static inline void frame_clear(uint64_t index) {
+	/* Set the bitIndex bit to 0 by ANDing it */
+	bitmap[index / 8] &= ~(1 << (index % 8));
+
+	/* Update memory usage info */
+	usedMemory -= 4096;
+	freeMemory += 4096;
+}
+
 /**
  * mmu_frame_clear()
  * 
@@ -95,23 +127,15 @@ extern char data_start[], data_end[];
  * @param address the frame to set unused
 */
 void mmu_frame_clear(uintptr_t address) {
-	bool int_state = spinlock_acquire(&mmu_lock);
+	spinlock_acquire(&mmu_lock);
     /* Calculate the bitmap index */
     uint64_t index = address / 4096;
 
     /* Check if the index is less than bitmap size */
     if(index < nframes) {
-        uint64_t byteIndex = index / 8;
-        uint8_t bitIndex = index % 8;
-
-        /* Set the bitIndex bit to 1 by ANDing it */
-        bitmap[byteIndex] &= ~(1 << bitIndex);
-
-        /* Update memory usage info */
-        usedMemory -= 4096;
-        freeMemory += 4096;
+        frame_clear(index);
     }
-	spinlock_release(&mmu_lock, int_state);
+	spinlock_release(&mmu_lock);
 }
 
 /**
@@ -122,23 +146,15 @@ void mmu_frame_clear(uintptr_t address) {
  * @param address the frame to set used
 */
 void mmu_frame_set(uintptr_t address) {
-	bool int_state = spinlock_acquire(&mmu_lock);
+	spinlock_acquire(&mmu_lock);
     /* Calculate the bitmap index */
     uint64_t index = address / 4096;
 
     /* Check if the index is less than bitmap size */
     if(index < nframes) {
-        uint64_t byteIndex = index / 8;
-        uint8_t bitIndex = index % 8;
-
-        /* Set the bitIndex bit to 1 by ORing it */
-        bitmap[byteIndex] |= (1 << bitIndex);
-
-        /* Update memory usage info */
-        usedMemory += 4096;
-        freeMemory -= 4096;
+        frame_set(index);
     }
-	spinlock_release(&mmu_lock, int_state);
+	spinlock_release(&mmu_lock);
 }
 
 /**
@@ -149,19 +165,63 @@ void mmu_frame_set(uintptr_t address) {
  * @returns true if being used and false if free
 */
 bool mmu_test_frame(uintptr_t address) {
-	bool int_state = spinlock_acquire(&mmu_lock);
+	spinlock_acquire(&mmu_lock);
     uint64_t index = address / 4096;
+	bool used = false;
 
     /* Check if the address is less than available memory */
     if(index < nframes) {
-        uint64_t byteIndex = index / 8;
-        uint8_t bitIndex = index % 8;
-
-		spinlock_release(&mmu_lock, int_state);
         /* Check if the bit tracking the page is set */
-        return (bitmap[byteIndex] & (1 << bitIndex)) != 0;
+        used = frame_test(index);
     }
-	spinlock_release(&mmu_lock, int_state);
+	spinlock_release(&mmu_lock);
+	return used;
+}
+
+/**
+ * find_free_frames()
+ * 
+ * Finds and marks used num continuous free frames. Starts looking at lastFrame
+ * and wraps around once, so frames freed behind lastFrame are found again.
+ * mmu_lock must be held.
+ * 
+ * @param num The number of frames
+ * @param start Set to the first frame index on success
+ * 
+ * @returns true if the frames were found
+*/
+static bool find_free_frames(uint64_t num, uint64_t* start) {
+	uint64_t free_frames = 0;
+	uint64_t start_frame = 0;
+
+	for(uint64_t i = 0; i < nframes; i++) {
+		uint64_t index = (lastFrame + i) % nframes;
+
+		/* A block can't wrap around the end of memory */
+		if(index == 0) free_frames = 0;
+
+		if(frame_test(index)) {
+			/* This frame is used, reset the counter */
+			free_frames = 0;
+			continue;
+		}
+
+		if(free_frames == 0) {
+			/* This is the start of a new free block */
+			start_frame = index;
+		}
+		free_frames++;
+
+		if(free_frames == num) {
+			/* Found a continuous block of free frames */
+			for(uint64_t j = start_frame; j < start_frame + num; j++) {
+				frame_set(j);
+			}
+			lastFrame = start_frame + num;
+			*start = start_frame;
+			return true;
+		}
+	}
 	return false;
 }
 
@@ -174,56 +234,37 @@ bool mmu_test_frame(uintptr_t address) {
  * @returns The address of the next free frame
 */
 uintptr_t mmu_request_frame(void) {
-    /* Loop through all frames */
-    for(; lastFrame < nframes; lastFrame++) {
-        /* Calculate the address (i * 4096) */
-        uintptr_t address = lastFrame * PAGE_SIZE;
-
-        /* If the frame is free then set it to used and return it */
-        if(!mmu_test_frame(address)) {
-            mmu_frame_set(address);
-            return address;
-        }
-    }
-	kprintf("mmu: Fatal: Out of memory!!\n");
-	fatal();
-    return 0; /* TODO: Use page file */
+	return mmu_request_frames(1);
 }
 
 /**
  * mmu_request_frames()
  * 
- * Requests multiple frames from mmu_request_frame
+ * Requests multiple continuous frames. Wakes the background reclaim when
+ * free memory drops below the low watermark and shrinks caches directly
+ * before failing.
  * 
  * @param num The number of frames to allocate
  */
 uintptr_t mmu_request_frames(uint64_t num) {
     if(num < 1) return 0; /* Return if 0 */
 
-    uint64_t start_frame = 0;
-    uint64_t free_frames = 0;
-    for(; lastFrame < nframes; lastFrame++) {
-        uintptr_t address = lastFrame * PAGE_SIZE;
+	for(int attempt = 0; attempt <= MMU_DIRECT_RECLAIM_TRIES; attempt++) {
+		uint64_t start = 0;
 
-        if(!mmu_test_frame(address)) {
-            if(free_frames == 0) {
-                /* This is the start of a new free block */
-                start_frame = lastFrame;
-            }
-            free_frames++;
-
-            if(free_frames == num) {
-                /* Found a continuous block of free frames */
-                for(uint64_t i = start_frame; i < start_frame + num; i++) {
-                    mmu_frame_set(i * PAGE_SIZE);
-                }
-                return start_frame * PAGE_SIZE;
-            }
-        } else {
-            /* This frame is used, reset the counter */
-            free_frames = 0;
-        }
-    }
+		spinlock_acquire(&mmu_lock);
+		bool found = find_free_frames(num, &start);
+		uint64_t free_frames = freeMemory / PAGE_SIZE;
+		spinlock_release(&mmu_lock);
+
+		if(found) {
+			if(free_frames < mmu_watermark_low) mmu_reclaim_wake();
+			return start * PAGE_SIZE;
+		}
+
+		/* Ask for some more than needed, the memory may be fragmented */
+		if(shrink_caches(num + mmu_watermark_low, true) == 0) break;
+	}
 	kprintf("mmu: Fatal: Out of memory!!\n");
 	fatal();
     return 0; /* TODO: Use page file */
@@ -238,11 +279,10 @@ uintptr_t mmu_request_frames(uint64_t num) {
  * @param pages The number of pages to free
 */
 void mmu_free_frames(void* addr, uint64_t pages) {
-	bool int_state = spinlock_acquire(&mmu_lock);
+	/* mmu_frame_clear takes mmu_lock itself, holding it here would deadlock */
 	for(uint64_t i = 0; i < pages; i++) {
 		mmu_frame_clear((uintptr_t)((uintptr_t)addr + (i * 4096)));
 	}
-	spinlock_release(&mmu_lock, int_state);
 }
 
 /**
@@ -419,6 +459,10 @@ void __init mmu_init(void) {
 		mmu_frame_set((uintptr_t)(bitmap + (i * 4096)));
 	}
 
+	/* Keep about 1/128 of the free memory (at least 256KiB) for reclaim to work with */
+	mmu_watermark_low = MAX((freeMemory / PAGE_SIZE) / 128, 64);
+	mmu_watermark_high = mmu_watermark_low * 2;
+
 	/* Assign a page in the hhdm */
 	mmu_kernel_pagemap = (pagemap_t*)(mmu_request_frame() + HHDM_HIGHER_HALF);
 
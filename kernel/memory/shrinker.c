@@ -0,0 +1,133 @@
+/**
+ * shrinker.c: Memory pressure handling
+ * 
+ * Caches that can give memory back register a shrinker. When the frame
+ * allocator drops below its low watermark an unbound worker runs the
+ * shrinkers until the high watermark is reached again, and when an
+ * allocation can not be satisfied at all the shrinkers are run directly
+ * before giving up.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <kernel/shrinker.h>
+#include <kernel/spinlock.h>
+#include <kernel/kprintf.h>
+#include <kernel/mmu.h>
+#include <kernel/workqueue.h>
+
+/* Registered shrinkers, protected by shrinker_lock */
+static struct shrinker* shrinkers = NULL;
+static spinlock_t shrinker_lock = SPINLOCK_ZERO;
+
+/* Set when the free frames dropped below mmu_watermark_low */
+static bool reclaim_wanted = false;
+
+static void reclaim_work_func(struct work* work);
+static struct work reclaim_work = WORK_INIT(reclaim_work_func);
+
+/* Free memory in bytes, kept up to date by mmu.c */
+extern uint64_t freeMemory;
+
+/* Add a cache to the list of caches that get shrunk under memory pressure */
+void shrinker_register(struct shrinker* shrinker) {
+	spinlock_acquire(&shrinker_lock);
+	shrinker->calls = 0;
+	shrinker->requested = 0;
+	shrinker->reclaimed = 0;
+	shrinker->next = shrinkers;
+	shrinkers = shrinker;
+	spinlock_release(&shrinker_lock);
+}
+
+/* Remove a cache from the shrinker list */
+void shrinker_unregister(struct shrinker* shrinker) {
+	spinlock_acquire(&shrinker_lock);
+	for(struct shrinker** it = &shrinkers; *it != NULL; it = &(*it)->next) {
+		if(*it == shrinker) {
+			*it = shrinker->next;
+			break;
+		}
+	}
+	spinlock_release(&shrinker_lock);
+}
+
+/* Ask every shrinker matching the pass for frames until nr_frames are freed */
+static uint64_t shrink_pass(uint64_t nr_frames, bool last_resort) {
+	uint64_t freed = 0;
+	for(struct shrinker* shrinker = shrinkers; shrinker != NULL && freed < nr_frames; shrinker = shrinker->next) {
+		if(((shrinker->flags & SHRINKER_LAST_RESORT) != 0) != last_resort) continue;
+
+		uint64_t available = shrinker->count(shrinker);
+		if(available == 0) continue;
+
+		uint64_t want = nr_frames - freed;
+		if(want > available) want = available;
+
+		uint64_t got = shrinker->scan(shrinker, want);
+		shrinker->calls++;
+		shrinker->requested += want;
+		shrinker->reclaimed += got;
+		freed += got;
+	}
+	return freed;
+}
+
+/**
+ * shrink_caches()
+ * 
+ * Runs the registered shrinkers
+ * 
+ * @param nr_frames The number of frames wanted
+ * @param direct If an allocation is waiting on this, allows SHRINKER_LAST_RESORT caches to be shrunk
+ * 
+ * @returns The number of frames freed
+*/
+uint64_t shrink_caches(uint64_t nr_frames, bool direct) {
+	spinlock_acquire(&shrinker_lock);
+	uint64_t freed = shrink_pass(nr_frames, false);
+	if(direct && freed < nr_frames) {
+		freed += shrink_pass(nr_frames - freed, true);
+	}
+	spinlock_release(&shrinker_lock);
+	return freed;
+}
+
+/* Ask the background reclaim to run, called by the frame allocator below the low watermark */
+void mmu_reclaim_wake(void) {
+	__atomic_store_n(&reclaim_wanted, true, __ATOMIC_RELEASE);
+	queue_work(&system_unbound_wq, &reclaim_work);
+}
+
+static void reclaim_work_func(struct work* work) {
+	mmu_reclaim_background();
+}
+
+/**
+ * mmu_reclaim_background()
+ * 
+ * Background reclaim, shrinks caches until the high watermark is reached.
+ * Run from the unbound workqueue, does nothing unless the frame allocator asked for it.
+*/
+void mmu_reclaim_background(void) {
+	if(!__atomic_load_n(&reclaim_wanted, __ATOMIC_RELAXED)) return;
+
+	/* Only one core has to do the work */
+	if(!__atomic_exchange_n(&reclaim_wanted, false, __ATOMIC_ACQUIRE)) return;
+
+	uint64_t free_frames = __atomic_load_n(&freeMemory, __ATOMIC_RELAXED) / PAGE_SIZE;
+	if(free_frames >= mmu_watermark_high) return;
+
+	shrink_caches(mmu_watermark_high - free_frames, false);
+}
+
+/* Print how much every shrinker was asked for and gave back */
+void shrinker_print_stats(void) {
+	spinlock_acquire(&shrinker_lock);
+	for(struct shrinker* shrinker = shrinkers; shrinker != NULL; shrinker = shrinker->next) {
+		kprintf("shrinker: %s: %lu calls, %lu frames requested, %lu frames reclaimed, %lu reclaimable now\n",
+			shrinker->name, shrinker->calls, shrinker->requested, shrinker->reclaimed, shrinker->count(shrinker));
+	}
+	spinlock_release(&shrinker_lock);
+}
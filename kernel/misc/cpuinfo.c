@@ -60,14 +60,11 @@ void __init cpuinfo_init(void) {
 
         cpu_info->cpuName[48] = '\0'; // Null-terminate the string
 		cpu_info->cpuName = strctrim(cpu_info->cpuName, ' ');
-        kprintf("%s, ", cpu_info->cpuName);
+        kprintf("%s\n", cpu_info->cpuName);
     } else {
-        kprintf("Unknown, ");
+        kprintf("Unknown\n");
     }
 
-	__get_cpuid(0x1, &eax, &ebx, &ecx, &edx);
-
-	uint32_t cores = (ebx >> 16) & 0xFF;
-	cpu_info->coreCount = cores;
-	kprintf("%d cores\n", cores);
+	/* Counted from the topology of the cores once they are known */
+	cpu_info->coreCount = 0;
 }
\ No newline at end of file
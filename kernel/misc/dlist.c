@@ -9,6 +9,9 @@
 #include <kernel/mmu.h>
 #include <kernel/kprintf.h>
 
+/* Number of nodes allocated with one kmalloc_bulk call by dlist_push_bulk */
+#define DLIST_PUSH_BATCH 32
+
 /* Create empty list */
 node_t* dlist_create_empty() {
     node_t* head = (node_t*)malloc(sizeof(node_t));
@@ -20,6 +23,19 @@ node_t* dlist_create_empty() {
     return head;
 }
 
+/* Create count empty lists at once */
+void dlist_create_empty_bulk(node_t** heads, size_t count) {
+    size_t allocated = kmalloc_bulk(sizeof(node_t), count, (void**)heads);
+    for (size_t i = 0; i < allocated; i++) {
+        heads[i]->previous = NULL;
+        heads[i]->value = NULL;
+        heads[i]->next = NULL;
+    }
+    for (size_t i = allocated; i < count; i++) {
+        heads[i] = NULL;
+    }
+}
+
 /* Get length of list */
 uint64_t dlist_get_length(node_t* head) {
     uint64_t length = 0;
@@ -49,6 +65,35 @@ void dlist_push(node_t* head, void* value) {
     }
 }
 
+/* Push count values to the end of the list, allocating all the nodes at once */
+void dlist_push_bulk(node_t* head, void** values, size_t count) {
+    node_t* nodes[DLIST_PUSH_BATCH];
+
+    // Find the last node in the list
+    node_t* current = head;
+    while (current->next != NULL) {
+        current = current->next;
+    }
+
+    while (count > 0) {
+        size_t batch = count < DLIST_PUSH_BATCH ? count : DLIST_PUSH_BATCH;
+        size_t allocated = kmalloc_bulk(sizeof(node_t), batch, (void**)nodes);
+
+        for (size_t i = 0; i < allocated; i++) {
+            nodes[i]->value = *values++;
+            nodes[i]->next = NULL;
+            nodes[i]->previous = current;
+            current->next = nodes[i];
+            current = nodes[i];
+        }
+
+        if (allocated != batch) {
+            return;
+        }
+        count -= batch;
+    }
+}
+
 /* Pop value from the end of the list */
 node_t* dlist_pop(node_t* head) {
     node_t* current = head;
@@ -136,12 +181,28 @@ void dlist_destroy_item(node_t* head, uint64_t index) {
     }
 }
 
+/* Number of pointers freed with one kfree_bulk call when destroying a list */
+#define DLIST_FREE_BATCH 32
+
 /* Free the entire array */
 void dlist_destroy_array(node_t* head) {
-    while (head->next != NULL) {
-        dlist_destroy_item(head, 0);
+    void* batch[DLIST_FREE_BATCH];
+    size_t count = 0;
+
+    node_t* current = head->next;
+    while (current != NULL) {
+        node_t* next = current->next;
+        batch[count++] = current->value;
+        batch[count++] = current;
+        if (count == DLIST_FREE_BATCH) {
+            kfree_bulk(count, batch);
+            count = 0;
+        }
+        current = next;
     }
-    free(head);
+
+    batch[count++] = head;
+    kfree_bulk(count, batch);
 }
 
 /* Use when only accessing the value is desired instead of removing (popping) the value at an idex */
@@ -0,0 +1,247 @@
+/**
+ * rbtree.c: Red-black tree
+ *
+ * Nodes are embedded in the structures they order and missing children are
+ * NULL, so inserting and erasing never allocate. Both are O(log n)
+ */
+
+#include <kernel/rbtree.h>
+
+/* Point the parent of old, or the root, at new */
+static void rb_replace_child(struct rb_root* root, struct rb_node* parent, struct rb_node* old, struct rb_node* new) {
+	if(parent == NULL) {
+		root->node = new;
+	} else if(parent->left == old) {
+		parent->left = new;
+	} else {
+		parent->right = new;
+	}
+}
+
+static void rb_rotate_left(struct rb_root* root, struct rb_node* node) {
+	struct rb_node* right = node->right;
+	node->right = right->left;
+	if(right->left) {
+		right->left->parent = node;
+	}
+	right->parent = node->parent;
+	rb_replace_child(root, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_root* root, struct rb_node* node) {
+	struct rb_node* left = node->left;
+	node->left = left->right;
+	if(left->right) {
+		left->right->parent = node;
+	}
+	left->parent = node->parent;
+	rb_replace_child(root, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+}
+
+static inline bool rb_is_red(struct rb_node* node) {
+	return node != NULL && node->red;
+}
+
+/**
+ * rb_insert_color: Rebalance the tree after rb_link_node()
+ *
+ * @param node: The node just linked
+ * @param root: The tree
+ */
+void rb_insert_color(struct rb_node* node, struct rb_root* root) {
+	struct rb_node* parent;
+	while((parent = node->parent) != NULL && parent->red) {
+		/* A red parent is never the root, so there is a grandparent */
+		struct rb_node* grandparent = parent->parent;
+
+		if(parent == grandparent->left) {
+			struct rb_node* uncle = grandparent->right;
+			if(rb_is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->right) {
+				rb_rotate_left(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rb_rotate_right(root, grandparent);
+		} else {
+			struct rb_node* uncle = grandparent->left;
+			if(rb_is_red(uncle)) {
+				parent->red = false;
+				uncle->red = false;
+				grandparent->red = true;
+				node = grandparent;
+				continue;
+			}
+
+			if(node == parent->left) {
+				rb_rotate_right(root, parent);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			grandparent->red = true;
+			rb_rotate_left(root, grandparent);
+		}
+	}
+	root->node->red = false;
+}
+
+/* node took the place of a removed black node, node may be NULL so its parent is passed too */
+static void rb_erase_color(struct rb_root* root, struct rb_node* node, struct rb_node* parent) {
+	while(node != root->node && !rb_is_red(node)) {
+		/* node is short one black node, so its sibling exists */
+		if(node == parent->left) {
+			struct rb_node* sibling = parent->right;
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rb_rotate_left(root, parent);
+				sibling = parent->right;
+			}
+
+			if(!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if(!rb_is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rb_rotate_right(root, sibling);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rb_rotate_left(root, parent);
+			node = root->node;
+		} else {
+			struct rb_node* sibling = parent->left;
+			if(sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rb_rotate_right(root, parent);
+				sibling = parent->left;
+			}
+
+			if(!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+
+			if(!rb_is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rb_rotate_left(root, sibling);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rb_rotate_right(root, parent);
+			node = root->node;
+		}
+	}
+
+	if(node) {
+		node->red = false;
+	}
+}
+
+/**
+ * rb_erase: Remove a node from the tree
+ *
+ * @param node: The node, must be in the tree
+ * @param root: The tree
+ */
+void rb_erase(struct rb_node* node, struct rb_root* root) {
+	struct rb_node* child;
+	struct rb_node* parent;
+	bool red;
+
+	if(node->left == NULL || node->right == NULL) {
+		/* At most one child, it takes the place of the node */
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		red = node->red;
+		rb_replace_child(root, parent, node, child);
+		if(child) {
+			child->parent = parent;
+		}
+	} else {
+		/* Two children, the next node in order takes its place */
+		struct rb_node* next = node->right;
+		while(next->left) {
+			next = next->left;
+		}
+
+		child = next->right;
+		red = next->red;
+		if(next->parent == node) {
+			parent = next;
+		} else {
+			parent = next->parent;
+			parent->left = child;
+			if(child) {
+				child->parent = parent;
+			}
+			next->right = node->right;
+			next->right->parent = next;
+		}
+
+		rb_replace_child(root, node->parent, node, next);
+		next->parent = node->parent;
+		next->left = node->left;
+		next->left->parent = next;
+		next->red = node->red;
+	}
+
+	if(!red) {
+		rb_erase_color(root, child, parent);
+	}
+}
+
+/* Get the smallest node of the tree, NULL if it is empty */
+struct rb_node* rb_first(struct rb_root* root) {
+	struct rb_node* node = root->node;
+	if(node == NULL) {
+		return NULL;
+	}
+	while(node->left) {
+		node = node->left;
+	}
+	return node;
+}
+
+/* Get the node after this one in order, NULL if it is the last */
+struct rb_node* rb_next(struct rb_node* node) {
+	if(node->right) {
+		node = node->right;
+		while(node->left) {
+			node = node->left;
+		}
+		return node;
+	}
+
+	while(node->parent && node == node->parent->right) {
+		node = node->parent;
+	}
+	return node->parent;
+}
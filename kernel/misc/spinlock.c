@@ -1,14 +1,17 @@
 /**
  * spinlock.c: Simple spinlock implementation
+ *
+ * Holding any spinlock disables preemption (see preempt.c). Only the irqsave
+ * variants disable interrupts too, they are needed for locks an interrupt
+ * handler may take while the interrupted code holds them
  */
 
 #include <kernel/spinlock.h>
 #include <kernel/cpu.h>
+#include <kernel/preempt.h>
 
-/* Acquire spinlock, deadlocks after counter is exhausted */
-bool spinlock_acquire(spinlock_t *lock) {
-	bool int_state = interrupt_state();
-	disable_interrupts();
+/* Spin until the lock is ours, deadlocks after counter is exhausted */
+static void spinlock_spin(spinlock_t* lock) {
 	volatile size_t deadlock_counter = 0;
     for (;;) {
         if (spinlock_test_and_acq(lock)) break;
@@ -19,15 +22,60 @@ bool spinlock_acquire(spinlock_t *lock) {
         asm volatile ("pause");
 #endif
     }
-    return int_state;
+    return;
 
 deadlock:
 	asm ("1: hlt; jmp 1b");
-	return 0;
 }
 
-/* Release spinlock */
-void spinlock_release(spinlock_t* lock, bool int_state) {
+/* Acquire spinlock with preemption disabled */
+void spinlock_acquire(spinlock_t* lock) {
+	preempt_count_add(__builtin_return_address(0));
+	spinlock_spin(lock);
+}
+
+/* Acquire spinlock only if it is free */
+bool spinlock_try_acquire(spinlock_t* lock) {
+	preempt_count_add(__builtin_return_address(0));
+	if (!spinlock_test_and_acq(lock)) {
+		preempt_enable_no_resched();
+		return false;
+	}
+	return true;
+}
+
+/* Release spinlock, the core may be preempted right away */
+void spinlock_release(spinlock_t* lock) {
+	__atomic_store_n(&lock->lock, 0, __ATOMIC_SEQ_CST);
+	preempt_enable();
+}
+
+/* Acquire spinlock with interrupts disabled, returns if they were enabled */
+bool spinlock_acquire_irqsave(spinlock_t* lock) {
+	bool int_state = interrupt_state();
+	disable_interrupts();
+	preempt_count_add(__builtin_return_address(0));
+	spinlock_spin(lock);
+	return int_state;
+}
+
+/* Acquire spinlock with interrupts disabled only if it is free, int_state is set when it was acquired */
+bool spinlock_try_acquire_irqsave(spinlock_t* lock, bool* int_state) {
+	bool state = interrupt_state();
+	disable_interrupts();
+	preempt_count_add(__builtin_return_address(0));
+	if (!spinlock_test_and_acq(lock)) {
+		preempt_enable_no_resched();
+		if (state == true) enable_interrupts();
+		return false;
+	}
+	*int_state = state;
+	return true;
+}
+
+/* Release spinlock and enable interrupts if they were enabled before */
+void spinlock_release_irqrestore(spinlock_t* lock, bool int_state) {
 	__atomic_store_n(&lock->lock, 0, __ATOMIC_SEQ_CST);
 	if (int_state == true) enable_interrupts();
-}
\ No newline at end of file
+	preempt_enable();
+}
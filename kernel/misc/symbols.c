@@ -2,6 +2,9 @@
  * symbols.c: Gets symbols defined in the kernel, basically, the kernel indexes itself.
  * 
  * Used for stacktrace to know the names of functions at addresses.
+ *
+ * The function table may be dropped under memory pressure. Readers look it up
+ * inside rcu_read_lock(), it is freed once none of them can still see it.
  */
 
 #include <stdint.h>
@@ -14,6 +17,8 @@
 #include <kernel/symbols.h>
 #include <string.h>
 #include <kernel/macros.h>
+#include <kernel/shrinker.h>
+#include <kernel/rcu.h>
 
 extern void fatal(void);
 
@@ -31,19 +36,62 @@ Elf64_Shdr* symbol_table_hdr = NULL;
 Elf64_Sym* symbol_table = NULL;
 char* symbol_string_table = NULL;
 uint64_t symbol_count = 0;
-uint64_t function_count = 0;
 
 void* debug_info_start = NULL;
 
-/* Store out functions */
-ksym_func_t* function_table = NULL;
+/* Store out functions, published with rcu_assign_pointer() and NULL once dropped */
+struct ksym_table* function_table = NULL;
 
 /* Macros to make tghe code cleaner */
 #define GET_NAME(s, n) ((const char*)((uintptr_t)s + n))
 #define JMP_BYTES(f, o) ((uintptr_t)f + o)
 
-/* Not the end of the world if we dont have symbols */
-static bool symbols_present = false;
+/* Pages held by the function table, including the page of malloc metadata */
+static uint64_t symbols_table_pages(struct ksym_table* table) {
+	if(table == NULL || table->size < PAGE_SIZE) return 0;
+	return (table->size + PAGE_SIZE - 1) / PAGE_SIZE + 1;
+}
+
+/* Only the shrinker changes the table, and the shrinker lock is held */
+static uint64_t symbols_shrinker_count(struct shrinker* shrinker) {
+	if(!rcu_ready) return 0;
+	return symbols_table_pages(function_table);
+}
+
+/* Runs from a workqueue, not from the reclaim path, so it may print */
+static void symbols_free_table(struct rcu_head* head) {
+	struct ksym_table* table = (struct ksym_table*)head;
+	uint64_t pages = symbols_table_pages(table);
+	free(table);
+	kprintf("symbols: Dropped the function table to reclaim %lu pages\n", pages);
+}
+
+/* Drop the function table, stack traces print addresses only from then on */
+static uint64_t symbols_shrinker_scan(struct shrinker* shrinker, uint64_t nr_frames) {
+	struct ksym_table* table = function_table;
+	uint64_t pages = symbols_shrinker_count(shrinker);
+	if(pages == 0 || nr_frames == 0) return 0;
+
+	/* Readers that still see the table keep it until they leave their read-side section */
+	rcu_assign_pointer(function_table, NULL);
+	call_rcu(&table->rcu, symbols_free_table);
+	return pages;
+}
+
+static struct shrinker symbols_shrinker = {
+	.name = "symbols",
+	.count = symbols_shrinker_count,
+	.scan = symbols_shrinker_scan,
+	.flags = SHRINKER_LAST_RESORT,
+};
+
+/* Get the command line the kernel was booted with, NULL if the bootloader gave none */
+const char* kernel_cmdline(void) {
+	if(kfile_request.response == NULL) {
+		return NULL;
+	}
+	return kfile_request.response->kernel_file->cmdline;
+}
 
 /* Indexes the kernel's ELF file to get funtion names */
 /* TODO: Move ELF parsing into a seperate file dedicated to ELF parsing */
@@ -73,46 +121,54 @@ void __init symbols_init(void) {
 	/* Print if we dont have symbols and return (nothing left) */
 	if(symbol_table == NULL || symbol_string_table == NULL) {
 		kprintf("The kernel file does not contain `.symtab` and `.strtab` sections!\n");
-		symbols_present = false;
 		return;
 	}
-	
-	/* At this point we are certain to have symbols */
-	symbols_present = true;
 
 	/* Array of all the functions */
-	function_table = malloc(sizeof(ksym_func_t) * (symbol_count - 1));
+	size_t size = sizeof(struct ksym_table) + sizeof(ksym_func_t) * (symbol_count - 1);
+	struct ksym_table* table = malloc(size);
+	table->size = size;
+	table->count = 0;
 
 	/* Add all the functions to the array, start from 1 (ignore the first null entry) */
 	for(uint64_t i = 1; i < symbol_count - 1; i++) {
 		/* Only add entry if symbol is a function */
 		if(ELF64_ST_TYPE(symbol_table[i].st_info) == STT_FUNC) {
-			function_table[function_count] = (ksym_func_t){
+			table->funcs[table->count] = (ksym_func_t){
 				.name = (char*)GET_NAME(symbol_string_table, symbol_table[i].st_name),
 				.addr = symbol_table[i].st_value
 			};
-			function_table[function_count - 1].next = &function_table[function_count];
-			function_count++;
+			if(table->count > 0) {
+				table->funcs[table->count - 1].next = &table->funcs[table->count];
+			}
+			table->count++;
 		}
 	}
 
-	kprintf("symbols: Found %lu functions in kernel\n", function_count);
+	/* The count is only read through the table, a reader never pairs it with another table */
+	rcu_assign_pointer(function_table, table);
+	kprintf("symbols: Found %lu functions in kernel\n", table->count);
+
+	/* Names in stack traces are nice to have, give the table up before running out of memory */
+	shrinker_register(&symbols_shrinker);
 }
 
 /**
  * symbols_search
  * 
- * Search a symbol closest lower than address
+ * Search a symbol closest lower than address. Called inside rcu_read_lock(),
+ * the symbol stays valid until rcu_read_unlock()
  * 
  * @param address The address to match
 */
 ksym_func_t* symbols_search(uintptr_t address) {
-	if(symbols_present == false) return NULL;
+	struct ksym_table* table = rcu_dereference(function_table);
+	if(table == NULL) return NULL;
     ksym_func_t* closest_symbol = (ksym_func_t*)((uint64_t)symbol_table);
 
-	for(uint64_t i = 0; i < function_count; i++) {
-		if(function_table[i].addr <= address && function_table[i].addr > closest_symbol->addr) {
-			closest_symbol = &function_table[i];
+	for(uint64_t i = 0; i < table->count; i++) {
+		if(table->funcs[i].addr <= address && table->funcs[i].addr > closest_symbol->addr) {
+			closest_symbol = &table->funcs[i];
 		}
 	}
 
@@ -124,10 +180,13 @@ void stacktrace(void) {
 	stack_frame_t* stack;
 	asm volatile ("movq %%rbp, %0" : "=r"(stack));
 	kprintf("Stack trace:\n");
+	rcu_read_lock();
 	while(stack->rip != 0) {
 		ksym_func_t* func = symbols_search(stack->rip);
-		char* name = func->name;
-		kprintf("\t<%p> [%s + 0x%lx]\n", stack->rip, (name == NULL) ? "[unknown]" : name, stack->rip - func->addr);
+		char* name = (func == NULL) ? NULL : func->name;
+		kprintf("\t<%p> [%s + 0x%lx]\n", stack->rip, (name == NULL) ? "[unknown]" : name,
+			(func == NULL) ? 0 : stack->rip - func->addr);
 		stack = stack->rbp;
 	}
+	rcu_read_unlock();
 }
\ No newline at end of file
@@ -19,7 +19,7 @@ const char *__kernel_version_format = "%d.%d.%d-%s";
 /* Version numbers */
 int __kernel_version_major = 0;
 int __kernel_version_minor = 0;
-int __kernel_version_lower = 1;
+int __kernel_version_lower = 2;
 
 /* Kernel build suffix, which doesn't necessarily
  * mean anything, but can be used to distinguish
@@ -0,0 +1,351 @@
+/**
+ * async.c: Stackless tasks run by per core executors
+ *
+ * A task is a poll function and the state it keeps between calls, written as
+ * a coroutine with the ASYNC_* macros. It runs until it has to wait, then
+ * returns and is polled again once something wakes it. Waiting costs no
+ * stack and no thread, only the structure embedding the task.
+ *
+ * Every core has an executor thread running the tasks queued on it. A woken
+ * task is queued on the executor it last ran on, and an executor with nothing
+ * to run steals tasks from the busiest one. Queueing onto an executor that is
+ * already busy wakes an idle one to steal from it, the same way the scheduler
+ * wakes idle cores.
+ *
+ * Wakes may come from anywhere, including interrupt handlers and timers. A
+ * task woken while it is being polled is polled again right after, so a wake
+ * between checking a condition and returning is never lost.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/async.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/kprintf.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <kernel/isolation.h>
+
+/* One executor per core, NULL until async_init() */
+static struct async_executor* executors = NULL;
+
+/* Joiner of a task that is finishing, no more can watch it */
+#define JOINER_CLOSED ((struct async_task*)1)
+
+void async_task_init(struct async_task* task, async_poll_t poll) {
+	task->poll = poll;
+	task->resume = 0;
+	task->state = ASYNC_IDLE;
+	task->next = NULL;
+	task->core = coreCount;
+	task->joiner = NULL;
+	task->result = 0;
+}
+
+/* Wake an idle executor other than busy so it steals from busy */
+static void executor_kick_idle(uint64_t busy) {
+	for(uint64_t i = 1; i < coreCount; i++) {
+		struct async_executor* ex = &executors[(busy + i) % coreCount];
+		if(ex->idle && !core_isolated(ex->core)) {
+			wake_up_one(&ex->wait);
+			return;
+		}
+	}
+}
+
+/* Put a task on the queue of an executor and make sure someone runs it */
+static void executor_enqueue(struct async_executor* ex, struct async_task* task) {
+	bool int_state = spinlock_acquire_irqsave(&ex->lock);
+	task->next = NULL;
+	if(ex->tail != NULL) {
+		ex->tail->next = task;
+	} else {
+		ex->head = task;
+	}
+	ex->tail = task;
+	uint64_t queued = ++ex->nr_queued;
+	spinlock_release_irqrestore(&ex->lock, int_state);
+
+	if(ex->idle) {
+		wake_up_one(&ex->wait);
+	} else if(queued > 1) {
+		executor_kick_idle(ex->core);
+	}
+}
+
+/* Take the first task off the queue of an executor, the caller holds its lock */
+static struct async_task* executor_dequeue_locked(struct async_executor* ex) {
+	struct async_task* task = ex->head;
+	if(task == NULL) {
+		return NULL;
+	}
+
+	ex->head = task->next;
+	if(ex->head == NULL) {
+		ex->tail = NULL;
+	}
+	task->next = NULL;
+	ex->nr_queued--;
+	return task;
+}
+
+static struct async_task* executor_dequeue(struct async_executor* ex) {
+	bool int_state = spinlock_acquire_irqsave(&ex->lock);
+	struct async_task* task = executor_dequeue_locked(ex);
+	spinlock_release_irqrestore(&ex->lock, int_state);
+	return task;
+}
+
+/* Take a task from the executor with the most queued, gives up on one whose lock is taken */
+static struct async_task* executor_steal(struct async_executor* self) {
+	/* Isolated cores only run the tasks spawned onto them */
+	if(core_isolated(self->core)) {
+		return NULL;
+	}
+
+	struct async_executor* busiest = NULL;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct async_executor* ex = &executors[i];
+		if(ex != self && ex->nr_queued != 0 && (busiest == NULL || ex->nr_queued > busiest->nr_queued)) {
+			busiest = ex;
+		}
+	}
+	if(busiest == NULL) {
+		return NULL;
+	}
+
+	bool int_state;
+	if(!spinlock_try_acquire_irqsave(&busiest->lock, &int_state)) {
+		return NULL;
+	}
+	struct async_task* task = executor_dequeue_locked(busiest);
+	spinlock_release_irqrestore(&busiest->lock, int_state);
+
+	if(task != NULL) {
+		self->stolen++;
+	}
+	return task;
+}
+
+/* Poll a task once and queue it again if it was woken meanwhile */
+static void executor_run(struct async_executor* ex, struct async_task* task) {
+	task->core = ex->core;
+	__atomic_store_n(&task->state, ASYNC_RUNNING, __ATOMIC_SEQ_CST);
+	ex->polls++;
+
+	if(task->poll(task) == ASYNC_READY) {
+		ex->completed++;
+
+		/* The task may be freed as soon as it is seen done, so it is not touched after */
+		bool int_state = interrupt_toggle(false);
+		struct async_task* joiner = __atomic_exchange_n(&task->joiner, JOINER_CLOSED, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&task->state, ASYNC_DONE, __ATOMIC_SEQ_CST);
+		interrupt_toggle(int_state);
+
+		if(joiner != NULL) {
+			async_wake(joiner);
+		}
+		return;
+	}
+
+	uint32_t state = ASYNC_RUNNING;
+	if(!__atomic_compare_exchange_n(&task->state, &state, ASYNC_IDLE, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		/* Woken while it ran */
+		__atomic_store_n(&task->state, ASYNC_QUEUED, __ATOMIC_SEQ_CST);
+		executor_enqueue(ex, task);
+	}
+}
+
+static void executor_thread(void* arg) {
+	struct async_executor* ex = arg;
+	for(;;) {
+		struct async_task* task = NULL;
+		for(uint64_t i = 0; i < ASYNC_BATCH; i++) {
+			task = executor_dequeue(ex);
+			if(task == NULL) {
+				break;
+			}
+			executor_run(ex, task);
+		}
+		if(task != NULL) {
+			continue;
+		}
+
+		task = executor_steal(ex);
+		if(task != NULL) {
+			executor_run(ex, task);
+			continue;
+		}
+
+		/* Queueing onto us wakes us, queueing onto a busy executor wakes one that is idle */
+		ex->idle = true;
+		wait_event(&ex->wait, ex->nr_queued != 0);
+		ex->idle = false;
+	}
+}
+
+/**
+ * async_wake: Make a waiting task run again
+ *
+ * Does nothing if the task is already queued or done. May be called from
+ * interrupt handlers
+ *
+ * @param task: The task
+ */
+void async_wake(struct async_task* task) {
+	uint32_t state = __atomic_load_n(&task->state, __ATOMIC_SEQ_CST);
+	for(;;) {
+		if(state == ASYNC_IDLE) {
+			if(__atomic_compare_exchange_n(&task->state, &state, ASYNC_QUEUED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				uint64_t core = task->core < coreCount ? task->core : this_core()->id;
+				executor_enqueue(&executors[core], task);
+				return;
+			}
+		} else if(state == ASYNC_RUNNING) {
+			if(__atomic_compare_exchange_n(&task->state, &state, ASYNC_WOKEN, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				return;
+			}
+		} else {
+			return;
+		}
+	}
+}
+
+/**
+ * async_spawn_on: Start a task on the executor of a core
+ *
+ * @param core: The core, other executors may still steal the task
+ * @param task: The task, set up with async_task_init()
+ */
+void async_spawn_on(uint64_t core, struct async_task* task) {
+	if(executors == NULL) {
+		panic("async: Task spawned before async_init()", NULL);
+	}
+
+	task->core = core < coreCount ? core : this_core()->id;
+	async_wake(task);
+}
+
+/* Start a task on the executor of this core */
+void async_spawn(struct async_task* task) {
+	async_spawn_on(this_core()->id, task);
+}
+
+/* Wake task once child is done, a task has only one joiner */
+void async_watch(struct async_task* task, struct async_task* child) {
+	struct async_task* joiner = __atomic_load_n(&child->joiner, __ATOMIC_SEQ_CST);
+	for(;;) {
+		/* Its executor marks it done right after closing it, with interrupts disabled */
+		if(joiner == JOINER_CLOSED) {
+			while(!async_done(child)) {
+				asm volatile ("pause");
+			}
+			return;
+		}
+
+		if(__atomic_compare_exchange_n(&child->joiner, &joiner, task, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+	}
+}
+
+void async_watch_all(struct async_task* task, struct async_task** children, uint64_t n) {
+	for(uint64_t i = 0; i < n; i++) {
+		async_watch(task, children[i]);
+	}
+}
+
+/* Get the index of the first task that is done, -1 if none is */
+int64_t async_first_done(struct async_task** children, uint64_t n) {
+	for(uint64_t i = 0; i < n; i++) {
+		if(async_done(children[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Get the index of the first task that is not done, -1 if all are */
+int64_t async_first_pending(struct async_task** children, uint64_t n) {
+	for(uint64_t i = 0; i < n; i++) {
+		if(!async_done(children[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void async_event_init(struct async_event* event) {
+	event->set = false;
+	event->waiter = NULL;
+}
+
+/* Wake task once the event is signaled, an event has one waiter */
+void async_event_watch(struct async_event* event, struct async_task* task) {
+	__atomic_store_n(&event->waiter, task, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * async_event_signal: Mark an event as happened and wake its waiter
+ *
+ * Meant for completion paths like interrupt handlers, never sleeps
+ *
+ * @param event: The event
+ */
+void async_event_signal(struct async_event* event) {
+	__atomic_store_n(&event->set, true, __ATOMIC_SEQ_CST);
+	struct async_task* waiter = __atomic_load_n(&event->waiter, __ATOMIC_SEQ_CST);
+	if(waiter != NULL) {
+		async_wake(waiter);
+	}
+}
+
+static void async_sleep_fire(void* arg) {
+	struct async_sleep* sleep = arg;
+	__atomic_store_n(&sleep->fired, true, __ATOMIC_SEQ_CST);
+	async_wake(sleep->task);
+}
+
+/* Arm a timer waking task in ns nanoseconds, see ASYNC_SLEEP() */
+void async_sleep_start(struct async_sleep* sleep, struct async_task* task, uint64_t ns) {
+	sleep->task = task;
+	sleep->fired = false;
+	timer_setup(&sleep->timer, async_sleep_fire, sleep, 0);
+	timer_arm(&sleep->timer, clock_ns() + ns, TIMER_SLEEP_SLACK_NS);
+}
+
+/* Create the executors, called by kinit once all cores are scheduling */
+void async_init(void) {
+	struct async_executor* list = malloc(sizeof(struct async_executor) * coreCount);
+	if(list == NULL) {
+		panic("async: Out of memory for executors", NULL);
+	}
+	memset(list, 0, sizeof(struct async_executor) * coreCount);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		list[i].core = i;
+		wait_queue_init(&list[i].wait);
+	}
+	__atomic_store_n(&executors, list, __ATOMIC_RELEASE);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(thread_create_on(i, "kasync", executor_thread, &list[i]) == NULL) {
+			panic("async: Can't create the executor threads", NULL);
+		}
+	}
+}
+
+/* Print the tasks run by every executor */
+void async_print_stats(void) {
+	if(executors == NULL) {
+		return;
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct async_executor* ex = &executors[i];
+		kprintf("async: executor %lu: %lu queued, %lu polls, %lu completed, %lu stolen\n",
+			i, ex->nr_queued, ex->polls, ex->completed, ex->stolen);
+	}
+}
@@ -0,0 +1,214 @@
+/**
+ * deadline.c: Deadline scheduling class
+ *
+ * Every thread has a runtime it may use within each period, and must get it
+ * within deadline of the period starting. The queued thread with the earliest
+ * absolute deadline runs next (EDF).
+ *
+ * Budgets are enforced like a constant bandwidth server: a thread that used
+ * up its runtime is throttled until its next period, and a thread that wakes
+ * up with more budget than its bandwidth allows before the deadline gets a
+ * new period. So a deadline thread can't take more than runtime / period of a
+ * core, and admission control keeps the sum of those under
+ * SCHED_DL_BW_LIMIT percent of all cores.
+ */
+
+#include <stdint.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/rbtree.h>
+#include <kernel/timer.h>
+
+/* Bandwidth reserved by all deadline threads */
+static spinlock_t dl_bw_lock = SPINLOCK_ZERO;
+static uint64_t dl_total_bw = 0;
+
+static inline bool dl_before(uint64_t a, uint64_t b) {
+	return (int64_t)(a - b) < 0;
+}
+
+static inline uint64_t dl_bw(uint64_t runtime, uint64_t period) {
+	return (runtime << SCHED_DL_BW_SHIFT) / period;
+}
+
+/**
+ * dl_admit: Reserve the bandwidth of a deadline thread
+ *
+ * Replaces the bandwidth the thread already reserved
+ *
+ * @param thread: The thread
+ * @param runtime: Runtime per period
+ * @param period: The period
+ * @return false if the deadline threads would take more than SCHED_DL_BW_LIMIT of all cores
+ */
+bool dl_admit(struct thread* thread, uint64_t runtime, uint64_t period) {
+	uint64_t limit = (coreCount * SCHED_DL_BW_LIMIT << SCHED_DL_BW_SHIFT) / 100;
+	uint64_t bw = dl_bw(runtime, period);
+
+	bool int_state = spinlock_acquire_irqsave(&dl_bw_lock);
+	uint64_t old = thread->policy == SCHED_DEADLINE ? dl_bw(thread->dl_runtime, thread->dl_period) : 0;
+	bool admitted = dl_total_bw - old + bw <= limit;
+	if(admitted) {
+		dl_total_bw = dl_total_bw - old + bw;
+	}
+	spinlock_release_irqrestore(&dl_bw_lock, int_state);
+	return admitted;
+}
+
+/* Give back the bandwidth of a thread leaving the deadline class */
+void dl_release(struct thread* thread) {
+	bool int_state = spinlock_acquire_irqsave(&dl_bw_lock);
+	dl_total_bw -= dl_bw(thread->dl_runtime, thread->dl_period);
+	spinlock_release_irqrestore(&dl_bw_lock, int_state);
+}
+
+/* Start a new period with a full budget */
+static void dl_new_period(struct thread* thread, uint64_t now) {
+	thread->dl_abs_deadline = now + thread->dl_deadline;
+	thread->dl_budget = (int64_t)thread->dl_runtime;
+}
+
+/* A waking thread keeps its budget only if using it before the deadline stays within its bandwidth */
+static void dl_check_budget(struct thread* thread, uint64_t now) {
+	if(!dl_before(now, thread->dl_abs_deadline) || thread->dl_budget <= 0) {
+		dl_new_period(thread, now);
+		return;
+	}
+
+	/* budget / (deadline - now) > runtime / period, periods are short enough not to overflow */
+	uint64_t left = thread->dl_abs_deadline - now;
+	if((uint64_t)thread->dl_budget * thread->dl_period > left * thread->dl_runtime) {
+		dl_new_period(thread, now);
+	}
+}
+
+static struct thread* dl_first(struct runqueue* rq) {
+	return rq->dl.leftmost ? rb_entry(rq->dl.leftmost, struct thread, run_node) : NULL;
+}
+
+static void dl_enqueue(struct runqueue* rq, struct thread* thread, uint64_t from_core, int flags) {
+	/* Out of budget, queued again by dl_replenish_timer() at its next period or when its parameters change */
+	if(thread->dl_throttled) {
+		thread->dl_parked = true;
+		timer_arm(&thread->dl_timer, thread->dl_abs_deadline - thread->dl_deadline + thread->dl_period, 0);
+		return;
+	}
+
+	if(flags & (ENQUEUE_WAKEUP | ENQUEUE_NEW)) {
+		dl_check_budget(thread, clock_ns());
+	}
+
+	struct rb_node** link = &rq->dl.tasks.node;
+	struct rb_node* parent = NULL;
+	bool leftmost = true;
+	while(*link) {
+		parent = *link;
+		if(dl_before(thread->dl_abs_deadline, rb_entry(parent, struct thread, run_node)->dl_abs_deadline)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&thread->run_node, parent, link);
+	rb_insert_color(&thread->run_node, &rq->dl.tasks);
+	if(leftmost) {
+		rq->dl.leftmost = &thread->run_node;
+	}
+
+	thread->on_rq = true;
+	rq->dl.nr_running++;
+	rq->nr_running++;
+	__atomic_add_fetch(&sched_nr_rt_queued, 1, __ATOMIC_RELAXED);
+}
+
+static void dl_dequeue(struct runqueue* rq, struct thread* thread) {
+	if(rq->dl.leftmost == &thread->run_node) {
+		rq->dl.leftmost = rb_next(&thread->run_node);
+	}
+	rb_erase(&thread->run_node, &rq->dl.tasks);
+	thread->on_rq = false;
+	rq->dl.nr_running--;
+	rq->nr_running--;
+	__atomic_sub_fetch(&sched_nr_rt_queued, 1, __ATOMIC_RELAXED);
+}
+
+static struct thread* dl_peek(struct runqueue* rq) {
+	return dl_first(rq);
+}
+
+static struct thread* dl_pick_next(struct runqueue* rq) {
+	struct thread* thread = dl_first(rq);
+	if(thread == NULL) {
+		return NULL;
+	}
+
+	dl_dequeue(rq, thread);
+	thread->slice = (uint64_t)thread->dl_budget;
+	return thread;
+}
+
+/* Take the thread with the earliest deadline that may run on core dst off the queue */
+static struct thread* dl_steal(struct runqueue* rq, uint64_t dst) {
+	for(struct rb_node* node = rq->dl.leftmost; node != NULL; node = rb_next(node)) {
+		struct thread* thread = rb_entry(node, struct thread, run_node);
+		if(cpumask_test(&thread->affinity, dst)) {
+			dl_dequeue(rq, thread);
+			return thread;
+		}
+	}
+	return NULL;
+}
+
+static void dl_update_curr(struct runqueue* rq, struct thread* curr, uint64_t delta) {
+	curr->dl_budget -= (int64_t)delta;
+}
+
+/* Throttle the running thread once its budget is gone, the tick fires right when it is */
+static uint64_t dl_tick(struct runqueue* rq, struct thread* curr) {
+	if(curr->dl_budget <= 0) {
+		curr->dl_throttled = true;
+		return 0;
+	}
+	return (uint64_t)curr->dl_budget;
+}
+
+static bool dl_wakeup_preempt(struct runqueue* rq, struct thread* curr, struct thread* thread) {
+	return dl_before(thread->dl_abs_deadline, curr->dl_abs_deadline);
+}
+
+/* The next period of a throttled thread started */
+void dl_replenish_timer(void* arg) {
+	struct thread* thread = arg;
+	struct runqueue* rq = cpu_core(thread->core)->rq;
+
+	bool int_state = spinlock_acquire_irqsave(&rq->lock);
+	uint64_t now = clock_ns();
+	thread->dl_abs_deadline += thread->dl_period;
+	thread->dl_budget = (int64_t)thread->dl_runtime;
+	if(dl_before(thread->dl_abs_deadline, now + thread->dl_deadline - thread->dl_period)) {
+		/* It missed whole periods */
+		dl_new_period(thread, now);
+	}
+	thread->dl_throttled = false;
+	bool parked = thread->dl_parked;
+	thread->dl_parked = false;
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	/* Still running if it wasn't switched out yet, it then just keeps going */
+	if(parked) {
+		sched_requeue(thread, ENQUEUE_REPLENISH);
+	}
+}
+
+const struct sched_class dl_sched_class = {
+	.enqueue = dl_enqueue,
+	.dequeue = dl_dequeue,
+	.peek = dl_peek,
+	.pick_next = dl_pick_next,
+	.steal = dl_steal,
+	.update_curr = dl_update_curr,
+	.tick = dl_tick,
+	.wakeup_preempt = dl_wakeup_preempt,
+};
@@ -0,0 +1,108 @@
+/**
+ * domain.c: Scheduling domains built from the CPU topology
+ *
+ * Every core gets a domain for each level of the topology it shares with
+ * other cores: SMT siblings, cores sharing an L2, cores sharing the last
+ * level cache, the package and the whole system. Levels spanning the same
+ * cores as the one below are left out. Balancing and placement walk the
+ * domains from the lowest level up, so threads stay close to the caches
+ * they last used.
+ *
+ * Isolated cores have no domains and are left out of the domains of the
+ * others, so nothing is balanced onto or off them (see isolation.c).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+#include <kernel/isolation.h>
+
+static const char* sd_level_names[SD_LEVELS] = {
+	[SD_SMT] = "SMT",
+	[SD_L2] = "L2",
+	[SD_LLC] = "LLC",
+	[SD_PACKAGE] = "package",
+	[SD_SYSTEM] = "system",
+};
+
+/* Moving threads further away loses more cache, so it takes more imbalance */
+static const uint32_t sd_imbalance_pct[SD_LEVELS] = {
+	[SD_SMT] = 110,
+	[SD_L2] = 117,
+	[SD_LLC] = 117,
+	[SD_PACKAGE] = 125,
+	[SD_SYSTEM] = 125,
+};
+
+/* Cores with the same key share the level */
+static uint32_t sd_key(core_t* core, enum sched_domain_level level) {
+	switch(level) {
+		case SD_SMT:
+			return core->topo.core_uid;
+		case SD_L2:
+			return core->topo.l2;
+		case SD_LLC:
+			return core->topo.llc;
+		case SD_PACKAGE:
+			return core->topo.package;
+		default:
+			return 0;
+	}
+}
+
+/* Build the domains of one core */
+static void sched_build_domains(core_t* core) {
+	struct runqueue* rq = core->rq;
+	cpumask_t span;
+	cpumask_clear_all(&span);
+	cpumask_set(&span, core->id);
+	uint64_t weight = 1;
+
+	rq->nr_domains = 0;
+	for(int level = SD_SMT; level < SD_LEVELS; level++) {
+		uint32_t key = sd_key(core, level);
+		for(uint64_t i = 0; i < coreCount; i++) {
+			if(sd_key(cpu_core(i), level) == key) {
+				cpumask_set(&span, i);
+			}
+		}
+
+		if(level == SD_SMT) {
+			rq->smt_siblings = span;
+		}
+		cpumask_andnot(&span, &cpu_isolated);
+		cpumask_set(&span, core->id);
+		if(core_isolated(core->id)) {
+			return;
+		}
+
+		/* Nothing to balance with that the level below doesn't have */
+		uint64_t span_weight = cpumask_weight(&span);
+		if(span_weight == weight) {
+			continue;
+		}
+		weight = span_weight;
+
+		struct sched_domain* domain = &rq->domains[rq->nr_domains++];
+		domain->span = span;
+		domain->level = level;
+		domain->imbalance_pct = sd_imbalance_pct[level];
+	}
+}
+
+/* Build the scheduling domains of all cores, called once the run queues and topology exist */
+void __init sched_init_domains(void) {
+	for(uint64_t i = 0; i < coreCount; i++) {
+		sched_build_domains(cpu_core(i));
+	}
+
+	struct runqueue* rq = cpu_core(0)->rq;
+	kprintf("sched: Domains of core 0:");
+	for(uint32_t i = 0; i < rq->nr_domains; i++) {
+		kprintf(" %s (%lu cores)", sd_level_names[rq->domains[i].level], cpumask_weight(&rq->domains[i].span));
+	}
+	kprintf("%s\n", rq->nr_domains == 0 ? " none" : "");
+}
@@ -0,0 +1,267 @@
+/**
+ * fair.c: Fair scheduling class
+ *
+ * The threads queued on a core are kept in a red-black tree ordered by
+ * vruntime, the time they ran scaled by NICE_0_WEIGHT / weight, and the
+ * leftmost one runs next. The running thread is not in the tree.
+ *
+ * Every runnable thread runs once per latency period, which is split by
+ * weight, but no slice is shorter than the minimum granularity. A woken
+ * thread is placed at most half a period behind min_vruntime, so sleepers run
+ * soon without starving the rest, and it preempts the running thread when
+ * it is more than the wakeup granularity behind it.
+ */
+
+#include <stdint.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/rbtree.h>
+
+/* Weight of every nice level, from NICE_MIN to NICE_MAX */
+static const uint64_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+	88761, 71755, 56483, 46273, 36291,
+	29154, 23254, 18705, 14949, 11916,
+	9548, 7620, 6100, 4904, 3906,
+	3121, 2501, 1991, 1586, 1277,
+	1024, 820, 655, 526, 423,
+	335, 272, 215, 172, 137,
+	110, 87, 70, 56, 45,
+	36, 29, 23, 18, 15,
+};
+
+static uint64_t sched_latency_ns = SCHED_LATENCY_NS;
+static uint64_t sched_min_granularity_ns = SCHED_MIN_GRANULARITY_NS;
+static uint64_t sched_wakeup_granularity_ns = SCHED_WAKEUP_GRANULARITY_NS;
+
+/* vruntimes wrap around, compare them by their distance */
+static inline bool vruntime_before(uint64_t a, uint64_t b) {
+	return (int64_t)(a - b) < 0;
+}
+
+/* Scale real time to the vruntime of a thread */
+static inline uint64_t fair_delta(uint64_t delta, struct thread* thread) {
+	if(thread->weight == NICE_0_WEIGHT) {
+		return delta;
+	}
+	return delta * NICE_0_WEIGHT / thread->weight;
+}
+
+static inline struct thread* fair_first(struct runqueue* rq) {
+	return rq->fair.leftmost ? rb_entry(rq->fair.leftmost, struct thread, run_node) : NULL;
+}
+
+/* Move min_vruntime up to the smallest vruntime on the core, curr may be NULL */
+static void fair_update_min_vruntime(struct runqueue* rq, struct thread* curr) {
+	struct thread* first = fair_first(rq);
+	uint64_t vruntime;
+
+	if(curr && first) {
+		vruntime = vruntime_before(curr->vruntime, first->vruntime) ? curr->vruntime : first->vruntime;
+	} else if(curr) {
+		vruntime = curr->vruntime;
+	} else if(first) {
+		vruntime = first->vruntime;
+	} else {
+		return;
+	}
+
+	if(vruntime_before(rq->fair.min_vruntime, vruntime)) {
+		rq->fair.min_vruntime = vruntime;
+	}
+}
+
+/* Take a queued thread off the tree */
+static void fair_dequeue(struct runqueue* rq, struct thread* thread) {
+	if(rq->fair.leftmost == &thread->run_node) {
+		rq->fair.leftmost = rb_next(&thread->run_node);
+	}
+	rb_erase(&thread->run_node, &rq->fair.tasks);
+	thread->on_rq = false;
+	rq->fair.nr_running--;
+	rq->nr_running--;
+	rq->fair.load_weight -= thread->weight;
+}
+
+/**
+ * fair_slice: Get the time a thread runs before it is preempted
+ *
+ * @param rq: The run queue the thread is on or about to run from
+ * @param thread: The thread
+ * @return Length of the slice in nanoseconds
+ */
+static uint64_t fair_slice(struct runqueue* rq, struct thread* thread) {
+	uint64_t nr = rq->fair.nr_running + !thread->on_rq;
+	uint64_t load = rq->fair.load_weight + (thread->on_rq ? 0 : thread->weight);
+
+	/* Stretch the period once it can't give everyone the minimum granularity */
+	uint64_t period = sched_latency_ns;
+	if(nr > sched_latency_ns / sched_min_granularity_ns) {
+		period = nr * sched_min_granularity_ns;
+	}
+
+	uint64_t slice = period * thread->weight / load;
+	return slice < sched_min_granularity_ns ? sched_min_granularity_ns : slice;
+}
+
+/**
+ * fair_enqueue: Put a thread in the tree of a run queue
+ *
+ * @param rq: The run queue
+ * @param thread: The thread
+ * @param from_core: Core whose min_vruntime the vruntime of the thread is relative to, coreCount for none
+ * @param flags: ENQUEUE_WAKEUP or ENQUEUE_NEW, the others don't matter to this class
+ */
+static void fair_enqueue(struct runqueue* rq, struct thread* thread, uint64_t from_core, int flags) {
+	/* Keep the lead or lag it had on its old core */
+	if(from_core < coreCount && cpu_core(from_core)->rq != rq) {
+		thread->vruntime += rq->fair.min_vruntime - cpu_core(from_core)->rq->fair.min_vruntime;
+	}
+
+	if(flags & ENQUEUE_NEW) {
+		/* Start a slice behind so creating threads in a loop doesn't starve the others */
+		thread->vruntime = rq->fair.min_vruntime + fair_delta(fair_slice(rq, thread), thread);
+	} else if(flags & ENQUEUE_WAKEUP) {
+		/* Time spent asleep is worth at most half a period */
+		uint64_t floor = rq->fair.min_vruntime - sched_latency_ns / 2;
+		if(vruntime_before(thread->vruntime, floor)) {
+			thread->vruntime = floor;
+		}
+	}
+
+	struct rb_node** link = &rq->fair.tasks.node;
+	struct rb_node* parent = NULL;
+	bool leftmost = true;
+	while(*link) {
+		parent = *link;
+		if(vruntime_before(thread->vruntime, rb_entry(parent, struct thread, run_node)->vruntime)) {
+			link = &parent->left;
+		} else {
+			link = &parent->right;
+			leftmost = false;
+		}
+	}
+
+	rb_link_node(&thread->run_node, parent, link);
+	rb_insert_color(&thread->run_node, &rq->fair.tasks);
+	if(leftmost) {
+		rq->fair.leftmost = &thread->run_node;
+	}
+
+	thread->on_rq = true;
+	rq->fair.nr_running++;
+	rq->nr_running++;
+	rq->fair.load_weight += thread->weight;
+}
+
+static struct thread* fair_peek(struct runqueue* rq) {
+	return fair_first(rq);
+}
+
+/* Take the thread with the smallest vruntime off the tree, NULL if it is empty */
+static struct thread* fair_pick_next(struct runqueue* rq) {
+	struct thread* thread = fair_first(rq);
+	if(thread == NULL) {
+		return NULL;
+	}
+
+	thread->slice = fair_slice(rq, thread);
+	fair_dequeue(rq, thread);
+	fair_update_min_vruntime(rq, NULL);
+	return thread;
+}
+
+/* Take the first thread in vruntime order that may run on core dst off the tree */
+static struct thread* fair_steal(struct runqueue* rq, uint64_t dst) {
+	for(struct rb_node* node = rq->fair.leftmost; node != NULL; node = rb_next(node)) {
+		struct thread* thread = rb_entry(node, struct thread, run_node);
+		if(cpumask_test(&thread->affinity, dst)) {
+			fair_dequeue(rq, thread);
+			return thread;
+		}
+	}
+	return NULL;
+}
+
+/* Charge the running thread, vruntime grows slower the higher its weight */
+static void fair_update_curr(struct runqueue* rq, struct thread* curr, uint64_t delta) {
+	curr->vruntime += fair_delta(delta, curr);
+	fair_update_min_vruntime(rq, curr);
+}
+
+/**
+ * fair_tick: Check if the running thread used up its slice
+ *
+ * @param rq: Run queue of the core
+ * @param curr: The running thread, charged up to now
+ * @return Nanoseconds left in the slice, 0 if the thread should be preempted
+ */
+static uint64_t fair_tick(struct runqueue* rq, struct thread* curr) {
+	curr->slice = fair_slice(rq, curr);
+	struct thread* first = fair_first(rq);
+	if(first == NULL) {
+		return curr->slice;
+	}
+
+	uint64_t ran = curr->sum_exec_runtime - curr->slice_start;
+	if(ran >= curr->slice) {
+		return 0;
+	}
+
+	/* Don't run too far ahead of the thread waiting the longest either */
+	if(ran >= sched_min_granularity_ns && (int64_t)(curr->vruntime - first->vruntime) > (int64_t)curr->slice) {
+		return 0;
+	}
+	return curr->slice - ran;
+}
+
+/* A woken thread preempts once it is far enough behind the running one */
+static bool fair_wakeup_preempt(struct runqueue* rq, struct thread* curr, struct thread* thread) {
+	uint64_t granularity = fair_delta(sched_wakeup_granularity_ns, thread);
+	return (int64_t)(curr->vruntime - thread->vruntime) > (int64_t)granularity;
+}
+
+/* Change the nice level of a thread, rq is the run queue it is on or NULL */
+void fair_set_weight(struct runqueue* rq, struct thread* thread, int nice) {
+	if(nice < NICE_MIN) {
+		nice = NICE_MIN;
+	} else if(nice > NICE_MAX) {
+		nice = NICE_MAX;
+	}
+
+	uint64_t weight = nice_weights[nice - NICE_MIN];
+	if(rq && thread->on_rq && thread->sched_class == &fair_sched_class) {
+		rq->fair.load_weight += weight - thread->weight;
+	}
+	thread->nice = nice;
+	thread->weight = weight;
+}
+
+/**
+ * sched_fair_tune: Change the fair class tunables
+ *
+ * @param latency_ns: Period every runnable thread runs once in, 0 to keep it
+ * @param min_granularity_ns: Shortest slice, 0 to keep it
+ * @param wakeup_granularity_ns: vruntime lead a woken thread needs to preempt, 0 to keep it
+ */
+void sched_fair_tune(uint64_t latency_ns, uint64_t min_granularity_ns, uint64_t wakeup_granularity_ns) {
+	if(latency_ns) {
+		sched_latency_ns = latency_ns;
+	}
+	if(min_granularity_ns) {
+		sched_min_granularity_ns = min_granularity_ns;
+	}
+	if(wakeup_granularity_ns) {
+		sched_wakeup_granularity_ns = wakeup_granularity_ns;
+	}
+}
+
+const struct sched_class fair_sched_class = {
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.peek = fair_peek,
+	.pick_next = fair_pick_next,
+	.steal = fair_steal,
+	.update_curr = fair_update_curr,
+	.tick = fair_tick,
+	.wakeup_preempt = fair_wakeup_preempt,
+};
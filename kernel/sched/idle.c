@@ -0,0 +1,214 @@
+/**
+ * idle.c: Waiting for work on an idle core
+ *
+ * With MONITOR/MWAIT the idle thread arms a monitor on the idle_state word
+ * of its run queue and waits in the deepest C-state the CPU reports. Another
+ * core wakes it by setting IDLE_WAKE in that word, no IPI needed. Without
+ * MWAIT it waits in HLT and is woken with the reschedule IPI.
+ *
+ * Deeper than C1 is only used if the LAPIC timer keeps running there (ARAT),
+ * otherwise timers would stop firing on idle cores.
+ *
+ * Every wakeup is stamped with the TSC by the waking core, so the latency of
+ * both ways can be compared with idle_print_stats(). Normal wakeups of an
+ * MWAIT core hardly ever take the IPI way, idle_measure_wakeups() wakes idle
+ * cores both ways on purpose to get numbers for each.
+ */
+
+#include <stdint.h>
+#include <cpuid.h>
+#include <kernel/idle.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpufeature.h>
+#include <kernel/apic.h>
+#include <kernel/kprintf.h>
+#include <kernel/rcu.h>
+#include <kernel/timer.h>
+
+/* If the idle thread waits with MWAIT, and the hint it passes */
+static bool idle_mwait = false;
+static uint32_t idle_mwait_hint = 0;
+
+static inline void cpu_monitor(const volatile void* addr) {
+	asm volatile ("monitor" :: "a"(addr), "c"(0), "d"(0));
+}
+
+/* Pick MWAIT and its deepest C-state if the CPU has it */
+void __init idle_init(void) {
+	uint32_t eax, ebx, ecx, edx;
+	if(!cpu_has_feature(CPU_FEATURE_MONITOR) || __get_cpuid_max(0, NULL) < CPUID_MWAIT_LEAF) {
+		kprintf("idle: No MONITOR/MWAIT, using HLT\n");
+		return;
+	}
+
+	__cpuid(CPUID_MWAIT_LEAF, eax, ebx, ecx, edx);
+	idle_mwait = true;
+
+	bool arat = false;
+	if(__get_cpuid_max(0, NULL) >= CPUID_POWER_LEAF) {
+		uint32_t peax, pebx, pecx, pedx;
+		__cpuid(CPUID_POWER_LEAF, peax, pebx, pecx, pedx);
+		arat = peax & CPUID_POWER_EAX_ARAT;
+	}
+
+	/* EDX has the number of sub-states of C0 to C7 in 4 bits each, the hint is C-state - 1 and sub-state */
+	if((ecx & CPUID_MWAIT_ECX_EXTENSIONS) && arat) {
+		for(int cstate = 7; cstate >= 1; cstate--) {
+			uint32_t substates = (edx >> (cstate * 4)) & 0xF;
+			if(substates != 0) {
+				idle_mwait_hint = ((uint32_t)(cstate - 1) << 4) | (substates - 1);
+				break;
+			}
+		}
+	}
+
+	kprintf("idle: Using MWAIT with hint 0x%x%s\n", idle_mwait_hint, arat ? "" : " (no ARAT, C1 only)");
+}
+
+/* Count a wakeup of this idle core and how long it took since it was sent */
+static void idle_account_wakeup(struct runqueue* rq, bool mwait) {
+	uint64_t stamp = __atomic_exchange_n(&rq->wake_stamp, 0, __ATOMIC_ACQ_REL);
+	if(stamp == 0) {
+		return;
+	}
+
+	uint64_t latency = rdtsc() - stamp;
+	if(mwait) {
+		rq->mwait_wakeups++;
+		rq->mwait_wake_tsc += latency;
+	} else {
+		rq->ipi_wakeups++;
+		rq->ipi_wake_tsc += latency;
+	}
+}
+
+/**
+ * idle_wait: Wait until this idle core is woken
+ *
+ * Called by the idle thread with interrupts disabled after it checked that
+ * there is nothing to run, returns with interrupts enabled
+ */
+void idle_wait(void) {
+	core_t* core = this_core();
+	struct runqueue* rq = core->rq;
+
+	/* Grace periods stop waiting for this core until it wakes */
+	rcu_idle_enter();
+
+	if(!idle_mwait) {
+		/* An interrupt after the check still wakes us from hlt */
+		asm volatile ("sti; hlt");
+		core->idle_wakeups++;
+		rcu_idle_exit();
+		return;
+	}
+
+	__atomic_store_n(&rq->idle_state, IDLE_POLLING, __ATOMIC_SEQ_CST);
+	cpu_monitor(&rq->idle_state);
+
+	/* A store before the monitor was armed is seen here, one after it ends mwait */
+	if(rq->nr_running == 0 && !(rq->idle_state & IDLE_WAKE)) {
+		/* sti holds off interrupts for one instruction, so one arriving now still ends mwait */
+		asm volatile ("sti; mwait" :: "a"(idle_mwait_hint), "c"(0) : "memory");
+	} else {
+		enable_interrupts();
+	}
+
+	uint32_t state = __atomic_exchange_n(&rq->idle_state, 0, __ATOMIC_SEQ_CST);
+	core->idle_wakeups++;
+	rcu_idle_exit();
+	if(state & IDLE_WAKE) {
+		idle_account_wakeup(rq, true);
+	}
+}
+
+/**
+ * idle_wake: Wake an idle core so it looks at its run queue
+ *
+ * A core waiting in MWAIT is woken with a store to its idle_state, any other
+ * with the reschedule IPI
+ *
+ * @param core: The core
+ */
+void idle_wake(core_t* core) {
+	struct runqueue* rq = core->rq;
+	uint64_t expected = 0;
+	__atomic_compare_exchange_n(&rq->wake_stamp, &expected, rdtsc(), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	uint32_t state = __atomic_load_n(&rq->idle_state, __ATOMIC_ACQUIRE);
+	while(state & IDLE_POLLING) {
+		if(state & IDLE_WAKE) {
+			return;
+		}
+		if(__atomic_compare_exchange_n(&rq->idle_state, &state, state | IDLE_WAKE, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+			return;
+		}
+	}
+
+	lapic_issue_ipi(core->lapic_id, SCHED_IPI_VECTOR, 0, 0);
+}
+
+/* Called by the reschedule IPI handler when it interrupted the idle thread */
+void idle_ipi_received(void) {
+	idle_account_wakeup(this_core()->rq, false);
+}
+
+/**
+ * idle_measure_wakeups: Wake the other cores both ways while they are idle
+ *
+ * Alternates between a store to idle_state and the reschedule IPI, cores that
+ * are busy at the time are left alone. The latencies end up in the counters
+ * printed by idle_print_stats().
+ *
+ * @param rounds: Wakeups of each way per core
+ */
+void idle_measure_wakeups(uint64_t rounds) {
+	if(!idle_mwait) {
+		return;
+	}
+
+	for(uint64_t n = 0; n < rounds * 2; n++) {
+		for(uint64_t i = 0; i < coreCount; i++) {
+			core_t* core = cpu_core(i);
+			struct runqueue* rq = core->rq;
+			if(core == this_core() || rq == NULL) {
+				continue;
+			}
+
+			/* Only a core waiting in MWAIT whose last wakeup was accounted */
+			uint32_t state = __atomic_load_n(&rq->idle_state, __ATOMIC_ACQUIRE);
+			if(state != IDLE_POLLING || __atomic_load_n(&rq->wake_stamp, __ATOMIC_ACQUIRE) != 0) {
+				continue;
+			}
+
+			if(n & 1) {
+				uint64_t expected = 0;
+				__atomic_compare_exchange_n(&rq->wake_stamp, &expected, rdtsc(), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+				lapic_issue_ipi(core->lapic_id, SCHED_IPI_VECTOR, 0, 0);
+			} else {
+				idle_wake(core);
+			}
+		}
+
+		/* Let the cores go back to sleep */
+		timer_sleep(IDLE_MEASURE_GAP_NS);
+	}
+}
+
+/* Print how often idle cores were woken each way and the average latency */
+void idle_print_stats(void) {
+	uint64_t khz = tsc_get_khz();
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct runqueue* rq = cpu_core(i)->rq;
+		uint64_t mwait_ns = 0;
+		uint64_t ipi_ns = 0;
+		if(khz != 0 && rq->mwait_wakeups != 0) {
+			mwait_ns = rq->mwait_wake_tsc / rq->mwait_wakeups * 1000000 / khz;
+		}
+		if(khz != 0 && rq->ipi_wakeups != 0) {
+			ipi_ns = rq->ipi_wake_tsc / rq->ipi_wakeups * 1000000 / khz;
+		}
+		kprintf("idle: core %lu: %lu mwait wakeups avg %lu ns, %lu ipi wakeups avg %lu ns\n",
+			i, rq->mwait_wakeups, mwait_ns, rq->ipi_wakeups, ipi_ns);
+	}
+}
@@ -0,0 +1,156 @@
+/**
+ * isolation.c: Cores kept free of kernel noise
+ *
+ * The cores listed with isolcpus= on the kernel command line only run the
+ * threads whose affinity names them. New threads, unbound workers and timers
+ * that are not pinned stay on the housekeeping cores, the load balancer and
+ * idle stealing leave isolated cores out of their domains, and device
+ * interrupts are routed to the BSP. An isolated core running a single thread
+ * stops its tick until another thread is queued on it (see sched.c).
+ *
+ * The BSP always does housekeeping.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/isolation.h>
+#include <kernel/cpu.h>
+#include <kernel/apic.h>
+#include <kernel/symbols.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+
+cpumask_t cpu_isolated;
+cpumask_t cpu_housekeeping;
+
+extern uint32_t bsp_lapic_id;
+
+/* Parse a decimal number, end is set to the first character after it */
+static uint64_t isolation_parse_number(const char* s, const char** end) {
+	uint64_t value = 0;
+	while(*s >= '0' && *s <= '9') {
+		value = value * 10 + (uint64_t)(*s - '0');
+		s++;
+	}
+	*end = s;
+	return value;
+}
+
+/* Find an option on the command line, returns its value or NULL */
+static const char* isolation_find_option(const char* cmdline, const char* option) {
+	for(const char* s = cmdline; *s; s++) {
+		if(s != cmdline && s[-1] != ' ') {
+			continue;
+		}
+
+		const char* o = option;
+		const char* c = s;
+		while(*o && *c == *o) {
+			o++;
+			c++;
+		}
+		if(*o == '\0') {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/* Parse a list like 1,3-5 into the mask, returns false if it is malformed */
+static bool isolation_parse_list(const char* list, cpumask_t* mask) {
+	const char* s = list;
+	while(*s && *s != ' ') {
+		const char* end;
+		uint64_t first = isolation_parse_number(s, &end);
+		if(end == s) {
+			return false;
+		}
+		uint64_t last = first;
+		s = end;
+
+		if(*s == '-') {
+			s++;
+			last = isolation_parse_number(s, &end);
+			if(end == s || last < first) {
+				return false;
+			}
+			s = end;
+		}
+
+		for(uint64_t core = first; core <= last && core < coreCount; core++) {
+			cpumask_set(mask, core);
+		}
+
+		if(*s == ',') {
+			s++;
+		} else if(*s && *s != ' ') {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Read isolcpus= from the command line, called once the cores are counted and before the scheduler starts */
+void __init isolation_init(void) {
+	cpumask_clear_all(&cpu_isolated);
+	cpumask_clear_all(&cpu_housekeeping);
+	for(uint64_t i = 0; i < coreCount; i++) {
+		cpumask_set(&cpu_housekeeping, i);
+	}
+
+	const char* cmdline = kernel_cmdline();
+	const char* list = cmdline != NULL ? isolation_find_option(cmdline, ISOLATION_CMDLINE) : NULL;
+	if(list == NULL) {
+		return;
+	}
+
+	cpumask_t isolated;
+	cpumask_clear_all(&isolated);
+	if(!isolation_parse_list(list, &isolated)) {
+		kprintf("isolation: Ignoring malformed %s%s\n", ISOLATION_CMDLINE, list);
+		return;
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(!cpumask_test(&isolated, i)) {
+			continue;
+		}
+		if(cpu_core(i)->lapic_id == bsp_lapic_id) {
+			kprintf("isolation: Core %lu is the BSP, it is not isolated\n", i);
+			continue;
+		}
+
+		cpumask_set(&cpu_isolated, i);
+		cpumask_clear(&cpu_housekeeping, i);
+	}
+
+	if(cpumask_weight(&cpu_isolated) == 0) {
+		return;
+	}
+
+	kprintf("isolation: Isolated cores:");
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(core_isolated(i)) {
+			kprintf(" %lu", i);
+		}
+	}
+	kprintf(", %lu housekeeping\n", cpumask_weight(&cpu_housekeeping));
+
+	/* The firmware may have left interrupts pointing at them */
+	ioapic_reroute_isolated();
+}
+
+/**
+ * isolation_irq_lapic: Get the LAPIC a device interrupt should be sent to
+ *
+ * @param lapic_id: The LAPIC asked for
+ * @return lapic_id, or the BSP if it belongs to an isolated core
+ */
+uint32_t isolation_irq_lapic(uint32_t lapic_id) {
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(cpu_core(i)->lapic_id == lapic_id) {
+			return core_isolated(i) ? bsp_lapic_id : lapic_id;
+		}
+	}
+	return lapic_id;
+}
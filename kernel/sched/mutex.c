@@ -0,0 +1,102 @@
+/**
+ * mutex.c: Sleeping locks
+ *
+ * A contended mutex is polled while its owner is running on a core, as it is
+ * likely released before a sleep and wake up would complete. Once the owner
+ * is preempted or blocked, or the polling takes too long, the thread sleeps
+ * on the wait queue of the mutex. Semaphores sleep right away.
+ *
+ * Only threads may take these, not interrupt handlers or the idle thread.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/mutex.h>
+#include <kernel/wait.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+
+void mutex_init(struct mutex* mutex) {
+	mutex->owner = NULL;
+	wait_queue_init(&mutex->wait);
+}
+
+bool mutex_try_lock(struct mutex* mutex) {
+	struct thread* expected = NULL;
+	return __atomic_compare_exchange_n(&mutex->owner, &expected, thread_current(),
+		false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Poll the mutex while its owner runs, true if we got it */
+static bool mutex_spin(struct mutex* mutex) {
+	for(uint64_t i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+		struct thread* owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+		if(owner == NULL) {
+			if(mutex_try_lock(mutex)) {
+				return true;
+			}
+			continue;
+		}
+
+		/* The owner can only release it while it is on a core */
+		if(!owner->on_cpu || owner->state != THREAD_RUNNING) {
+			return false;
+		}
+		asm volatile ("pause");
+	}
+	return false;
+}
+
+/* Take the mutex, sleeps if it is held by a thread that is not running */
+void mutex_lock(struct mutex* mutex) {
+	if(mutex_try_lock(mutex)) {
+		return;
+	}
+
+	if(thread_current() == NULL) {
+		panic("mutex: Locked before the scheduler started", NULL);
+	}
+
+	while(!mutex_spin(mutex)) {
+		wait_event(&mutex->wait, mutex->owner == NULL);
+		if(mutex_try_lock(mutex)) {
+			return;
+		}
+	}
+}
+
+void mutex_unlock(struct mutex* mutex) {
+	__atomic_store_n(&mutex->owner, NULL, __ATOMIC_RELEASE);
+	wake_up_one(&mutex->wait);
+}
+
+bool mutex_is_locked(struct mutex* mutex) {
+	return __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED) != NULL;
+}
+
+void semaphore_init(struct semaphore* sem, int64_t count) {
+	sem->count = count;
+	wait_queue_init(&sem->wait);
+}
+
+bool semaphore_try_down(struct semaphore* sem) {
+	int64_t count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while(count > 0) {
+		if(__atomic_compare_exchange_n(&sem->count, &count, count - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Take one from the count, sleeps while it is zero */
+void semaphore_down(struct semaphore* sem) {
+	while(!semaphore_try_down(sem)) {
+		wait_event(&sem->wait, sem->count > 0);
+	}
+}
+
+void semaphore_up(struct semaphore* sem) {
+	__atomic_add_fetch(&sem->count, 1, __ATOMIC_RELEASE);
+	wake_up_one(&sem->wait);
+}
@@ -0,0 +1,106 @@
+/**
+ * preempt.c: Per core preempt count
+ *
+ * While the count of a core is not zero, the code running on it is not
+ * switched away from. Spinlocks raise it, so kernel code holding one can't
+ * be preempted, without disabling interrupts. A preemption the scheduler
+ * wants meanwhile is left in need_resched and done once the count drops back
+ * to zero with interrupts enabled.
+ *
+ * The count is changed with a single gs relative instruction, so a thread
+ * can't move to another core halfway through.
+ *
+ * With PREEMPT_DEBUG every core keeps the longest section it ran with
+ * preemption disabled, and where it started (see preempt_print_stats()).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/preempt.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/apic.h>
+#include <kernel/kprintf.h>
+#include <kernel/symbols.h>
+#include <kernel/rcu.h>
+
+volatile bool preempt_ready = false;
+
+/* Raise the count, ip is where the section starts */
+void preempt_count_add(void* ip) {
+	if(!preempt_ready) {
+		return;
+	}
+
+	asm volatile ("incl %%gs:%c0" :: "i"(&percpu_core.preempt_count) : "memory");
+
+#ifdef PREEMPT_DEBUG
+	if(preempt_count() == 1) {
+		core_t* core = this_core();
+		core->preempt_start = rdtsc();
+		core->preempt_start_ip = ip;
+	}
+#endif
+}
+
+/* Drop the count, true if it reached zero */
+static bool preempt_count_sub(void) {
+#ifdef PREEMPT_DEBUG
+	uint32_t count = preempt_count();
+	if(count == 0) {
+		panic("preempt: Preemption enabled more often than disabled", NULL);
+	}
+	if(count == 1) {
+		core_t* core = this_core();
+		uint64_t length = rdtsc() - core->preempt_start;
+		if(length > core->preempt_max) {
+			core->preempt_max = length;
+			core->preempt_max_ip = core->preempt_start_ip;
+		}
+	}
+#endif
+
+	asm volatile ("decl %%gs:%c0" :: "i"(&percpu_core.preempt_count) : "memory");
+	return preempt_count() == 0;
+}
+
+void preempt_disable(void) {
+	preempt_count_add(__builtin_return_address(0));
+}
+
+/* Enable preemption again without switching, for paths about to switch anyway */
+void preempt_enable_no_resched(void) {
+	if(preempt_ready) {
+		preempt_count_sub();
+	}
+}
+
+/* Enable preemption again and switch if the scheduler asked for it meanwhile */
+void preempt_enable(void) {
+	if(!preempt_ready || !preempt_count_sub() || !interrupt_state()) {
+		return;
+	}
+
+	struct runqueue* rq = this_core()->rq;
+	if(rq != NULL && rq->need_resched) {
+		preempt_schedule();
+	}
+}
+
+/* Print the longest section every core ran with preemption disabled */
+void preempt_print_stats(void) {
+#ifdef PREEMPT_DEBUG
+	uint64_t khz = tsc_get_khz();
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		uint64_t us = khz != 0 ? core->preempt_max * 1000 / khz : 0;
+		rcu_read_lock();
+		ksym_func_t* sym = core->preempt_max_ip != NULL ? symbols_search((uintptr_t)core->preempt_max_ip) : NULL;
+		kprintf("preempt: core %lu: longest non-preemptible section %lu us from %s+0x%lx\n",
+			i, us, sym != NULL ? sym->name : "?", sym != NULL ? (uintptr_t)core->preempt_max_ip - sym->addr : 0);
+		rcu_read_unlock();
+	}
+#else
+	kprintf("preempt: Build with PREEMPT_DEBUG to track non-preemptible sections\n");
+#endif
+}
@@ -0,0 +1,319 @@
+/**
+ * rcu.c: Read-copy-update
+ *
+ * Readers of a structure only disable preemption. A writer publishes a new
+ * version with rcu_assign_pointer() and frees the old one after a grace
+ * period, once every core that could still see it passed a quiescent state:
+ * a context switch, idle, or an interrupt of user mode or of preemptible
+ * code. None of these can happen inside a read-side section.
+ *
+ * A grace period starts with a snapshot of the cores. A core counts its
+ * idle entries and exits in dynticks, one found idle has no readers and is
+ * not waited for, so idle and tickless cores aren't woken. The others report
+ * when they pass a quiescent state, the last one completes the grace period.
+ * Cores that take too long get an IPI, which reports for them unless it
+ * interrupted a read-side section.
+ *
+ * Callbacks are queued on the calling core. All callbacks queued while the
+ * core waits for a grace period wait for the next one together, and run as
+ * one batch from the core's workqueue once it completed.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/rcu.h>
+#include <kernel/percpu.h>
+#include <kernel/cpu.h>
+#include <kernel/cpumask.h>
+#include <kernel/scheduler.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <kernel/smp.h>
+#include <kernel/int.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+
+static DEFINE_PER_CPU(struct rcu_data, rcu_data) = { .dynticks = 1 };
+
+volatile bool rcu_ready = false;
+
+/* Grace period state, the numbers only grow */
+static spinlock_t rcu_lock = SPINLOCK_ZERO;
+static uint64_t rcu_gp_seq = 0;
+static uint64_t rcu_completed = 0;
+static uint64_t rcu_requested = 0;
+static bool rcu_gp_active = false;
+static uint64_t rcu_gp_start = 0;
+static cpumask_t rcu_pending;
+
+/* Forces quiescent states while a grace period runs, kicks the callbacks once it completed.
+ * Only armed with rcu_lock held, so it is armed for the grace period that is current. rcu_lock nests outside the timer base locks */
+static struct timer rcu_gp_timer;
+
+/* Statistics */
+static uint64_t rcu_gps = 0;
+static uint64_t rcu_forced = 0;
+
+static bool rcu_gp_done(uint64_t gp) {
+	return (int64_t)(__atomic_load_n(&rcu_completed, __ATOMIC_ACQUIRE) - gp) >= 0;
+}
+
+/* Start a grace period and find the cores it waits for, the caller holds rcu_lock. false if it completed at once */
+static bool rcu_start_gp(void) {
+	uint64_t gp = rcu_gp_seq + 1;
+	__atomic_store_n(&rcu_gp_seq, gp, __ATOMIC_SEQ_CST);
+	rcu_gp_start = clock_ns();
+	cpumask_clear_all(&rcu_pending);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct runqueue* rq = cpu_core(i)->rq;
+		if(rq == NULL || !rq->online) {
+			continue;
+		}
+
+		/* Idle now, any reader it starts later comes after the grace period began */
+		struct rcu_data* rdp = per_cpu_ptr(rcu_data, i);
+		if((__atomic_load_n(&rdp->dynticks, __ATOMIC_SEQ_CST) & 1) == 0) {
+			continue;
+		}
+		cpumask_set(&rcu_pending, i);
+		__atomic_store_n(&rdp->need_qs, true, __ATOMIC_SEQ_CST);
+	}
+
+	if(cpumask_first(&rcu_pending) == CPUMASK_MAX_CORES) {
+		__atomic_store_n(&rcu_completed, gp, __ATOMIC_RELEASE);
+		rcu_gps++;
+		return false;
+	}
+	rcu_gp_active = true;
+	return true;
+}
+
+/* Ask for grace period gp to run, starting it if none is running */
+static void rcu_request_gp(uint64_t gp) {
+	bool int_state = spinlock_acquire_irqsave(&rcu_lock);
+	if((int64_t)(gp - rcu_requested) > 0) {
+		rcu_requested = gp;
+	}
+
+	if(!rcu_gp_active && (int64_t)(rcu_requested - rcu_completed) > 0) {
+		if(!rcu_start_gp()) {
+			timer_arm(&rcu_gp_timer, clock_ns(), 0);
+		} else if(!timer_pending(&rcu_gp_timer)) {
+			/* A pending timer either kicks completed callbacks first or forces already */
+			timer_arm(&rcu_gp_timer, clock_ns() + RCU_FORCE_QS_NS, 0);
+		}
+	}
+	spinlock_release_irqrestore(&rcu_lock, int_state);
+}
+
+/* Report that this core passed a quiescent state, interrupts are disabled */
+static void rcu_report_qs(void) {
+	struct rcu_data* rdp = this_cpu_ptr(rcu_data);
+	uint64_t id = this_core()->id;
+
+	spinlock_acquire(&rcu_lock);
+	if(rdp->need_qs) {
+		__atomic_store_n(&rdp->need_qs, false, __ATOMIC_RELAXED);
+		cpumask_clear(&rcu_pending, id);
+		if(rcu_gp_active && cpumask_first(&rcu_pending) == CPUMASK_MAX_CORES) {
+			rcu_gp_active = false;
+			__atomic_store_n(&rcu_completed, rcu_gp_seq, __ATOMIC_RELEASE);
+			rcu_gps++;
+
+			/* Callbacks run and the next grace period starts outside of whatever the caller holds */
+			timer_arm(&rcu_gp_timer, clock_ns(), 0);
+		}
+	}
+	spinlock_release(&rcu_lock);
+}
+
+/* Called on every context switch, with interrupts disabled */
+void rcu_qs(void) {
+	if(this_cpu_read(rcu_data.need_qs)) {
+		rcu_report_qs();
+	}
+}
+
+/* Called by the idle thread right before it waits, with interrupts disabled */
+void rcu_idle_enter(void) {
+	/* A grace period starting from now doesn't wait for this core, one that started already gets the report */
+	__atomic_add_fetch(this_cpu_ptr(rcu_data.dynticks), 1, __ATOMIC_SEQ_CST);
+	rcu_qs();
+}
+
+/* Called by the idle thread after it was woken */
+void rcu_idle_exit(void) {
+	bool int_state = interrupt_toggle(false);
+	uint64_t* dynticks = this_cpu_ptr(rcu_data.dynticks);
+	if((*dynticks & 1) == 0) {
+		__atomic_add_fetch(dynticks, 1, __ATOMIC_SEQ_CST);
+	}
+	interrupt_toggle(int_state);
+}
+
+/**
+ * rcu_irq_enter: Called on entry of every IRQ
+ *
+ * An interrupt of an idle core ends its idle period, the handler may read.
+ * An interrupt of user mode or of preemptible code is a quiescent state.
+ *
+ * @param r: Registers of the interrupted code
+ */
+void rcu_irq_enter(struct regs* r) {
+	if((this_cpu_read(rcu_data.dynticks) & 1) == 0) {
+		__atomic_add_fetch(this_cpu_ptr(rcu_data.dynticks), 1, __ATOMIC_SEQ_CST);
+	}
+
+	if(this_cpu_read(rcu_data.need_qs) && ((r->cs & 3) == 3 || preempt_count() == 0)) {
+		rcu_report_qs();
+	}
+}
+
+/* Cores behind on the grace period get this, rcu_irq_enter() already reported if it could */
+static void rcu_force_qs(void* arg) {
+	(void)arg;
+}
+
+/* Move the queued callbacks to wait for the next grace period, interrupts are disabled. The grace period to request, 0 for none */
+static uint64_t rcu_advance(struct rcu_data* rdp) {
+	if(rdp->wait != NULL || rdp->next == NULL) {
+		return 0;
+	}
+
+	/* A grace period running now may have started before the callbacks were queued */
+	rdp->wait = rdp->next;
+	rdp->wait_gp = __atomic_load_n(&rcu_gp_seq, __ATOMIC_SEQ_CST) + 1;
+	rdp->next = NULL;
+	rdp->next_tail = &rdp->next;
+	return rdp->wait_gp;
+}
+
+/* Run the callbacks of this core whose grace period completed, on its bound workqueue */
+static void rcu_do_batch(struct work* work) {
+	struct rcu_data* rdp = (struct rcu_data*)((uintptr_t)work - offsetof(struct rcu_data, work));
+
+	bool int_state = interrupt_toggle(false);
+	struct rcu_head* list = NULL;
+	if(rdp->wait != NULL && rcu_gp_done(rdp->wait_gp)) {
+		list = rdp->wait;
+		rdp->wait = NULL;
+	}
+	uint64_t gp = rcu_advance(rdp);
+	interrupt_toggle(int_state);
+
+	if(gp != 0) {
+		rcu_request_gp(gp);
+	}
+
+	uint64_t count = 0;
+	while(list != NULL) {
+		struct rcu_head* head = list;
+		list = head->next;
+		head->func(head);
+		count++;
+	}
+	__atomic_add_fetch(&rdp->invoked, count, __ATOMIC_RELAXED);
+}
+
+/* Drives the grace periods outside of the paths that report quiescent states */
+static void rcu_gp_timer_func(void* arg) {
+	(void)arg;
+	cpumask_t force;
+	cpumask_clear_all(&force);
+
+	spinlock_acquire(&rcu_lock);
+	if(rcu_gp_active) {
+		if(clock_ns() - rcu_gp_start >= RCU_FORCE_QS_NS) {
+			force = rcu_pending;
+			cpumask_clear(&force, this_core()->id);
+			rcu_forced++;
+		}
+	} else if((int64_t)(rcu_requested - rcu_completed) > 0) {
+		rcu_start_gp();
+	}
+	if(rcu_gp_active) {
+		timer_arm(&rcu_gp_timer, clock_ns() + RCU_FORCE_QS_NS, 0);
+	}
+	spinlock_release(&rcu_lock);
+
+	/* Run the callbacks of the cores that waited for a completed grace period */
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct rcu_data* rdp = per_cpu_ptr(rcu_data, i);
+		if(__atomic_load_n(&rdp->wait, __ATOMIC_ACQUIRE) != NULL && rcu_gp_done(rdp->wait_gp)) {
+			queue_work_on(i, &system_wq, &rdp->work);
+		}
+	}
+
+	if(cpumask_first(&force) != CPUMASK_MAX_CORES) {
+		smp_call_function_many(&force, rcu_force_qs, NULL, false);
+	}
+}
+
+/**
+ * call_rcu: Call a function once all current readers are done
+ *
+ * The function runs from a workqueue and may sleep. Must not be called
+ * before rcu_ready is set, see rcu_init().
+ *
+ * @param head: Embedded in the object, must stay valid until func ran
+ * @param func: Called with head after a grace period
+ */
+void call_rcu(struct rcu_head* head, void (*func)(struct rcu_head* head)) {
+	head->func = func;
+	head->next = NULL;
+
+	bool int_state = interrupt_toggle(false);
+	struct rcu_data* rdp = this_cpu_ptr(rcu_data);
+	*rdp->next_tail = head;
+	rdp->next_tail = &head->next;
+	rdp->queued++;
+	uint64_t gp = rcu_advance(rdp);
+
+	/* Kicked before the workqueues ran, nothing else would run them */
+	if(rdp->wait != NULL && rcu_gp_done(rdp->wait_gp)) {
+		queue_work_on(this_core()->id, &system_wq, &rdp->work);
+	}
+	interrupt_toggle(int_state);
+
+	if(gp != 0) {
+		rcu_request_gp(gp);
+	}
+}
+
+struct rcu_synchronize {
+	struct rcu_head head;
+	struct completion done;
+};
+
+static void rcu_wakeme(struct rcu_head* head) {
+	complete(&((struct rcu_synchronize*)head)->done);
+}
+
+/* Wait for a grace period, must not be called in a read-side section */
+void synchronize_rcu(void) {
+	struct rcu_synchronize sync;
+	completion_init(&sync.done);
+	call_rcu(&sync.head, rcu_wakeme);
+	wait_for_completion(&sync.done);
+}
+
+/* Set up the callback lists of all cores, called once every core runs on its per-core copy */
+void __init rcu_init(void) {
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct rcu_data* rdp = per_cpu_ptr(rcu_data, i);
+		rdp->next_tail = &rdp->next;
+		work_init(&rdp->work, rcu_do_batch);
+	}
+	timer_setup(&rcu_gp_timer, rcu_gp_timer_func, NULL, 0);
+	__atomic_store_n(&rcu_ready, true, __ATOMIC_RELEASE);
+}
+
+void rcu_print_stats(void) {
+	kprintf("rcu: %lu grace periods, %lu forced, %lu requested\n", rcu_gps, rcu_forced, rcu_requested);
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct rcu_data* rdp = per_cpu_ptr(rcu_data, i);
+		kprintf("rcu: core %lu: %lu callbacks queued, %lu invoked\n", i, rdp->queued, rdp->invoked);
+	}
+}
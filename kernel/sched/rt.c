@@ -0,0 +1,157 @@
+/**
+ * rt.c: Real-time scheduling class
+ *
+ * Every priority has a FIFO list and a bit in a bitmap, the first thread of
+ * the highest priority set runs next. A SCHED_FIFO thread runs until it
+ * blocks, yields or is preempted by a higher priority. A SCHED_RR thread also
+ * goes to the back of its list after SCHED_RR_TIMESLICE_NS if others of its
+ * priority are waiting.
+ *
+ * A preempted thread goes back to the front of its list with the rest of its
+ * slice. Spreading real-time threads over cores is done by sched.c, which
+ * pushes them to cores running something less important and pulls them
+ * before a core picks something less important.
+ */
+
+#include <stdint.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+
+/* Get the highest priority with queued threads, -1 if there is none. May be called without the lock as a hint */
+int rt_highest_prio(struct runqueue* rq) {
+	for(int i = (RT_PRIO_LEVELS + 63) / 64 - 1; i >= 0; i--) {
+		uint64_t bits = rq->rt.bitmap[i];
+		if(bits != 0) {
+			return i * 64 + 63 - __builtin_clzll(bits);
+		}
+	}
+	return -1;
+}
+
+static void rt_enqueue(struct runqueue* rq, struct thread* thread, uint64_t from_core, int flags) {
+	struct rt_rq* rt = &rq->rt;
+	int prio = thread->rt_priority;
+
+	/* A preempted thread keeps its place unless its slice ran out */
+	bool head = (flags & ENQUEUE_HEAD) && thread->rt_slice != 0;
+	if(!head) {
+		thread->rt_slice = SCHED_RR_TIMESLICE_NS;
+	}
+
+	if(rt->heads[prio] == NULL) {
+		thread->rt_prev = NULL;
+		thread->rt_next = NULL;
+		rt->heads[prio] = thread;
+		rt->tails[prio] = thread;
+		rt->bitmap[prio / 64] |= (uint64_t)1 << (prio % 64);
+	} else if(head) {
+		thread->rt_prev = NULL;
+		thread->rt_next = rt->heads[prio];
+		rt->heads[prio]->rt_prev = thread;
+		rt->heads[prio] = thread;
+	} else {
+		thread->rt_prev = rt->tails[prio];
+		thread->rt_next = NULL;
+		rt->tails[prio]->rt_next = thread;
+		rt->tails[prio] = thread;
+	}
+
+	thread->on_rq = true;
+	rt->nr_running++;
+	rq->nr_running++;
+	__atomic_add_fetch(&sched_nr_rt_queued, 1, __ATOMIC_RELAXED);
+}
+
+static void rt_dequeue(struct runqueue* rq, struct thread* thread) {
+	struct rt_rq* rt = &rq->rt;
+	int prio = thread->rt_priority;
+
+	if(thread->rt_prev) {
+		thread->rt_prev->rt_next = thread->rt_next;
+	} else {
+		rt->heads[prio] = thread->rt_next;
+	}
+	if(thread->rt_next) {
+		thread->rt_next->rt_prev = thread->rt_prev;
+	} else {
+		rt->tails[prio] = thread->rt_prev;
+	}
+	if(rt->heads[prio] == NULL) {
+		rt->bitmap[prio / 64] &= ~((uint64_t)1 << (prio % 64));
+	}
+
+	thread->rt_prev = NULL;
+	thread->rt_next = NULL;
+	thread->on_rq = false;
+	rt->nr_running--;
+	rq->nr_running--;
+	__atomic_sub_fetch(&sched_nr_rt_queued, 1, __ATOMIC_RELAXED);
+}
+
+static struct thread* rt_peek(struct runqueue* rq) {
+	int prio = rt_highest_prio(rq);
+	return prio < 0 ? NULL : rq->rt.heads[prio];
+}
+
+static struct thread* rt_pick_next(struct runqueue* rq) {
+	struct thread* thread = rt_peek(rq);
+	if(thread == NULL) {
+		return NULL;
+	}
+
+	rt_dequeue(rq, thread);
+	thread->slice = thread->policy == SCHED_RR ? thread->rt_slice : UINT64_MAX;
+	return thread;
+}
+
+/* Take the highest priority thread that may run on core dst off the queue */
+static struct thread* rt_steal(struct runqueue* rq, uint64_t dst) {
+	for(int prio = rt_highest_prio(rq); prio >= 0; prio--) {
+		for(struct thread* thread = rq->rt.heads[prio]; thread != NULL; thread = thread->rt_next) {
+			if(cpumask_test(&thread->affinity, dst)) {
+				rt_dequeue(rq, thread);
+				return thread;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void rt_update_curr(struct runqueue* rq, struct thread* curr, uint64_t delta) {
+	if(curr->policy == SCHED_RR) {
+		curr->rt_slice = delta >= curr->rt_slice ? 0 : curr->rt_slice - delta;
+	}
+}
+
+/* Round robin among the threads of the same priority */
+static uint64_t rt_tick(struct runqueue* rq, struct thread* curr) {
+	if(curr->policy != SCHED_RR) {
+		return UINT64_MAX;
+	}
+	if(curr->rt_slice != 0) {
+		return curr->rt_slice;
+	}
+
+	/* Alone on its priority, start a new slice */
+	if(rq->rt.heads[curr->rt_priority] == NULL) {
+		curr->rt_slice = SCHED_RR_TIMESLICE_NS;
+		return curr->rt_slice;
+	}
+	return 0;
+}
+
+/* A higher priority always preempts, which sched.c already checks */
+static bool rt_wakeup_preempt(struct runqueue* rq, struct thread* curr, struct thread* thread) {
+	return false;
+}
+
+const struct sched_class rt_sched_class = {
+	.enqueue = rt_enqueue,
+	.dequeue = rt_dequeue,
+	.peek = rt_peek,
+	.pick_next = rt_pick_next,
+	.steal = rt_steal,
+	.update_curr = rt_update_curr,
+	.tick = rt_tick,
+	.wakeup_preempt = rt_wakeup_preempt,
+};
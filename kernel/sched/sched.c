@@ -0,0 +1,1270 @@
+/**
+ * sched.c: Kernel threads and the scheduler
+ *
+ * Every core has its own run queue and idle thread. Threads are picked from
+ * the deadline, real-time and fair classes in that order (see deadline.c, rt.c
+ * and fair.c). Threads are preempted from the LAPIC timer by returning the
+ * interrupt frame of the next thread, or by loading its context when it gave
+ * up the core itself (see switch.S).
+ *
+ * The thread switched away from is only put back on a run queue or freed in
+ * sched_finish_switch(), which runs once the core has left its stack.
+ *
+ * A core running a thread has a timer at the end of its slice and every
+ * SCHED_TICK_NS. The idle thread cancels it and hands the other timers of
+ * the core to a busy core. Cores with queued threads wake an idle core,
+ * which then steals from the busiest core.
+ *
+ * Idle cores steal threads from the busiest core, and every core pulls
+ * threads from the busiest one every SCHED_BALANCE_TICKS. Both look in the
+ * scheduling domains of the core from the lowest level up, so threads move
+ * between SMT siblings and cores sharing a cache first (see domain.c). Only
+ * one run queue lock is held at a time, and a remote one is never spun on, so
+ * a steal never waits behind the core it takes from.
+ *
+ * New and woken threads go to an idle core whose SMT siblings are idle too if
+ * there is one, the closest to the core they last ran on first, and only then
+ * to an idle sibling of a busy core.
+ *
+ * Kernel code is preempted anywhere it holds no spinlock (see preempt.c). An
+ * interrupt that wants to preempt code with the preempt count raised only
+ * sets need_resched, the switch then happens in preempt_enable().
+ *
+ * Cores listed with isolcpus= only run threads bound to them (see
+ * isolation.c). An isolated core running one thread with nothing queued
+ * behind it stops its tick, a thread queued on it starts it again.
+ *
+ * Real-time and deadline threads are placed on the core running the least
+ * important thread when queued, and a core about to pick something less
+ * important than a real-time thread queued elsewhere pulls it first.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/apic.h>
+#include <kernel/int.h>
+#include <kernel/mmu.h>
+#include <kernel/macros.h>
+#include <kernel/kprintf.h>
+#include <kernel/shrinker.h>
+#include <kernel/fpu.h>
+#include <kernel/timer.h>
+#include <kernel/workqueue.h>
+#include <kernel/idle.h>
+#include <kernel/preempt.h>
+#include <kernel/isolation.h>
+#include <kernel/smp.h>
+#include <kernel/rcu.h>
+
+/* Process all kernel threads belong to */
+struct process kernel_process = {
+	.name = "kernel",
+	.description = "Kernel threads",
+	.threads = NULL,
+	.pid = 0,
+	.pagemap = NULL,
+};
+
+/* See switch.S and int.S */
+extern void thread_start(void);
+extern void isr_restore(void);
+
+static int next_tid = 0;
+
+/* Number of APs that left their bootloader stack */
+static volatile uint64_t cores_entered = 0;
+
+volatile uint64_t sched_nr_rt_queued = 0;
+
+static const struct sched_class* const sched_classes[] = {
+	&dl_sched_class,
+	&rt_sched_class,
+	&fair_sched_class,
+};
+
+#define SCHED_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+/* Get the priority of the policy of a thread across classes, higher runs first */
+static int sched_policy_prio(struct thread* thread) {
+	switch(thread->policy) {
+	case SCHED_DEADLINE:
+		return SCHED_PRIO_DL;
+	case SCHED_FIFO:
+	case SCHED_RR:
+		return SCHED_PRIO_RT + thread->rt_priority;
+	default:
+		return SCHED_PRIO_FAIR;
+	}
+}
+
+/* Same for a thread of a run queue, which may be its idle thread */
+static int sched_prio(struct runqueue* rq, struct thread* thread) {
+	return thread == rq->idle ? SCHED_PRIO_IDLE : sched_policy_prio(thread);
+}
+
+/* Get the priority of the most important queued thread, may be called without the lock as a hint */
+static int rq_queued_prio(struct runqueue* rq) {
+	if(rq->dl.nr_running != 0) {
+		return SCHED_PRIO_DL;
+	}
+
+	int rt = rt_highest_prio(rq);
+	if(rt >= 0) {
+		return SCHED_PRIO_RT + rt;
+	}
+	return rq->fair.nr_running != 0 ? SCHED_PRIO_FAIR : SCHED_PRIO_IDLE;
+}
+
+/* A throttled deadline thread can't keep running */
+static inline bool sched_throttled(struct thread* thread) {
+	return thread->policy == SCHED_DEADLINE && thread->dl_throttled;
+}
+
+/* Threads queued or running on a core */
+static uint64_t rq_load(core_t* core) {
+	return core->rq->nr_running + (core->current_thread != core->rq->idle);
+}
+
+/* Allocate a thread that starts in entry once it is switched to */
+static struct thread* thread_alloc(const char* name, void (*entry)(void* arg), void* arg) {
+	struct thread* thread = malloc(sizeof(struct thread));
+	void* stack = malloc(THREAD_STACK_SIZE);
+	if(thread == NULL || stack == NULL) {
+		free(thread);
+		free(stack);
+		return NULL;
+	}
+
+	memset(thread, 0, sizeof(struct thread));
+	thread->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+	thread->parent = &kernel_process;
+	thread->name = name;
+	thread->stack = stack;
+	thread->entry = entry;
+	thread->arg = arg;
+	thread->state = THREAD_READY;
+	thread->sched_class = &fair_sched_class;
+	thread->policy = SCHED_NORMAL;
+	thread->weight = NICE_0_WEIGHT;
+	timer_setup(&thread->dl_timer, dl_replenish_timer, thread, TIMER_HRES);
+	thread->core = coreCount;
+	thread->fpu_core = coreCount;
+	cpumask_set_all(&thread->affinity);
+	cpumask_andnot(&thread->affinity, &cpu_isolated);
+
+	/* thread_start calls entry(arg) */
+	thread->context.rsp = ((uintptr_t)stack + THREAD_STACK_SIZE) & ~(uintptr_t)0xF;
+	thread->context.rip = (uint64_t)thread_start;
+	thread->context.r12 = (uint64_t)entry;
+	thread->context.r13 = (uint64_t)arg;
+	return thread;
+}
+
+/* If the core has nothing to run, and if whole is set neither have its SMT siblings */
+static bool sched_core_idle(uint64_t core, bool whole) {
+	if(rq_load(cpu_core(core)) != 0) {
+		return false;
+	}
+	if(!whole) {
+		return true;
+	}
+
+	const cpumask_t* siblings = &cpu_core(core)->rq->smt_siblings;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(cpumask_test(siblings, i) && rq_load(cpu_core(i)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* If the thread may be queued on the core now */
+static bool sched_core_allowed(struct thread* thread, uint64_t core) {
+	return core < coreCount && cpumask_test(&thread->affinity, core) && cpu_core(core)->rq->online;
+}
+
+/**
+ * sched_select_idle: Get an idle core for a thread, the closest to near
+ *
+ * A core whose SMT siblings are idle as well is taken over one sharing its
+ * core with a busy sibling, the domains of near are searched from the
+ * lowest level up for each
+ *
+ * @param thread: The thread
+ * @param near: Core to search around
+ *
+ * @return The core, coreCount if none is idle
+ */
+static uint64_t sched_select_idle(struct thread* thread, uint64_t near) {
+	if(near >= coreCount) {
+		return coreCount;
+	}
+	if(sched_core_allowed(thread, near) && sched_core_idle(near, true)) {
+		return near;
+	}
+
+	struct runqueue* rq = cpu_core(near)->rq;
+	for(int pass = 0; pass < 2; pass++) {
+		const cpumask_t* child = NULL;
+		for(uint32_t d = 0; d < rq->nr_domains; d++) {
+			const cpumask_t* span = &rq->domains[d].span;
+			for(uint64_t i = 0; i < coreCount; i++) {
+				if(!cpumask_test(span, i) || (child != NULL && cpumask_test(child, i))) {
+					continue;
+				}
+				if(sched_core_allowed(thread, i) && sched_core_idle(i, pass == 0)) {
+					return i;
+				}
+			}
+			child = span;
+		}
+	}
+	return coreCount;
+}
+
+/* Idle cores don't tick, wake one the thread may run on so it steals work from busy */
+static void sched_kick_idle(struct thread* thread, uint64_t busy) {
+	uint64_t core = sched_select_idle(thread, busy);
+	if(core < coreCount) {
+		idle_wake(cpu_core(core));
+	}
+}
+
+/* Arm the tick for the end of the slice, or the next load update if that comes first */
+static void sched_arm_tick(struct runqueue* rq, uint64_t now, uint64_t left) {
+	int64_t until_tick = (int64_t)(rq->next_tick - now);
+	if(until_tick < 0) {
+		until_tick = 0;
+	}
+
+	uint64_t expires = left < (uint64_t)until_tick ? now + left : rq->next_tick;
+	timer_arm(&rq->tick_timer, expires, 0);
+}
+
+/* If the core needs the tick for curr, only an isolated core running a thread alone does without. The caller holds the lock */
+static bool sched_tick_needed(core_t* core, struct thread* curr) {
+	return !core_isolated(core->id) || core->rq->nr_running != 0 || curr->policy == SCHED_DEADLINE;
+}
+
+/* Start the stopped tick of this core again, a thread was queued behind the running one */
+static void sched_restart_tick(struct runqueue* rq) {
+	bool int_state = spinlock_acquire_irqsave(&rq->lock);
+	bool stopped = rq->tick_stopped;
+	rq->tick_stopped = false;
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	/* Fire right away, the class then works out what is left of the slice */
+	if(stopped) {
+		uint64_t now = clock_ns();
+		rq->next_tick = now + SCHED_TICK_NS;
+		sched_arm_tick(rq, now, 0);
+	}
+}
+
+/* Put a thread on the run queue of a core and wake or preempt the core if the thread should run, flags are passed to its class */
+static void sched_enqueue(uint64_t core_id, struct thread* thread, int flags) {
+	core_t* core = cpu_core(core_id);
+	struct runqueue* rq = core->rq;
+
+	bool int_state = spinlock_acquire_irqsave(&rq->lock);
+	uint64_t from = thread->core;
+	if(from < coreCount && from != core_id) {
+		rq->migrations++;
+	}
+	thread->core = core_id;
+	thread->state = THREAD_READY;
+	thread->sched_class->enqueue(rq, thread, from, flags);
+
+	/* A throttled deadline thread is only queued at its next period */
+	if(!thread->on_rq) {
+		spinlock_release_irqrestore(&rq->lock, int_state);
+		return;
+	}
+
+	struct thread* current = core->current_thread;
+	bool idle = rq->online && current == rq->idle;
+	bool preempt = false;
+	if(rq->online && current != NULL && !idle && !(flags & ENQUEUE_PULL)) {
+		preempt = sched_prio(rq, thread) > sched_prio(rq, current);
+		if(!preempt && (flags & ENQUEUE_PREEMPT) && thread->sched_class == current->sched_class) {
+			preempt = thread->sched_class->wakeup_preempt(rq, current, thread);
+		}
+	}
+	if(preempt) {
+		rq->need_resched = true;
+	}
+	bool waiting = rq->nr_running > 1;
+	bool restart_tick = rq->tick_stopped && !idle;
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	/* The IPI also preempts this core once interrupts are enabled again, and starts its tick */
+	if(preempt || (restart_tick && core_id != this_core()->id)) {
+		lapic_issue_ipi(core->lapic_id, SCHED_IPI_VECTOR, 0, 0);
+	} else if(restart_tick) {
+		sched_restart_tick(rq);
+	} else if(idle && core_id != this_core()->id) {
+		idle_wake(core);
+	} else if(waiting) {
+		sched_kick_idle(thread, core_id);
+	}
+}
+
+/* Get the online core running the least important thread, if that is less important than thread */
+static uint64_t sched_select_rt_core(struct thread* thread, uint64_t prefer, int prio) {
+	if(prefer < coreCount && cpumask_test(&thread->affinity, prefer) && cpu_core(prefer)->rq->online
+		&& cpu_core(prefer)->rq->curr_prio < prio) {
+		return prefer;
+	}
+
+	uint64_t best = coreCount;
+	int best_prio = prio;
+	for(uint64_t i = 0; i < coreCount && best_prio != SCHED_PRIO_IDLE; i++) {
+		struct runqueue* rq = cpu_core(i)->rq;
+		if(!rq->online || !cpumask_test(&thread->affinity, i)) {
+			continue;
+		}
+
+		if(rq->curr_prio < best_prio) {
+			best = i;
+			best_prio = rq->curr_prio;
+		}
+	}
+	return best;
+}
+
+/* Get the online core the thread should be queued on, ties go to prefer */
+static uint64_t sched_select_core(struct thread* thread, uint64_t prefer) {
+	uint64_t best = coreCount;
+	uint64_t best_load = UINT64_MAX;
+
+	/* Push real-time threads to where they run right away */
+	if(thread->policy != SCHED_NORMAL) {
+		best = sched_select_rt_core(thread, prefer, sched_policy_prio(thread));
+		if(best != coreCount) {
+			return best;
+		}
+	}
+
+	/* Idle cores close to its caches first, without doubling up on an SMT core */
+	best = sched_select_idle(thread, prefer < coreCount ? prefer : this_core()->id);
+	if(best != coreCount) {
+		return best;
+	}
+
+	if(prefer < coreCount && cpumask_test(&thread->affinity, prefer) && cpu_core(prefer)->rq->online) {
+		best = prefer;
+		best_load = rq_load(cpu_core(prefer));
+	}
+
+	for(uint64_t i = 0; i < coreCount && best_load != 0; i++) {
+		core_t* core = cpu_core(i);
+		if(!core->rq->online || !cpumask_test(&thread->affinity, i)) {
+			continue;
+		}
+
+		uint64_t load = rq_load(core);
+		if(load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+
+	/* None of its cores are scheduling yet, queue it on one for later */
+	if(best == coreCount) {
+		best = cpumask_first(&thread->affinity);
+		if(best >= coreCount) {
+			best = prefer;
+		}
+	}
+	return best;
+}
+
+/* Load of a core weighed by how busy it has been recently */
+static uint64_t sched_weight(core_t* core) {
+	return (core->rq->nr_running << SCHED_LOAD_SHIFT) + core->rq->load_avg;
+}
+
+/* Get the online core in span with the most weight that has threads queued, NULL if there is none */
+static core_t* sched_find_busiest(core_t* self, const cpumask_t* span) {
+	core_t* busiest = NULL;
+	uint64_t busiest_weight = 0;
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		if(core == self || !cpumask_test(span, i) || !core->rq->online || core->rq->fair.nr_running == 0) {
+			continue;
+		}
+
+		uint64_t weight = sched_weight(core);
+		if(weight > busiest_weight) {
+			busiest = core;
+			busiest_weight = weight;
+		}
+	}
+	return busiest;
+}
+
+/* Move one fair thread from the run queue of victim to ours, gives up if its lock is taken */
+static bool sched_pull(core_t* self, core_t* victim) {
+	struct runqueue* rq = victim->rq;
+	bool int_state;
+	if(!spinlock_try_acquire_irqsave(&rq->lock, &int_state)) {
+		return false;
+	}
+	struct thread* thread = fair_sched_class.steal(rq, self->id);
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	if(thread == NULL) {
+		return false;
+	}
+
+	sched_enqueue(self->id, thread, 0);
+	return true;
+}
+
+/**
+ * sched_pull_rt: Take real-time threads queued on other cores that outrank what this core would run
+ *
+ * Called before picking the next thread. Remote locks are only tried, a
+ * thread missed is placed again when its own core switches
+ *
+ * @param self: This core
+ * @param prev: The running thread, if it may keep running
+ */
+static void sched_pull_rt(core_t* self, struct thread* prev) {
+	if(__atomic_load_n(&sched_nr_rt_queued, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	int prio = rq_queued_prio(self->rq);
+	if(prev != NULL && sched_prio(self->rq, prev) > prio) {
+		prio = sched_prio(self->rq, prev);
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct runqueue* rq = cpu_core(i)->rq;
+		int queued = rq_queued_prio(rq);
+		if(i == self->id || !rq->online || queued <= prio || queued <= SCHED_PRIO_FAIR) {
+			continue;
+		}
+
+		bool int_state;
+		if(!spinlock_try_acquire_irqsave(&rq->lock, &int_state)) {
+			continue;
+		}
+		const struct sched_class* class = rq->dl.nr_running != 0 ? &dl_sched_class : &rt_sched_class;
+		struct thread* thread = class->steal(rq, self->id);
+		if(thread != NULL && sched_prio(rq, thread) <= prio) {
+			/* The best one we may take is no better, leave it */
+			class->enqueue(rq, thread, i, ENQUEUE_HEAD);
+			thread = NULL;
+		}
+		spinlock_release_irqrestore(&rq->lock, int_state);
+
+		if(thread != NULL) {
+			sched_enqueue(self->id, thread, ENQUEUE_PULL);
+			self->rq->rt_pulls++;
+			prio = sched_prio(self->rq, thread);
+		}
+	}
+}
+
+/* Called by an idle core, take a thread from the busiest core of the lowest domain that has one */
+static void sched_steal(core_t* self) {
+	sched_pull_rt(self, NULL);
+	if(self->rq->nr_running != 0) {
+		return;
+	}
+
+	struct runqueue* rq = self->rq;
+	for(uint32_t d = 0; d < rq->nr_domains; d++) {
+		core_t* busiest = sched_find_busiest(self, &rq->domains[d].span);
+		if(busiest != NULL && sched_pull(self, busiest)) {
+			rq->steals++;
+			return;
+		}
+	}
+}
+
+/* Pull threads from the busiest core of the lowest unbalanced domain until we carry about half of the difference */
+static void sched_balance(core_t* self) {
+	struct runqueue* rq = self->rq;
+	for(uint32_t d = 0; d < rq->nr_domains; d++) {
+		struct sched_domain* domain = &rq->domains[d];
+		core_t* busiest = sched_find_busiest(self, &domain->span);
+		if(busiest == NULL
+			|| sched_weight(busiest) * 100 <= (sched_weight(self) + (1 << SCHED_LOAD_SHIFT)) * domain->imbalance_pct) {
+			continue;
+		}
+
+		uint64_t busiest_load = rq_load(busiest);
+		uint64_t load = rq_load(self);
+		if(busiest_load <= load + 1) {
+			continue;
+		}
+
+		uint64_t pull = (busiest_load - load) / 2;
+		if(pull > SCHED_BALANCE_MAX_PULL) {
+			pull = SCHED_BALANCE_MAX_PULL;
+		}
+
+		for(uint64_t i = 0; i < pull && sched_pull(self, busiest); i++) {
+			rq->balance_pulls++;
+		}
+		return;
+	}
+}
+
+/* Charge the running thread for the time since it was last charged, the caller holds the lock */
+static void sched_update_curr(struct runqueue* rq, struct thread* curr, uint64_t now) {
+	if(curr == rq->idle || (int64_t)(now - curr->exec_start) <= 0) {
+		return;
+	}
+
+	uint64_t delta = now - curr->exec_start;
+	curr->exec_start = now;
+	curr->sum_exec_runtime += delta;
+	curr->sched_class->update_curr(rq, curr, delta);
+}
+
+/* Take the thread to run next off the run queue, NULL if prev is runnable and outranks them all. The caller holds the lock */
+static struct thread* sched_pick_next(struct runqueue* rq, struct thread* prev, bool runnable) {
+	for(uint64_t i = 0; i < SCHED_CLASSES; i++) {
+		struct thread* next = sched_classes[i]->peek(rq);
+		if(next == NULL) {
+			continue;
+		}
+
+		if(runnable && sched_prio(rq, prev) > sched_prio(rq, next)) {
+			return NULL;
+		}
+		return sched_classes[i]->pick_next(rq);
+	}
+	return NULL;
+}
+
+/* Make next the current thread, the caller then continues next. prev goes back on a run queue if requeue is set */
+static void sched_prepare_switch(core_t* core, struct thread* prev, struct thread* next, bool requeue) {
+	struct runqueue* rq = core->rq;
+	uint64_t now = clock_ns();
+	rq->prev = prev;
+	rq->prev_requeue = requeue;
+	rq->prev_preempted = false;
+	rq->need_resched = false;
+	rq->curr_prio = sched_prio(rq, next);
+	rq->switches++;
+	cputime_switch(next, next == rq->idle);
+	rcu_qs();
+	core->current_thread = next;
+	next->state = THREAD_RUNNING;
+	next->on_cpu = true;
+	next->core = core->id;
+	next->exec_start = now;
+	next->slice_start = next->sum_exec_runtime;
+	fpu_switch(prev, next);
+
+	/* Only a core running a thread needs the tick */
+	if(next == rq->idle) {
+		rq->tick_stopped = false;
+		timer_cancel(&rq->tick_timer);
+		timer_core_idle();
+		return;
+	}
+
+	if(core_isolated(core->id)) {
+		bool int_state = spinlock_acquire_irqsave(&rq->lock);
+		rq->tick_stopped = !sched_tick_needed(core, next);
+		spinlock_release_irqrestore(&rq->lock, int_state);
+
+		if(rq->tick_stopped) {
+			rq->tick_stops++;
+			timer_cancel(&rq->tick_timer);
+			timer_core_idle();
+			return;
+		}
+	}
+
+	if(prev == rq->idle && (int64_t)(now - rq->next_tick) >= 0) {
+		rq->next_tick = now + SCHED_TICK_NS;
+	}
+	sched_arm_tick(rq, now, next->slice);
+}
+
+/**
+ * sched_requeue: Queue a runnable thread that is on no run queue
+ *
+ * The thread stays on its core unless its affinity changed or it is a
+ * real-time thread that can run right away elsewhere
+ *
+ * @param thread: The thread
+ * @param flags: Passed to the enqueue operation of its class
+ */
+void sched_requeue(struct thread* thread, int flags) {
+	uint64_t core = thread->core;
+	if(core >= coreCount || !cpumask_test(&thread->affinity, core) || !cpu_core(core)->rq->online
+		|| thread->policy != SCHED_NORMAL) {
+		core = sched_select_core(thread, core);
+	}
+	sched_enqueue(core, thread, flags);
+}
+
+/**
+ * sched_finish_switch: Called on the stack of the new thread after every switch
+ *
+ * Puts the previous thread back on the run queue if it was preempted or yielded,
+ * or frees it if it exited. A blocked thread is left to thread_wake(). Also
+ * called at the end of every interrupt (see int.S)
+ */
+void sched_finish_switch(void) {
+	struct runqueue* rq = this_core()->rq;
+	if(rq == NULL || rq->prev == NULL) {
+		return;
+	}
+
+	struct thread* prev = rq->prev;
+	rq->prev = NULL;
+	prev->on_cpu = false;
+
+	if(prev == rq->idle) {
+		return;
+	}
+
+	if(rq->prev_requeue) {
+		sched_requeue(prev, rq->prev_preempted ? ENQUEUE_HEAD : 0);
+	} else if(prev->state == THREAD_DEAD) {
+		if(prev->policy == SCHED_DEADLINE) {
+			dl_release(prev);
+		}
+		fpu_thread_free(prev);
+		free(prev->stack);
+		free(prev);
+	}
+}
+
+/* Switch from the interrupted thread to the next one on the run queue, interrupts are disabled */
+static struct regs* sched_preempt(core_t* core, struct regs* r) {
+	struct runqueue* rq = core->rq;
+	struct thread* prev = core->current_thread;
+
+	bool runnable = prev != rq->idle && !sched_throttled(prev);
+	sched_pull_rt(core, runnable ? prev : NULL);
+
+	bool int_state = spinlock_acquire_irqsave(&rq->lock);
+	sched_update_curr(rq, prev, clock_ns());
+	struct thread* next = sched_pick_next(rq, prev, runnable);
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	if(next == NULL) {
+		if(prev == rq->idle || runnable) {
+			prev->slice_start = prev->sum_exec_runtime;
+			return r;
+		}
+		next = rq->idle;
+	}
+
+	/* The thread continues from its interrupt frame */
+	prev->context.rsp = (uint64_t)r;
+	prev->context.rip = (uint64_t)isr_restore;
+	if(prev != rq->idle) {
+		prev->state = THREAD_READY;
+	}
+
+	rq->preemptions++;
+	sched_prepare_switch(core, prev, next, prev != rq->idle);
+	rq->prev_preempted = true;
+
+	/* A preempted thread is continued by returning its frame to isr_common */
+	if(next->context.rip == (uint64_t)isr_restore) {
+		return (struct regs*)next->context.rsp;
+	}
+
+	/* The interrupt never returns here */
+	cputime_irq_exit();
+	context_load(&next->context);
+}
+
+/* The tick timer of a core running a thread */
+static void sched_tick_timer(void* arg) {
+	struct runqueue* rq = arg;
+	core_t* core = this_core();
+	uint64_t now = clock_ns();
+
+	/* Track the recent load of the core and balance every now and then */
+	if((int64_t)(now - rq->next_tick) >= 0) {
+		rq->next_tick = now + SCHED_TICK_NS;
+		int64_t load = (int64_t)(rq_load(core) << SCHED_LOAD_SHIFT);
+		rq->load_avg += (load - (int64_t)rq->load_avg) >> SCHED_LOAD_DECAY;
+		if((++rq->ticks + core->id) % SCHED_BALANCE_TICKS == 0) {
+			sched_balance(core);
+		}
+	}
+
+	struct thread* current = core->current_thread;
+	if(current == rq->idle) {
+		return;
+	}
+
+	bool int_state = spinlock_acquire_irqsave(&rq->lock);
+	sched_update_curr(rq, current, now);
+	uint64_t left = current->sched_class->tick(rq, current);
+	bool stop = !sched_tick_needed(core, current);
+	rq->tick_stopped = stop;
+	spinlock_release_irqrestore(&rq->lock, int_state);
+
+	if(left == 0) {
+		rq->need_resched = true;
+		left = SCHED_TICK_NS;
+	}
+
+	/* Alone on an isolated core, the tick starts again when another thread is queued */
+	if(stop) {
+		rq->tick_stops++;
+		timer_core_idle();
+		return;
+	}
+	sched_arm_tick(rq, now, left);
+}
+
+/**
+ * sched_tick: Called by the LAPIC timer on every core after the timers ran
+ *
+ * Preempts the running thread once its time slice is used up, and the idle
+ * thread if a timer woke a thread on this core
+ *
+ * @param r: Interrupt frame of the running thread
+ * @return The interrupt frame to continue
+ */
+struct regs* sched_tick(struct regs* r) {
+	core_t* core = this_core();
+	struct runqueue* rq = core->rq;
+	if(rq == NULL || core->current_thread == NULL) {
+		return r;
+	}
+
+	if(rq->need_resched || (core->current_thread == rq->idle && rq->nr_running != 0)) {
+		/* Left for preempt_enable() */
+		if(preempt_count() != 0) {
+			rq->need_resched = true;
+			return r;
+		}
+		rq->need_resched = false;
+		return sched_preempt(core, r);
+	}
+	return r;
+}
+
+/* Sent to an idle core when a thread is put on its run queue or to make it steal one, and to preempt for a woken thread */
+static struct regs* sched_ipi_handler(struct regs* r) {
+	lapic_write(LAPIC_REG_EOI, LAPIC_EOI_ACK);
+
+	/* Another core may have handed us timers */
+	timer_program_next();
+
+	core_t* core = this_core();
+	struct runqueue* rq = core->rq;
+	if(rq == NULL || core->current_thread == NULL) {
+		return r;
+	}
+	if(rq->tick_stopped) {
+		sched_restart_tick(rq);
+	}
+	if(core->current_thread != rq->idle && !rq->need_resched) {
+		return r;
+	}
+	if(core->current_thread == rq->idle) {
+		idle_ipi_received();
+	}
+
+	/* Left for preempt_enable() */
+	if(preempt_count() != 0) {
+		rq->need_resched = true;
+		return r;
+	}
+	return sched_preempt(core, r);
+}
+
+/* Switch away from the running thread, preempted if it did not give up the core itself */
+static void sched_switch(bool preempted) {
+	bool int_state = interrupt_toggle(false);
+	core_t* core = this_core();
+	struct runqueue* rq = core->rq;
+	struct thread* prev = core->current_thread;
+
+#ifdef PREEMPT_DEBUG
+	if(preempt_count() != 0) {
+		panic("sched: Switching away with preemption disabled", NULL);
+	}
+#endif
+
+	/* Its pool may need another worker to go on */
+	if(prev->worker != NULL && prev->state == THREAD_BLOCKED) {
+		wq_worker_sleeping(prev);
+	}
+
+	bool runnable = prev != rq->idle && prev->state == THREAD_RUNNING && !sched_throttled(prev)
+		&& cpumask_test(&prev->affinity, core->id);
+	sched_pull_rt(core, runnable ? prev : NULL);
+
+	spinlock_acquire_irqsave(&rq->lock);
+	sched_update_curr(rq, prev, clock_ns());
+	struct thread* next = sched_pick_next(rq, prev, runnable);
+	spinlock_release_irqrestore(&rq->lock, false);
+
+	if(next == NULL) {
+		/* Nothing else to run, keep going if we can */
+		if(prev == rq->idle || runnable) {
+			prev->slice_start = prev->sum_exec_runtime;
+			rq->need_resched = false;
+			interrupt_toggle(int_state);
+			return;
+		}
+		next = rq->idle;
+	}
+
+	bool requeue = prev != rq->idle && prev->state == THREAD_RUNNING;
+	if(requeue) {
+		prev->state = THREAD_READY;
+	}
+
+	sched_prepare_switch(core, prev, next, requeue);
+	if(preempted) {
+		rq->preemptions++;
+		rq->prev_preempted = true;
+	}
+	context_switch(&prev->context, &next->context);
+	sched_finish_switch();
+
+	interrupt_toggle(int_state);
+}
+
+/**
+ * schedule: Give up the core
+ *
+ * A running thread is put back on the run queue, a blocked or dead thread
+ * is not. Returns when the thread is run again. Must not be called with a
+ * spinlock held
+ */
+void schedule(void) {
+	sched_switch(false);
+}
+
+/**
+ * preempt_schedule: Preempt the running thread from thread context
+ *
+ * Called by preempt_enable() when an interrupt wanted to preempt while the
+ * preempt count was raised
+ */
+void preempt_schedule(void) {
+	core_t* core = this_core();
+	if(core->rq == NULL || core->current_thread == NULL) {
+		return;
+	}
+	sched_switch(core->current_thread != core->rq->idle);
+}
+
+void thread_yield(void) {
+	schedule();
+}
+
+/**
+ * thread_wake: Make a blocked thread runnable
+ *
+ * The thread may still be switching away on its core, it is only queued once
+ * the core has left its stack
+ *
+ * @param thread: The thread to wake
+ * @return false if the thread was not blocked
+ */
+bool thread_wake(struct thread* thread) {
+	enum thread_state expected = THREAD_BLOCKED;
+	if(!__atomic_compare_exchange_n(&thread->state, &expected, THREAD_READY, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return false;
+	}
+
+	/* It blocked with interrupts disabled, so this is never the core it is switching away on */
+	while(__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE)) {
+		asm volatile ("pause");
+	}
+
+	if(thread->worker != NULL) {
+		wq_worker_waking_up(thread);
+	}
+	sched_requeue(thread, ENQUEUE_WAKEUP);
+	return true;
+}
+
+/* End the running thread, its stack is freed by the next thread on the core */
+void thread_exit(void) {
+	disable_interrupts();
+	thread_current()->state = THREAD_DEAD;
+	schedule();
+	panic("Exited thread was scheduled again", NULL);
+	__builtin_unreachable();
+}
+
+/**
+ * thread_set_nice: Change the share of CPU time a thread gets
+ *
+ * @param thread: The thread
+ * @param nice: From NICE_MIN for the largest share to NICE_MAX for the smallest
+ */
+void thread_set_nice(struct thread* thread, int nice) {
+	for(;;) {
+		uint64_t core = thread->core;
+		if(core >= coreCount) {
+			fair_set_weight(NULL, thread, nice);
+			return;
+		}
+
+		/* The thread may move to another run queue until we hold the lock of its own */
+		struct runqueue* rq = cpu_core(core)->rq;
+		bool int_state = spinlock_acquire_irqsave(&rq->lock);
+		if(thread->core == core) {
+			fair_set_weight(rq, thread, nice);
+			spinlock_release_irqrestore(&rq->lock, int_state);
+			return;
+		}
+		spinlock_release_irqrestore(&rq->lock, int_state);
+	}
+}
+
+/* Parameters of a policy, see sched_set_attr() */
+struct sched_attr {
+	enum sched_policy policy;
+	int priority;
+	uint64_t runtime;
+	uint64_t deadline;
+	uint64_t period;
+};
+
+/* Switch a thread to a policy, rq is the run queue it is on, locked, or NULL */
+static void sched_apply_attr(struct runqueue* rq, struct thread* thread, const struct sched_attr* attr) {
+	if(thread->policy == SCHED_DEADLINE && attr->policy != SCHED_DEADLINE) {
+		dl_release(thread);
+	}
+
+	bool was_fair = thread->sched_class == &fair_sched_class;
+	thread->policy = attr->policy;
+	thread->rt_priority = 0;
+	thread->rt_slice = 0;
+	thread->dl_throttled = false;
+
+	switch(attr->policy) {
+	case SCHED_DEADLINE:
+		thread->sched_class = &dl_sched_class;
+		thread->dl_runtime = attr->runtime;
+		thread->dl_deadline = attr->deadline;
+		thread->dl_period = attr->period;
+		thread->dl_abs_deadline = clock_ns() + attr->deadline;
+		thread->dl_budget = (int64_t)attr->runtime;
+		break;
+	case SCHED_FIFO:
+	case SCHED_RR:
+		thread->sched_class = &rt_sched_class;
+		thread->rt_priority = attr->priority;
+		break;
+	default:
+		thread->sched_class = &fair_sched_class;
+
+		/* Its vruntime went stale while it was in another class */
+		if(!was_fair && rq) {
+			thread->vruntime = rq->fair.min_vruntime;
+		}
+		break;
+	}
+}
+
+/* Move a thread to another class or change its parameters, wherever it is */
+static void sched_set_attr(struct thread* thread, const struct sched_attr* attr) {
+	bool cancelled = false;
+	for(;;) {
+		uint64_t core_id = thread->core;
+		if(core_id >= coreCount) {
+			sched_apply_attr(NULL, thread, attr);
+			return;
+		}
+
+		/* The thread may move to another run queue until we hold the lock of its own */
+		core_t* core = cpu_core(core_id);
+		struct runqueue* rq = core->rq;
+		bool int_state = spinlock_acquire_irqsave(&rq->lock);
+		if(thread->core != core_id) {
+			spinlock_release_irqrestore(&rq->lock, int_state);
+			continue;
+		}
+
+		/*
+		 * A throttled deadline thread is parked off the queues until
+		 * dl_replenish_timer() requeues it. That takes this lock and
+		 * timer_cancel() waits for it, so the timer is stopped unlocked.
+		 */
+		if(thread->dl_parked && (!cancelled || timer_pending(&thread->dl_timer))) {
+			spinlock_release_irqrestore(&rq->lock, int_state);
+			timer_cancel(&thread->dl_timer);
+			cancelled = true;
+			continue;
+		}
+
+		/* Its new parameters apply right away, not at the next period */
+		bool parked = thread->dl_parked;
+		thread->dl_parked = false;
+
+		bool queued = thread->on_rq;
+		if(queued) {
+			thread->sched_class->dequeue(rq, thread);
+		}
+		sched_apply_attr(rq, thread, attr);
+		if(queued || parked) {
+			thread->sched_class->enqueue(rq, thread, core_id, 0);
+		}
+
+		/* The running thread may not be the most important anymore, or the changed one is now */
+		bool resched = core->current_thread == thread || ((queued || parked) && sched_prio(rq, thread) > rq->curr_prio);
+		if(resched) {
+			rq->need_resched = true;
+		}
+		spinlock_release_irqrestore(&rq->lock, int_state);
+
+		if(resched && rq->online) {
+			lapic_issue_ipi(core->lapic_id, SCHED_IPI_VECTOR, 0, 0);
+		}
+		return;
+	}
+}
+
+/**
+ * thread_set_policy: Move a thread to the fair or real-time class
+ *
+ * @param thread: The thread
+ * @param policy: SCHED_NORMAL, SCHED_FIFO or SCHED_RR, use thread_set_deadline() for SCHED_DEADLINE
+ * @param priority: From RT_PRIO_MIN to RT_PRIO_MAX for the real-time policies, 0 for SCHED_NORMAL
+ * @return false if the policy or priority is invalid
+ */
+bool thread_set_policy(struct thread* thread, enum sched_policy policy, int priority) {
+	if(policy == SCHED_NORMAL && priority != 0) {
+		return false;
+	}
+	if((policy == SCHED_FIFO || policy == SCHED_RR) && (priority < RT_PRIO_MIN || priority > RT_PRIO_MAX)) {
+		return false;
+	}
+	if(policy >= SCHED_DEADLINE) {
+		return false;
+	}
+
+	struct sched_attr attr = {
+		.policy = policy,
+		.priority = priority,
+	};
+	sched_set_attr(thread, &attr);
+	return true;
+}
+
+/**
+ * thread_set_deadline: Move a thread to the deadline class
+ *
+ * The thread gets runtime nanoseconds every period, each time within deadline
+ * of the period starting
+ *
+ * @param thread: The thread
+ * @param runtime: Budget per period, at least SCHED_DL_RUNTIME_MIN
+ * @param deadline: Relative deadline, from runtime to period
+ * @param period: The period, at most SCHED_DL_PERIOD_MAX
+ * @return false if the parameters are invalid or the bandwidth isn't available
+ */
+bool thread_set_deadline(struct thread* thread, uint64_t runtime, uint64_t deadline, uint64_t period) {
+	if(runtime < SCHED_DL_RUNTIME_MIN || runtime > deadline || deadline > period || period > SCHED_DL_PERIOD_MAX) {
+		return false;
+	}
+	if(!dl_admit(thread, runtime, period)) {
+		return false;
+	}
+
+	struct sched_attr attr = {
+		.policy = SCHED_DEADLINE,
+		.runtime = runtime,
+		.deadline = deadline,
+		.period = period,
+	};
+	sched_set_attr(thread, &attr);
+	return true;
+}
+
+/**
+ * thread_set_affinity: Change the cores a thread may run on
+ *
+ * Takes effect the next time the thread is switched out, right away for the calling thread
+ *
+ * @param thread: The thread
+ * @param affinity: Cores the thread may run on
+ * @return false if none of the cores are scheduling, the affinity is not changed then
+ */
+bool thread_set_affinity(struct thread* thread, const cpumask_t* affinity) {
+	bool online = false;
+	for(uint64_t i = 0; i < coreCount && !online; i++) {
+		online = cpumask_test(affinity, i) && cpu_core(i)->rq->online;
+	}
+	if(!online) {
+		return false;
+	}
+
+	thread->affinity = *affinity;
+	if(thread == thread_current() && !cpumask_test(affinity, thread->core)) {
+		schedule();
+	}
+	return true;
+}
+
+/**
+ * thread_create_on: Start a thread bound to a core
+ *
+ * @param core: Index of the only core that runs the thread
+ * @param name: Name of the thread, not copied
+ * @param entry: Function the thread runs, returning from it ends the thread
+ * @param arg: Argument passed to entry
+ * @return The thread or NULL if there was no memory for it
+ */
+struct thread* thread_create_on(uint64_t core, const char* name, void (*entry)(void* arg), void* arg) {
+	struct thread* thread = thread_alloc(name, entry, arg);
+	if(thread == NULL) {
+		return NULL;
+	}
+
+	cpumask_clear_all(&thread->affinity);
+	cpumask_set(&thread->affinity, core);
+	sched_enqueue(core, thread, ENQUEUE_NEW);
+	return thread;
+}
+
+/* Start a thread on the online core with the least threads */
+struct thread* thread_create(const char* name, void (*entry)(void* arg), void* arg) {
+	struct thread* thread = thread_alloc(name, entry, arg);
+	if(thread == NULL) {
+		return NULL;
+	}
+
+	sched_enqueue(sched_select_core(thread, this_core()->id), thread, ENQUEUE_NEW);
+	return thread;
+}
+
+/* Runs when the run queue of a core is empty */
+static void sched_idle(void* arg) {
+	struct runqueue* rq = arg;
+
+	for(;;) {
+		/* Help out busy cores */
+		if(rq->nr_running == 0) {
+			sched_steal(this_core());
+		}
+
+		/* A thread queued after the check still wakes us, see idle_wait() */
+		disable_interrupts();
+		if(rq->nr_running != 0) {
+			enable_interrupts();
+			schedule();
+		} else {
+			idle_wait();
+		}
+	}
+}
+
+/* Allocate the run queues and idle threads of all cores */
+void __init sched_init(void) {
+	kernel_process.pagemap = mmu_kernel_pagemap;
+
+	if(coreCount > CPUMASK_MAX_CORES) {
+		panic("sched: More cores than a cpumask can hold", NULL);
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct runqueue* rq = aligned_alloc(CACHELINE_SIZE, sizeof(struct runqueue));
+		if(rq == NULL) {
+			panic("sched: Out of memory for run queues", NULL);
+		}
+		memset(rq, 0, sizeof(struct runqueue));
+
+		rq->idle = thread_alloc("idle", sched_idle, rq);
+		if(rq->idle == NULL) {
+			panic("sched: Out of memory for idle threads", NULL);
+		}
+		rq->idle->core = i;
+		cpumask_clear_all(&rq->idle->affinity);
+		cpumask_set(&rq->idle->affinity, i);
+		timer_setup(&rq->tick_timer, sched_tick_timer, rq, TIMER_PINNED | TIMER_HRES);
+
+		cpu_core(i)->rq = rq;
+	}
+
+	sched_init_domains();
+
+	irq_install(sched_ipi_handler, SCHED_IPI_VECTOR);
+	idle_init();
+}
+
+/**
+ * sched_enter: Start scheduling on this core
+ *
+ * Leaves the bootloader provided stack for the idle thread of the core, the
+ * bootloader stacks are reclaimed afterwards
+ */
+void sched_enter(void) {
+	disable_interrupts();
+
+	core_t* core = this_core();
+	struct runqueue* rq = core->rq;
+	struct thread* idle = rq->idle;
+
+	idle->state = THREAD_RUNNING;
+	idle->on_cpu = true;
+	core->current_thread = idle;
+	rq->online = true;
+
+	if(!core->bsp) {
+		__atomic_add_fetch(&cores_entered, 1, __ATOMIC_SEQ_CST);
+	}
+
+	context_load(&idle->context);
+}
+
+/**
+ * sched_start: Start scheduling on the BSP
+ *
+ * Waits for all APs to be scheduling, so init can reclaim the bootloader memory
+ *
+ * @param init: The first thread, run on the BSP
+ * @param arg: Argument passed to init
+ */
+void sched_start(void (*init)(void* arg), void* arg) {
+	while(__atomic_load_n(&cores_entered, __ATOMIC_SEQ_CST) != coreCount - 1) {
+		asm volatile ("pause");
+	}
+
+	struct thread* thread = thread_alloc("kinit", init, arg);
+	if(thread == NULL) {
+		panic("sched: Can't create the init thread", NULL);
+	}
+	sched_enqueue(this_core()->id, thread, ENQUEUE_NEW);
+
+	kprintf("sched: Scheduling on %lu cores\n", coreCount);
+	sched_enter();
+}
+
+/* Print the run queue statistics of all cores */
+void sched_print_stats(void) {
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct runqueue* rq = cpu_core(i)->rq;
+		kprintf("sched: core %lu: %lu queued (%lu dl, %lu rt), load %lu.%02lu, %lu switches, %lu preemptions, %lu steals, %lu balanced, %lu rt pulled, %lu migrations, %lu tick stops\n",
+			i, rq->nr_running, rq->dl.nr_running, rq->rt.nr_running,
+			rq->load_avg >> SCHED_LOAD_SHIFT, ((rq->load_avg & ((1 << SCHED_LOAD_SHIFT) - 1)) * 100) >> SCHED_LOAD_SHIFT,
+			rq->switches, rq->preemptions, rq->steals, rq->balance_pulls, rq->rt_pulls, rq->migrations, rq->tick_stops);
+	}
+	idle_print_stats();
+	cputime_print_stats();
+	rcu_print_stats();
+	smp_call_print_stats();
+#ifdef PREEMPT_DEBUG
+	preempt_print_stats();
+#endif
+}
@@ -0,0 +1,226 @@
+/**
+ * wait.c: Wait queues and completions
+ *
+ * A thread on a wait queue is blocked and not on any run queue, it uses no
+ * core until it is woken with thread_wake()
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/wait.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/timer.h>
+
+/* Timer of a sleep with a deadline */
+struct wait_timeout {
+	struct wait_queue* wq;
+	struct waiter* waiter;
+	volatile bool timed_out;
+};
+
+void wait_queue_init(struct wait_queue* wq) {
+	wq->lock = (spinlock_t)SPINLOCK_ZERO;
+	wq->head = NULL;
+	wq->tail = NULL;
+}
+
+/* Take a waiter off the queue, the caller holds the lock */
+static void waiter_unlink(struct wait_queue* wq, struct waiter* waiter) {
+	struct waiter* prev = NULL;
+	for(struct waiter* cur = wq->head; cur != waiter; prev = cur, cur = cur->next);
+
+	if(prev) {
+		prev->next = waiter->next;
+	} else {
+		wq->head = waiter->next;
+	}
+	if(wq->tail == waiter) {
+		wq->tail = prev;
+	}
+	waiter->queued = false;
+}
+
+/* The deadline passed before the waiter was woken */
+static void wait_timeout_expired(void* arg) {
+	struct wait_timeout* timeout = arg;
+	bool int_state = spinlock_acquire_irqsave(&timeout->wq->lock);
+	if(timeout->waiter->queued) {
+		waiter_unlink(timeout->wq, timeout->waiter);
+		timeout->timed_out = true;
+		thread_wake(timeout->waiter->thread);
+	}
+	spinlock_release_irqrestore(&timeout->wq->lock, int_state);
+}
+
+/**
+ * wait_queue_sleep_locked_until: Block the running thread on a wait queue until a deadline
+ *
+ * Called with the lock of the queue held, which is released. Returns once
+ * the thread is woken or the deadline passed, with the lock not held
+ *
+ * @param wq: The wait queue
+ * @param int_state: Interrupt state returned when the lock was acquired
+ * @param deadline: clock_ns() time to give up at, UINT64_MAX for never
+ * @return false if the deadline passed
+ */
+bool wait_queue_sleep_locked_until(struct wait_queue* wq, bool int_state, uint64_t deadline) {
+	struct thread* thread = thread_current();
+	if(thread == NULL || thread == this_core()->rq->idle) {
+		panic("wait: Only threads can sleep", NULL);
+	}
+
+	if(deadline != UINT64_MAX && clock_ns() >= deadline) {
+		spinlock_release_irqrestore(&wq->lock, int_state);
+		return false;
+	}
+
+	struct waiter waiter = {
+		.thread = thread,
+		.next = NULL,
+		.queued = true,
+	};
+
+	if(wq->tail) {
+		wq->tail->next = &waiter;
+	} else {
+		wq->head = &waiter;
+	}
+	wq->tail = &waiter;
+	thread->state = THREAD_BLOCKED;
+
+	struct wait_timeout timeout = {
+		.wq = wq,
+		.waiter = &waiter,
+		.timed_out = false,
+	};
+	struct timer timer;
+	if(deadline != UINT64_MAX) {
+		timer_setup(&timer, wait_timeout_expired, &timeout, 0);
+		timer_arm(&timer, deadline, 0);
+	}
+
+	/* Interrupts stay disabled until the core has switched away */
+	spinlock_release_irqrestore(&wq->lock, false);
+	schedule();
+
+	/* The timer may still be looking at the waiter on another core */
+	if(deadline != UINT64_MAX) {
+		timer_cancel(&timer);
+	}
+	interrupt_toggle(int_state);
+	return !timeout.timed_out;
+}
+
+/**
+ * wait_queue_sleep_locked: Block the running thread on a wait queue
+ *
+ * Called with the lock of the queue held, which is released. Returns once
+ * the thread is woken, with the lock not held
+ *
+ * @param wq: The wait queue
+ * @param int_state: Interrupt state returned when the lock was acquired
+ */
+void wait_queue_sleep_locked(struct wait_queue* wq, bool int_state) {
+	wait_queue_sleep_locked_until(wq, int_state, UINT64_MAX);
+}
+
+/* Unlink the first waiter and wake it, the caller holds the lock */
+static bool wake_first(struct wait_queue* wq) {
+	struct waiter* waiter = wq->head;
+	if(waiter == NULL) {
+		return false;
+	}
+
+	wq->head = waiter->next;
+	if(wq->head == NULL) {
+		wq->tail = NULL;
+	}
+
+	/* The waiter is gone from the stack once its thread runs again */
+	struct thread* thread = waiter->thread;
+	waiter->queued = false;
+	thread_wake(thread);
+	return true;
+}
+
+/* Wake the thread waiting the longest, false if there was none */
+bool wake_up_one(struct wait_queue* wq) {
+	bool int_state = spinlock_acquire_irqsave(&wq->lock);
+	bool woken = wake_first(wq);
+	spinlock_release_irqrestore(&wq->lock, int_state);
+	return woken;
+}
+
+/* Wake all threads on the queue, returns how many were woken */
+uint64_t wake_up_all(struct wait_queue* wq) {
+	uint64_t woken = 0;
+	bool int_state = spinlock_acquire_irqsave(&wq->lock);
+	while(wake_first(wq)) {
+		woken++;
+	}
+	spinlock_release_irqrestore(&wq->lock, int_state);
+	return woken;
+}
+
+void completion_init(struct completion* completion) {
+	completion->done = 0;
+	wait_queue_init(&completion->wait);
+}
+
+/* Consume one completion if there is one */
+bool try_wait_for_completion(struct completion* completion) {
+	uint64_t done = __atomic_load_n(&completion->done, __ATOMIC_ACQUIRE);
+	while(done != 0) {
+		if(done == COMPLETION_ALL) {
+			return true;
+		}
+		if(__atomic_compare_exchange_n(&completion->done, &done, done - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Sleep until complete() or complete_all() is called */
+void wait_for_completion(struct completion* completion) {
+	while(!try_wait_for_completion(completion)) {
+		wait_event(&completion->wait, completion->done != 0);
+	}
+}
+
+/* Sleep until complete() or complete_all() is called, false if ns passed first */
+bool wait_for_completion_timeout(struct completion* completion, uint64_t ns) {
+	uint64_t deadline = clock_ns() + ns;
+	while(!try_wait_for_completion(completion)) {
+		uint64_t now = clock_ns();
+		if(now >= deadline || !wait_event_timeout(&completion->wait, completion->done != 0, deadline - now)) {
+			return try_wait_for_completion(completion);
+		}
+	}
+	return true;
+}
+
+/* Let one waiter, current or future, through */
+void complete(struct completion* completion) {
+	bool int_state = spinlock_acquire_irqsave(&completion->wait.lock);
+
+	/* Waiters take completions without the lock */
+	uint64_t done = __atomic_load_n(&completion->done, __ATOMIC_ACQUIRE);
+	while(done != COMPLETION_ALL && !__atomic_compare_exchange_n(&completion->done, &done, done + 1,
+		false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	wake_first(&completion->wait);
+	spinlock_release_irqrestore(&completion->wait.lock, int_state);
+}
+
+/* Let every waiter through until reinit_completion() */
+void complete_all(struct completion* completion) {
+	bool int_state = spinlock_acquire_irqsave(&completion->wait.lock);
+	__atomic_store_n(&completion->done, COMPLETION_ALL, __ATOMIC_RELEASE);
+	while(wake_first(&completion->wait));
+	spinlock_release_irqrestore(&completion->wait.lock, int_state);
+}
+
+void reinit_completion(struct completion* completion) {
+	completion->done = 0;
+}
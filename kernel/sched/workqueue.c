@@ -0,0 +1,381 @@
+/**
+ * workqueue.c: Deferred work run by kernel threads
+ *
+ * Every core has a pool of workers bound to it, and there is an unbound pool
+ * whose workers run anywhere. Work is queued without allocating, so it can
+ * be queued from interrupts and with locks held.
+ *
+ * A bound pool runs one worker at a time. The scheduler tells the pool when a
+ * worker blocks (wq_worker_sleeping()), and only then is an idle worker woken
+ * to continue with the queued work. A worker taking work first makes sure an
+ * idle worker is left for that, and workers beyond WQ_MAX_IDLE_WORKERS exit
+ * when they run out of work.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/workqueue.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/kprintf.h>
+#include <kernel/timer.h>
+
+struct workqueue system_wq = {
+	.name = "events",
+	.flags = 0,
+};
+
+struct workqueue system_unbound_wq = {
+	.name = "events_unbound",
+	.flags = WQ_UNBOUND,
+};
+
+/* One pool per core, NULL until workqueue_init() */
+static struct worker_pool* bound_pools = NULL;
+static struct worker_pool unbound_pool;
+
+static void worker_thread(void* arg);
+
+void work_init(struct work* work, work_func_t func) {
+	work->func = func;
+	work->next = NULL;
+	work->pool = NULL;
+	work->pending = false;
+}
+
+/* Wake an idle worker of the pool, the caller holds the pool lock */
+static bool wake_idle_worker(struct worker_pool* pool) {
+	struct worker* worker = pool->idle;
+	if(worker == NULL) {
+		return false;
+	}
+
+	/* The worker clears its idle flag itself once it runs */
+	pool->idle = worker->next;
+	worker->next = NULL;
+	pool->nr_idle--;
+	__atomic_add_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+	thread_wake(worker->thread);
+	return true;
+}
+
+/* Start another worker in the pool, called by a worker without the pool lock */
+static void create_worker(struct worker_pool* pool) {
+	struct worker* worker = malloc(sizeof(struct worker));
+	if(worker == NULL) {
+		return;
+	}
+	memset(worker, 0, sizeof(struct worker));
+	worker->pool = pool;
+
+	/* It counts as running until it goes idle */
+	bool int_state = spinlock_acquire_irqsave(&pool->lock);
+	pool->nr_workers++;
+	__atomic_add_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+	spinlock_release_irqrestore(&pool->lock, int_state);
+
+	struct thread* thread;
+	if(pool->unbound) {
+		thread = thread_create("kworker/u", worker_thread, worker);
+	} else {
+		thread = thread_create_on(pool->core, "kworker", worker_thread, worker);
+	}
+
+	int_state = spinlock_acquire_irqsave(&pool->lock);
+	if(thread == NULL) {
+		pool->nr_workers--;
+		__atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+		free(worker);
+	} else {
+		pool->created++;
+	}
+	spinlock_release_irqrestore(&pool->lock, int_state);
+}
+
+/* Runs the work of its pool */
+static void worker_thread(void* arg) {
+	struct worker* worker = arg;
+	struct worker_pool* pool = worker->pool;
+	struct thread* self = thread_current();
+	worker->thread = self;
+	self->worker = worker;
+
+	bool int_state = spinlock_acquire_irqsave(&pool->lock);
+	for(;;) {
+		/* A bound pool runs one worker at a time, extra ones go idle once a blocked one woke up */
+		bool crowded = !pool->unbound && __atomic_load_n(&pool->nr_running, __ATOMIC_SEQ_CST) > 1;
+		if(pool->head == NULL || crowded) {
+			if(pool->nr_idle >= WQ_MAX_IDLE_WORKERS) {
+				pool->nr_workers--;
+				__atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+				spinlock_release_irqrestore(&pool->lock, int_state);
+				self->worker = NULL;
+				free(worker);
+				thread_exit();
+			}
+
+			worker->idle = true;
+			worker->next = pool->idle;
+			pool->idle = worker;
+			pool->nr_idle++;
+			__atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+			self->state = THREAD_BLOCKED;
+
+			/* Interrupts stay disabled until the core has switched away */
+			spinlock_release_irqrestore(&pool->lock, false);
+			schedule();
+			worker->idle = false;
+			interrupt_toggle(int_state);
+			int_state = spinlock_acquire_irqsave(&pool->lock);
+			continue;
+		}
+
+		/* Leave an idle worker behind in case this one blocks */
+		if(pool->nr_idle == 0 && !pool->creating && pool->nr_workers < WQ_MAX_WORKERS) {
+			pool->creating = true;
+			spinlock_release_irqrestore(&pool->lock, int_state);
+			create_worker(pool);
+			int_state = spinlock_acquire_irqsave(&pool->lock);
+			pool->creating = false;
+			continue;
+		}
+
+		struct work* work = pool->head;
+		pool->head = work->next;
+		if(pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		work->next = NULL;
+
+		/* It may be queued again from now on, also by its own function */
+		__atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+		spinlock_release_irqrestore(&pool->lock, int_state);
+
+		work->func(work);
+
+		int_state = spinlock_acquire_irqsave(&pool->lock);
+		pool->processed++;
+	}
+}
+
+/* Put pending work on a pool and wake a worker if it needs one */
+static bool pool_queue_work(struct worker_pool* pool, struct work* work) {
+	bool int_state = spinlock_acquire_irqsave(&pool->lock);
+	work->pool = pool;
+	work->next = NULL;
+	if(pool->tail) {
+		pool->tail->next = work;
+	} else {
+		pool->head = work;
+	}
+	pool->tail = work;
+
+	if(pool->unbound || __atomic_load_n(&pool->nr_running, __ATOMIC_SEQ_CST) == 0) {
+		wake_idle_worker(pool);
+	}
+	spinlock_release_irqrestore(&pool->lock, int_state);
+	return true;
+}
+
+/* Queue work that is already marked pending */
+static bool __queue_work(uint64_t core, struct workqueue* wq, struct work* work) {
+	if(bound_pools == NULL) {
+		/* Too early, nothing would run it */
+		__atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	if(wq->flags & WQ_UNBOUND) {
+		return pool_queue_work(&unbound_pool, work);
+	}
+	return pool_queue_work(&bound_pools[core], work);
+}
+
+/**
+ * queue_work_on: Run work on a core
+ *
+ * @param core: Index of the core, ignored for an unbound workqueue
+ * @param wq: The workqueue
+ * @param work: The work, must stay valid until it ran
+ * @return false if the work was already pending
+ */
+bool queue_work_on(uint64_t core, struct workqueue* wq, struct work* work) {
+	if(__atomic_exchange_n(&work->pending, true, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+	return __queue_work(core, wq, work);
+}
+
+/* Run work on this core, or any core for an unbound workqueue */
+bool queue_work(struct workqueue* wq, struct work* work) {
+	bool int_state = interrupt_toggle(false);
+	bool queued = queue_work_on(this_core()->id, wq, work);
+	interrupt_toggle(int_state);
+	return queued;
+}
+
+static void delayed_work_timer(void* arg) {
+	struct delayed_work* dwork = arg;
+	__queue_work(this_core()->id, dwork->wq, &dwork->work);
+}
+
+void delayed_work_init(struct delayed_work* dwork, work_func_t func) {
+	work_init(&dwork->work, func);
+	timer_setup(&dwork->timer, delayed_work_timer, dwork, 0);
+	dwork->wq = NULL;
+}
+
+/**
+ * queue_delayed_work: Run work once a delay passed
+ *
+ * The timer has a sixteenth of the delay as slack, so delayed work coalesces
+ * with other timers
+ *
+ * @param wq: The workqueue
+ * @param dwork: The work
+ * @param delay_ns: Nanoseconds to wait
+ * @return false if the work was already pending
+ */
+bool queue_delayed_work(struct workqueue* wq, struct delayed_work* dwork, uint64_t delay_ns) {
+	if(__atomic_exchange_n(&dwork->work.pending, true, __ATOMIC_ACQ_REL)) {
+		return false;
+	}
+
+	dwork->wq = wq;
+	if(delay_ns == 0) {
+		bool int_state = interrupt_toggle(false);
+		bool queued = __queue_work(this_core()->id, wq, &dwork->work);
+		interrupt_toggle(int_state);
+		return queued;
+	}
+
+	timer_arm(&dwork->timer, clock_ns() + delay_ns, delay_ns >> 4);
+	return true;
+}
+
+/**
+ * cancel_work: Take queued work off its pool
+ *
+ * Work whose function already started is not waited for
+ *
+ * @param work: The work
+ * @return false if the work was not queued
+ */
+bool cancel_work(struct work* work) {
+	struct worker_pool* pool = work->pool;
+	if(pool == NULL) {
+		return false;
+	}
+
+	bool int_state = spinlock_acquire_irqsave(&pool->lock);
+	struct work* prev = NULL;
+	struct work* cur = pool->head;
+	for(; cur != NULL && cur != work; prev = cur, cur = cur->next);
+
+	if(cur != NULL) {
+		if(prev) {
+			prev->next = work->next;
+		} else {
+			pool->head = work->next;
+		}
+		if(pool->tail == work) {
+			pool->tail = prev;
+		}
+		work->next = NULL;
+		__atomic_store_n(&work->pending, false, __ATOMIC_RELEASE);
+	}
+	spinlock_release_irqrestore(&pool->lock, int_state);
+	return cur != NULL;
+}
+
+/* Stop delayed work from running, false if it was not pending */
+bool cancel_delayed_work(struct delayed_work* dwork) {
+	if(timer_cancel(&dwork->timer)) {
+		__atomic_store_n(&dwork->work.pending, false, __ATOMIC_RELEASE);
+		return true;
+	}
+	return cancel_work(&dwork->work);
+}
+
+/**
+ * wq_worker_sleeping: Called by schedule() when a worker blocks
+ *
+ * Wakes an idle worker if the pool has no running worker left for its
+ * queued work. Interrupts are disabled
+ *
+ * @param thread: The worker thread
+ */
+void wq_worker_sleeping(struct thread* thread) {
+	struct worker* worker = thread->worker;
+	if(worker->idle) {
+		return;
+	}
+
+	struct worker_pool* pool = worker->pool;
+	__atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+	uint64_t running = __atomic_sub_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+
+	/* Woken before we got here, wq_worker_waking_up() may have missed it */
+	if(__atomic_load_n(&thread->state, __ATOMIC_SEQ_CST) != THREAD_BLOCKED) {
+		if(__atomic_exchange_n(&worker->sleeping, false, __ATOMIC_SEQ_CST)) {
+			__atomic_add_fetch(&pool->nr_running, 1, __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	if(running == 0 && pool->head != NULL) {
+		spinlock_acquire_irqsave(&pool->lock);
+		if(pool->head != NULL && __atomic_load_n(&pool->nr_running, __ATOMIC_SEQ_CST) == 0) {
+			wake_idle_worker(pool);
+		}
+		spinlock_release_irqrestore(&pool->lock, false);
+	}
+}
+
+/* Called by thread_wake() when a worker is woken */
+void wq_worker_waking_up(struct thread* thread) {
+	struct worker* worker = thread->worker;
+	if(__atomic_exchange_n(&worker->sleeping, false, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&worker->pool->nr_running, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void pool_init(struct worker_pool* pool, uint64_t core, bool unbound) {
+	memset(pool, 0, sizeof(struct worker_pool));
+	pool->core = core;
+	pool->unbound = unbound;
+}
+
+/* Create the pools and their first workers, called by kinit once all cores are scheduling */
+void workqueue_init(void) {
+	struct worker_pool* pools = malloc(sizeof(struct worker_pool) * coreCount);
+	if(pools == NULL) {
+		panic("workqueue: Out of memory for worker pools", NULL);
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		pool_init(&pools[i], i, false);
+	}
+	pool_init(&unbound_pool, coreCount, true);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		create_worker(&pools[i]);
+	}
+	create_worker(&unbound_pool);
+
+	__atomic_store_n(&bound_pools, pools, __ATOMIC_RELEASE);
+}
+
+/* Print the work done by every pool */
+void workqueue_print_stats(void) {
+	if(bound_pools == NULL) {
+		return;
+	}
+
+	for(uint64_t i = 0; i <= coreCount; i++) {
+		struct worker_pool* pool = i < coreCount ? &bound_pools[i] : &unbound_pool;
+		kprintf("workqueue: pool %s%lu: %lu workers (%lu idle, %lu running), %lu created, %lu processed\n",
+			pool->unbound ? "u" : "", i, pool->nr_workers, pool->nr_idle, pool->nr_running, pool->created, pool->processed);
+	}
+}
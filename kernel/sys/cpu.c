@@ -6,6 +6,7 @@
 #include <kernel/cpufeature.h>
 #include <kernel/mmu.h>
 #include <kernel/apic.h>
+#include <kernel/int.h>
 
 #define EFER_SYSCALLENABLE 1
 
@@ -15,9 +16,6 @@ spinlock_t paniclock = SPINLOCK_ZERO;
 /* Store CPU Features as a uint64_t and access them based on bits in the variable */
 uint64_t cpu_features = 0;
 
-/* All read and writes on core_local will be done as %gs:offset using __seg_gs */
-static core_t __seg_gs const* core_local = 0;
-
 /**
  * Handle fatal exceptions.
  * 
@@ -27,13 +25,14 @@ static core_t __seg_gs const* core_local = 0;
  * @param r Interrupt register context
 */
 void panic(const char* desc, struct regs* r) {
-	bool int_state = spinlock_acquire(&paniclock);
+	bool int_state = spinlock_acquire_irqsave(&paniclock);
+	kprintf_panic();
 
 	/* Clear screen and display panic */
 	kprintf("\033[0;41m");
 	clear_screen();
 	reset_cursor();
-	kprintf("\nKernel panic! (%s) on core %lu\n", desc, core_local->lapic_id);
+	kprintf("\nKernel panic! (%s) on core %lu\n", desc, this_cpu_read(percpu_core.lapic_id));
 
 	/* If no register state is provided then dont display anything */
 	if(r == NULL) goto _done;
@@ -55,15 +54,15 @@ void panic(const char* desc, struct regs* r) {
 		rdmsr(0xc0000101), rdmsr(0xc0000102));
 	kprintf("  cr0=0x%016lx cr2=0x%016lx cr3=0x%016lx cr4=0x%016lx\n",
 		read_cr0(), read_cr2(), read_cr3(), read_cr4());
-	kprintf("  core=%lu bsp=%s\n", core_local->lapic_id, core_local->bsp ? "true" : "false");
+	kprintf("  core=%lu bsp=%s\n", this_cpu_read(percpu_core.lapic_id), this_cpu_read(percpu_core.bsp) ? "true" : "false");
 
 	goto _done;
 
 _done:
 	stacktrace();
 	kprintf("\033[0m");
-	lapic_issue_ipi(0, 255, 3, 0);
-	spinlock_release(&paniclock, int_state);
+	lapic_issue_ipi(0, HALT_IPI_VECTOR, LAPIC_IPI_ALL_BUT_SELF, 0);
+	spinlock_release_irqrestore(&paniclock, int_state);
 	fatal();
 }
 
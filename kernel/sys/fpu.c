@@ -0,0 +1,235 @@
+/**
+ * fpu.c: Lazy x87, SSE and AVX state switching
+ *
+ * A thread gets a save area the first time it uses a vector register. CR0.TS
+ * is set when a thread is switched in, so its state is only restored by the
+ * #NM of its first vector instruction. A thread that used the FPU is saved when
+ * it is switched out, with XSAVES or XSAVEOPT the unmodified components are
+ * skipped. If it comes back to the same core and nobody else restored their
+ * state there, the registers still hold its state and TS is left clear.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <cpuid.h>
+#include <kernel/fpu.h>
+#include <kernel/cpu.h>
+#include <kernel/cpufeature.h>
+#include <kernel/scheduler.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+#include <kernel/msr.h>
+#include <kernel/mmu.h>
+
+enum fpu_save_mode {
+	FPU_FXSAVE,
+	FPU_XSAVE,
+	FPU_XSAVEOPT,
+	FPU_XSAVES,
+};
+
+static const char* fpu_mode_names[] = {"FXSAVE", "XSAVE", "XSAVEOPT", "XSAVES"};
+
+uint64_t fpu_state_size = 512;
+
+/* Components enabled in XCR0 */
+static uint64_t fpu_xcr0 = 0;
+static enum fpu_save_mode fpu_mode = FPU_FXSAVE;
+
+/* Set by the first core, the others use the same configuration */
+static bool fpu_detected = false;
+
+/* XSAVE header, follows the 512 byte legacy region */
+#define XSAVE_HEADER_OFFSET 512
+#define XCOMP_BV_COMPACTED ((uint64_t)1 << 63)
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+	asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void write_cr0(uint64_t cr0) {
+	asm volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void write_cr4(uint64_t cr4) {
+	asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void clts(void) {
+	asm volatile ("clts" ::: "memory");
+}
+
+static void fpu_save(void* area) {
+	uint32_t low = (uint32_t)fpu_xcr0, high = (uint32_t)(fpu_xcr0 >> 32);
+	switch(fpu_mode) {
+		case FPU_XSAVES: asm volatile ("xsaves64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory"); break;
+		case FPU_XSAVEOPT: asm volatile ("xsaveopt64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory"); break;
+		case FPU_XSAVE: asm volatile ("xsave64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory"); break;
+		case FPU_FXSAVE: asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory"); break;
+	}
+}
+
+static void fpu_restore(void* area) {
+	uint32_t low = (uint32_t)fpu_xcr0, high = (uint32_t)(fpu_xcr0 >> 32);
+	switch(fpu_mode) {
+		case FPU_XSAVES: asm volatile ("xrstors64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory"); break;
+		case FPU_XSAVEOPT:
+		case FPU_XSAVE: asm volatile ("xrstor64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory"); break;
+		case FPU_FXSAVE: asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory"); break;
+	}
+}
+
+/* Allocate a save area that restores to the initial state */
+static void* fpu_alloc_state(void) {
+	uint8_t* area = aligned_alloc(64, fpu_state_size);
+	if(area == NULL) {
+		return NULL;
+	}
+	memset(area, 0, fpu_state_size);
+
+	/* FCW and MXCSR are loaded from the legacy region, the rest starts out initialized */
+	*(uint16_t*)(area + 0) = 0x37F;
+	*(uint32_t*)(area + 24) = 0x1F80;
+	if(fpu_mode == FPU_XSAVES) {
+		*(uint64_t*)(area + XSAVE_HEADER_OFFSET + 8) = XCOMP_BV_COMPACTED | fpu_xcr0;
+	}
+	return area;
+}
+
+/* Pick the components and the save instruction, done once */
+static void __init fpu_detect(void) {
+	if(!cpu_has_feature(CPU_FEATURE_XSAVE)) {
+		return;
+	}
+
+	uint32_t eax, ebx, ecx, edx;
+	__cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+	uint64_t supported = ((uint64_t)edx << 32) | eax;
+
+	fpu_xcr0 = XSTATE_X87 | XSTATE_SSE;
+	if(supported & XSTATE_AVX) {
+		fpu_xcr0 |= XSTATE_AVX;
+
+		/* AVX-512 components can only be enabled together */
+		if((supported & XSTATE_AVX512) == XSTATE_AVX512) {
+			fpu_xcr0 |= XSTATE_AVX512;
+		}
+	}
+
+	__cpuid_count(0xD, 1, eax, ebx, ecx, edx);
+	if(eax & (1 << 3)) {
+		fpu_mode = FPU_XSAVES;
+	} else if(eax & (1 << 0)) {
+		fpu_mode = FPU_XSAVEOPT;
+	} else {
+		fpu_mode = FPU_XSAVE;
+	}
+}
+
+/* Set the size of the save area, XCR0 has to be loaded first */
+static void __init fpu_detect_size(void) {
+	uint32_t eax, ebx, ecx, edx;
+	if(fpu_mode == FPU_XSAVES) {
+		/* Compacted size of XCR0 | IA32_XSS, no supervisor state is enabled */
+		__cpuid_count(0xD, 1, eax, ebx, ecx, edx);
+	} else {
+		/* Standard format size of what XCR0 enables */
+		__cpuid_count(0xD, 0, eax, ebx, ecx, edx);
+	}
+	fpu_state_size = ebx;
+}
+
+/* Enable the FPU, SSE and XSAVE on this core and leave CR0.TS set */
+void __init fpu_init(void) {
+	if(!fpu_detected) {
+		fpu_detect();
+	}
+
+	uint64_t cr0 = read_cr0();
+	cr0 &= ~(uint64_t)CR0_EM;
+	cr0 |= CR0_MP | CR0_NE;
+	write_cr0(cr0);
+
+	uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+	if(fpu_mode != FPU_FXSAVE) {
+		cr4 |= CR4_OSXSAVE;
+	}
+	write_cr4(cr4);
+
+	if(fpu_mode != FPU_FXSAVE) {
+		xsetbv(0, fpu_xcr0);
+	}
+	if(fpu_mode == FPU_XSAVES) {
+		wrmsr(MSR_XSS, 0);
+	}
+
+	asm volatile ("fninit");
+
+	if(!fpu_detected) {
+		if(fpu_mode != FPU_FXSAVE) {
+			fpu_detect_size();
+		}
+		fpu_detected = true;
+		kprintf("fpu: Using %s, xcr0 = 0x%lx, %lu byte save area\n",
+			fpu_mode_names[fpu_mode], fpu_xcr0, fpu_state_size);
+	}
+
+	this_core()->fpu_owner = NULL;
+	write_cr0(read_cr0() | CR0_TS);
+}
+
+/**
+ * fpu_switch: Called by the scheduler before switching threads
+ *
+ * Saves prev if it used the FPU since it was switched in, and sets TS unless
+ * the registers still hold the state of next
+ */
+void fpu_switch(struct thread* prev, struct thread* next) {
+	core_t* core = this_core();
+	uint64_t cr0 = read_cr0();
+
+	if(core->fpu_owner == prev && !(cr0 & CR0_TS)) {
+		fpu_save(prev->fpu_state);
+	}
+
+	if(core->fpu_owner == next && next->fpu_core == core->id) {
+		if(cr0 & CR0_TS) {
+			clts();
+		}
+	} else if(!(cr0 & CR0_TS)) {
+		write_cr0(cr0 | CR0_TS);
+	}
+}
+
+/* #NM, the running thread used the FPU with TS set */
+void fpu_device_not_available(struct regs* r) {
+	core_t* core = this_core();
+	struct thread* thread = core->current_thread;
+	if(thread == NULL) {
+		panic("FPU used before the scheduler started", r);
+	}
+
+	if(thread->fpu_state == NULL) {
+		thread->fpu_state = fpu_alloc_state();
+		if(thread->fpu_state == NULL) {
+			panic("Out of memory for FPU state", r);
+		}
+	}
+
+	/* Whatever the registers hold was saved when its thread was switched out */
+	clts();
+	fpu_restore(thread->fpu_state);
+	core->fpu_owner = thread;
+	thread->fpu_core = core->id;
+}
+
+/* Free the save area of an exited thread */
+void fpu_thread_free(struct thread* thread) {
+	core_t* core = this_core();
+	if(core->fpu_owner == thread) {
+		core->fpu_owner = NULL;
+	}
+	free(thread->fpu_state);
+	thread->fpu_state = NULL;
+}
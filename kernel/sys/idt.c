@@ -15,6 +15,8 @@
 #include <kernel/mmu.h>
 #include <kernel/cpu.h>
 #include <kernel/macros.h>
+#include <kernel/fpu.h>
+#include <kernel/rcu.h>
 
 static struct idt_pointer idtp;
 static idt_entry_t idt[256];
@@ -40,14 +42,14 @@ void idt_set_gate(uint8_t num, void* handler, uint16_t selector, uint8_t flags,
  */
 uint8_t idt_allocate(void) {
 	static spinlock_t lock = SPINLOCK_ZERO;
-	bool int_state = spinlock_acquire(&lock);
+	spinlock_acquire(&lock);
 
 	if(free_vector == 255) {
 		panic("IDT Vectors exhauted\n", NULL);
 	}
 
 	uint8_t ret = free_vector++;
-	spinlock_release(&lock, int_state);
+	spinlock_release(&lock);
 	return ret;
 }
 
@@ -86,8 +88,11 @@ void idt_reload(void) {
  * @param irq: Function with signature [regs* (*irq_t)(struct regs* r)], is called when irq is called at @param index
  */
 void irq_install(irq_t irq, int index) {
-	irqs[index - 32] = irq;
+	/* Handlers are looked up without a lock, a new one is seen whole */
+	rcu_assign_pointer(irqs[index - 32], irq);
+	rcu_read_lock();
 	kprintf("irq: Install IRQ %d to %p\n", index - 32, symbols_search((uintptr_t)irqs[index - 32]));
+	rcu_read_unlock();
 }
 
 /* Exception handler, makes things tidy */
@@ -99,19 +104,22 @@ static void _exception(struct regs* r, const char* description) {
 
 /* Initial Common IRQ Handler, makes things tidy. Just calls the specific handler and returns */
 struct regs* _handle_irq(struct regs* r, int irqIndex) {
-	irq_t handler = irqs[irqIndex];
+	irq_t handler = rcu_dereference(irqs[irqIndex]);
 	if(!handler) {
 		panic("Received IRQ without handler", r);
 	}
-	return handler(r);
+
+	/* A handler leaving for another thread for good accounts the exit itself */
+	cputime_irq_enter(r);
+	rcu_irq_enter(r);
+	r = handler(r);
+	cputime_irq_exit();
+	return r;
 }
 
 #define EXC(i, n) case i: _exception(r, n); break;
 #define IRQ(i) case i: return _handle_irq(r, i - 32);
 
-/* Reference to gs segment, all access to core_local will be converted to access from %gs:0 */
-static core_t __seg_gs const* core_local = 0;
-
 /* Called by asm isr_common, directs isrs to be handled as exceptions or irqs */
 struct regs* isr_handler(struct regs* r) {
     switch (r->int_no) {
@@ -121,7 +129,7 @@ struct regs* isr_handler(struct regs* r) {
 		EXC(4, "overflow")
 		EXC(5, "bound range exceeded")
 		EXC(6, "invalid opcode")
-		EXC(7, "device not available")
+		case 7: fpu_device_not_available(r); break;
 		case 8: panic("Double fault", r); break;
 		EXC(10, "invalid TSS")
 		EXC(11, "segment not present")
@@ -140,16 +148,18 @@ struct regs* isr_handler(struct regs* r) {
 
 		/* IRQs */
 		IRQ(32);
+		IRQ(33);
+		IRQ(34);
 
 		/* HALT Signal */
-		case 255: {
-			kprintf("Received halt signal on core %lu\n", core_local->lapic_id);
+		case HALT_IPI_VECTOR: {
+			kprintf("Received halt signal on core %lu\n", this_cpu_read(percpu_core.lapic_id));
 			asm ("1: hlt; jmp 1b");
 		} break;
 
 		/* Interrupt on unknown vector */
 		default: {
-			kprintf("int: Received Unexpected interrupt on core %lu, vector = %lu\n", core_local->lapic_id, r->int_no);
+			kprintf("int: Received Unexpected interrupt on core %lu, vector = %lu\n", this_cpu_read(percpu_core.lapic_id), r->int_no);
 		} break;
 	}
 
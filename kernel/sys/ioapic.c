@@ -8,6 +8,11 @@
 #include <kernel/apic.h>
 #include <kernel/dlist.h>
 #include <kernel/kprintf.h>
+#include <kernel/isolation.h>
+
+/* Redirection entry bits */
+#define IOAPIC_REDIRECT_LOGICAL (1 << 11)
+#define IOAPIC_REDIRECT_DEST_SHIFT 24 /* In the high half */
 
 /**
  * ioapic_read: Read from an IOAPIC register
@@ -78,10 +83,41 @@ void ioapic_irq_redirect(uint32_t lapic_id, uint8_t vector, uint8_t irq, bool st
     ioapic_set_gsi_redirect(lapic_id, vector, irq, 0, status);
 }
 
+/**
+ * ioapic_reroute_isolated: Point every redirection entry sent to an isolated core at the BSP instead
+ *
+ * Entries in logical destination mode are left alone, the kernel only uses physical mode
+ */
+void ioapic_reroute_isolated(void) {
+	for(uint64_t i = 0; i < dlist_get_length(madt_ioapic); i++) {
+		struct madt_ioapic* ioapic = dlist_get(madt_ioapic, i);
+		/* The register holds the index of the last entry */
+		uint64_t last = ioapic_gsi_count(ioapic);
+		for(uint32_t pin = 0; pin <= last; pin++) {
+			uint32_t reg = 0x10 + pin * 2;
+			uint32_t low = ioapic_read(ioapic, reg);
+			if(low & IOAPIC_REDIRECT_LOGICAL) {
+				continue;
+			}
+
+			uint32_t high = ioapic_read(ioapic, reg + 1);
+			uint32_t dest = high >> IOAPIC_REDIRECT_DEST_SHIFT;
+			uint32_t target = isolation_irq_lapic(dest);
+			if(target != dest) {
+				ioapic_write(ioapic, reg + 1, (high & ~(0xFFu << IOAPIC_REDIRECT_DEST_SHIFT)) | (target << IOAPIC_REDIRECT_DEST_SHIFT));
+				kprintf("isolation: Routed IOAPIC %u pin %u from LAPIC %u to %u\n", ioapic->ioAPICId, pin, dest, target);
+			}
+		}
+	}
+}
+
 void ioapic_set_gsi_redirect(uint32_t lapic_id, uint8_t vector, uint8_t gsi,
                               uint16_t flags, bool status) {
     struct madt_ioapic *ioapic = ioapic_from_gsi(gsi);
 
+    /* Isolated cores get no device interrupts */
+    lapic_id = isolation_irq_lapic(lapic_id);
+
     uint64_t redirect = vector;
     if ((flags & (1 << 1)) != 0) {
         redirect |= (1 << 13);
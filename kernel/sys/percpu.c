@@ -0,0 +1,61 @@
+/**
+ * percpu.c: Per-core copies of the .percpu section
+ *
+ * Every core gets a copy of the section, cache line aligned and padded so
+ * no two cores share a line. GS_BASE of a core holds the distance of its
+ * copy from the section in the kernel image, so a variable is reached with
+ * %gs:&var, an address the linker fills in. The core structure is the first
+ * thing in the section.
+ *
+ * Until percpu_init() the BSP runs on the copy in the kernel image, with a
+ * GS_BASE of 0. There is no NUMA information yet, so the copies come from
+ * the general allocator rather than memory close to the core.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/percpu.h>
+#include <kernel/cpu.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+
+__attribute__((section(".percpu.core"))) __cacheline_aligned core_t percpu_core;
+DEFINE_PER_CPU(uintptr_t, percpu_offset);
+
+uintptr_t* percpu_offsets = NULL;
+
+/* Allocate the copies of all cores, called once the cores are counted */
+void __init percpu_init(void) {
+	size_t size = (size_t)(__percpu_end - __percpu_start);
+	size_t padded = (size + CACHELINE_SIZE - 1) & ~(size_t)(CACHELINE_SIZE - 1);
+
+	percpu_offsets = malloc(sizeof(uintptr_t) * coreCount);
+	if(percpu_offsets == NULL) {
+		panic("percpu: Out of memory for the offsets", NULL);
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		char* area = aligned_alloc(CACHELINE_SIZE, padded);
+		if(area == NULL) {
+			panic("percpu: Out of memory for per-core areas", NULL);
+		}
+
+		/* Every variable starts out with the value it has in the image, the core structure empty */
+		memcpy(area, __percpu_start, size);
+		memset(area + size, 0, padded - size);
+		percpu_offsets[i] = (uintptr_t)area - (uintptr_t)__percpu_start;
+
+		core_t* core = per_cpu_ptr(percpu_core, i);
+		memset(core, 0, sizeof(core_t));
+		core->self = core;
+		per_cpu(percpu_offset, i) = percpu_offsets[i];
+	}
+
+	kprintf("percpu: %lu bytes for each of %lu cores\n", padded, coreCount);
+}
+
+/* Switch this core to its copy, interrupts are disabled and no spinlock is held */
+void percpu_enter(uint64_t core) {
+	set_gs_register((void*)percpu_offsets[core]);
+}
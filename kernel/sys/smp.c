@@ -1,5 +1,10 @@
 /**
  * smp.c: Handles the process of starting all other cores
+ *
+ * The BSP initializes itself first and calibrates the LAPIC timer and the
+ * TSC for everyone, then all APs are released at once and initialize in
+ * parallel. Nothing in core_start() is shared between cores except through
+ * its own locks, so no core waits for another.
  */
 
 #include <stdint.h>
@@ -13,6 +18,15 @@
 #include <kernel/cpufeature.h>
 #include <kernel/apic.h>
 #include <kernel/msr.h>
+#include <kernel/allocbench.h>
+#include <kernel/scheduler.h>
+#include <memory.h>
+#include <kernel/fpu.h>
+#include <kernel/timer.h>
+#include <kernel/topology.h>
+#include <kernel/isolation.h>
+#include <kernel/smp.h>
+#include <kernel/rcu.h>
 
 uint32_t bsp_lapic_id = 0;
 uint64_t coreCount = 0;
@@ -22,22 +36,21 @@ __attribute__((used, section(".requests")))
 static volatile struct limine_smp_request smp_request = {
 	.id = LIMINE_SMP_REQUEST,
 	.revision = 0,
-	.flags = 1,
+	.flags = LIMINE_SMP_X2APIC,
 };
 
 /* Number of cores initialized */
-static uint64_t initialized = 0;
+static volatile uint64_t initialized = 0;
+
+/* TSC when the BSP released the APs, and when each core was online */
+static uint64_t release_tsc = 0;
+static uint64_t* online_tsc = NULL;
 
-/* Local core list to keep track of cores */
-core_t *cpu_core_local = NULL;
 
 extern struct regs* lapic_irq_handler(struct regs* r);
 extern void lapic_init(void);
 extern void gdt_reload();
 
-/* Spinlock to prevent cores from initializing simultaneously */
-spinlock_t lock = SPINLOCK_ZERO;
-
 /* Start's a single core, this function will run in the core being initialized */
 void core_start(struct limine_smp_info *core) {
 	/* Load gdt in the core */
@@ -46,15 +59,13 @@ void core_start(struct limine_smp_info *core) {
 	/* Load idt in the core */
 	idt_reload();
 
-	bool int_state = spinlock_acquire(&lock);
+	/* Switch to the per-core variables of the core, spinlocks count in it */
+	core_t *core_local = (core_t*)core->extra_argument;
+	percpu_enter(core_local->id);
 
 	/* Load pagemap in the core */
 	mmu_switch_pagemap(mmu_kernel_pagemap);
 
-	/* Set GS register as local core */
-	core_t *core_local = (core_t*)core->extra_argument;
-	set_gs_register(core_local);
-
 	/* Set the struct fields to their appropriate values */
 	core_local->lapic_id = core->lapic_id;
 
@@ -64,39 +75,39 @@ void core_start(struct limine_smp_info *core) {
 	}
 
 	lapic_init();
-	lapic_timer_calibrate(10000000);
-
-	/* Enable SSE */
-	asm volatile(
-		"mov %%cr0, %%rax;"
-		"and $0xFFFB, %%ax;"
-		"or  $2, %%eax;"
-		"mov %%rax, %%cr0;"
-		"mov %%cr4, %%rax;"
-		"or  $0b11000000000, %%rax;"
-		"mov %%rax, %%cr4;"
-		: : : "rax");
-
-	/* set NE in cr0 and reset x87 fpu */
-	asm volatile(
-		"fninit;"
-		"mov %%cr0, %%rax;"
-		"or $0b100000, %%rax;"
-		"mov %%rax, %%cr0;"
-		: : : "rax"
-	);
-
-
-	kprintf("smp: Processor #%ld online\n", core_local->lapic_id);
+	if(core_local->bsp) {
+		lapic_timer_calibrate(10000000);
+	} else {
+		lapic_timer_init();
+	}
+
+	/* Account CPU time from here on, steal time needs the TSC calibrated */
+	cputime_init_core();
+
+	/* Enable the FPU, SSE and XSAVE, state is switched lazily */
+	fpu_init();
+
+
+	if(core_local->bsp) {
+		kprintf("smp: Processor #%ld online\n", core_local->lapic_id);
+	} else {
+		online_tsc[core_local->id] = rdtsc();
+		kprintf("smp: Processor #%ld online after %lu us\n", core_local->lapic_id,
+			(online_tsc[core_local->id] - release_tsc) * 1000 / tsc_get_khz());
+	}
 
 	/* Add the initialized statement */
-	initialized++;
-	spinlock_release(&lock, int_state);
+	__atomic_add_fetch(&initialized, 1, __ATOMIC_RELEASE);
 
 	/* Exiting from this causes a triple fault */
 	if(core_local->bsp != true) {
+		/* IPIs sent before the LAPIC was enabled were lost */
+		smp_call_flush();
 		enable_interrupts();
-		asm volatile ("1: hlt; jmp 1b");
+#ifdef ALLOC_BENCH
+		allocbench_run();
+#endif
+		sched_enter();
 	}
 }
 
@@ -105,46 +116,77 @@ void __init smp_init(void) {
 	struct limine_smp_response *smp_response = smp_request.response;
 	struct limine_smp_info **cpu_cores = smp_response->cpus;	
 
-	kprintf("smp: X2APIC Enabled? %s\n", smp_response->flags == 1 ? "true" : "false");
+	/* Limine switched every LAPIC to x2APIC mode if it could, all accesses use MSRs from now on */
+	x2apic_enabled = (smp_response->flags & LIMINE_SMP_X2APIC) != 0;
+	kprintf("smp: X2APIC Enabled? %s\n", x2apic_enabled ? "true" : "false");
 
 	coreCount = smp_response->cpu_count;
 
-	/* Local array to keep track of the cores */
-	cpu_core_local = malloc(sizeof(core_t) * coreCount);
-	if(((uintptr_t)cpu_core_local % _Alignof(core_t)) != 0) {
-		/* cpu_core_local must be aligned or UBSAN will be actiavated */
-		kprintf("cpu_core_local found unaligned. Core count: %d, Size of the struct: %d, size of allocated memory: %d, alignment: %d, address returned: %p\n",
-			coreCount, sizeof(core_t), sizeof(cpu_core_local), _Alignof(core_t), cpu_core_local);
-		fatal();
-	}
+	/* Every core gets its own copy of the per-core variables, the BSP moves to its copy in core_start() */
+	percpu_init();
 
 	/* Get the ID of the BSP core */
 	bsp_lapic_id = smp_response->bsp_lapic_id;
 
+	/* The topology is decoded from the APIC ids, the scheduler builds its domains from it */
+	for(uint64_t i = 0; i < coreCount; i++) {
+		cpu_core(i)->id = i;
+		cpu_core(i)->lapic_id = cpu_cores[i]->lapic_id;
+	}
+	topology_init();
+	isolation_init();
+
 	irq_install(lapic_irq_handler, 32);
+	smp_call_init();
 
-	/* Loop through all the cores */
+	/* Timer wheels and run queues must exist before any core takes a timer interrupt */
+	timer_init();
+	sched_init();
+
+	online_tsc = malloc(sizeof(uint64_t) * coreCount);
+	if(online_tsc == NULL) {
+		panic("smp: Out of memory for the core list", NULL);
+	}
+	memset(online_tsc, 0, sizeof(uint64_t) * coreCount);
+
+	/* The BSP goes first, the APs use its calibration */
 	for(uint64_t i = 0; i < coreCount; i++) {
 		struct limine_smp_info* core = cpu_cores[i];
+		core->extra_argument = (uint64_t)cpu_core(i);
+		if(core->lapic_id == smp_response->bsp_lapic_id) {
+			cpu_core(i)->bsp = true;
+			core_start(core);
+		}
+	}
 
-		/* Get the core_t from cpu_core_local */
-		core_t* current = &cpu_core_local[i];
-
-		core->extra_argument = (uint64_t)current;
+#ifdef ALLOC_BENCH
+	/* The APs go straight into the benchmark */
+	allocbench_init(coreCount);
+#endif
 
-		/* If core is bsp then goto the function */
+	/* Release all APs at once, writing goto_address starts the core */
+	release_tsc = rdtsc();
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct limine_smp_info* core = cpu_cores[i];
 		if(core->lapic_id != smp_response->bsp_lapic_id) {
-			core->goto_address = core_start; /* Jump to core start */
-		} else {
-			current->bsp = true;
-			core_start(core);
+			__atomic_store_n(&core->goto_address, core_start, __ATOMIC_RELEASE);
 		}
+	}
 
-		/* Ensure smooth and ordered initialization of cores */
-		while (initialized != (i + 1)) {
-			asm ("pause");
+	while(__atomic_load_n(&initialized, __ATOMIC_ACQUIRE) != coreCount) {
+		asm ("pause");
+	}
+
+	uint64_t slowest = 0;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(online_tsc[i] != 0 && online_tsc[i] - release_tsc > slowest) {
+			slowest = online_tsc[i] - release_tsc;
 		}
 	}
+	kprintf("smp: %lu cores online, the last after %lu us\n", coreCount, slowest * 1000 / tsc_get_khz());
+
+	/* Every core runs on its own per-core copy now, callbacks queued from here on stay with their core */
+	rcu_init();
 
 	enable_interrupts();
 }
\ No newline at end of file
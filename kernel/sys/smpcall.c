@@ -0,0 +1,217 @@
+/**
+ * smpcall.c: Running functions on other cores
+ *
+ * Every core has a lock-free call queue, a list that callers push onto with
+ * a compare-and-swap. Only the push that finds the queue empty sends the IPI,
+ * later calls queued before the core got to them are run by the same IPI.
+ * The core takes the whole list with one exchange and runs it oldest first.
+ *
+ * Every core owns one call slot per destination core, so queueing needs no
+ * allocation. A slot stays locked until the destination ran its function,
+ * a caller finding it locked waits for its previous call to finish. Callers
+ * run their own queue while they wait, so two cores calling each other with
+ * interrupts disabled don't deadlock.
+ *
+ * A call reaching every other core uses the all-but-self destination
+ * shorthand, one IPI write instead of one per core.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/smp.h>
+#include <kernel/cpu.h>
+#include <kernel/apic.h>
+#include <kernel/int.h>
+#include <kernel/preempt.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+
+/* coreCount slots per core, the slots of core i start at i * coreCount */
+static struct smp_call* call_slots = NULL;
+
+/* Functions other cores queued for this one, newest first, and how many it ran */
+static DEFINE_PER_CPU(struct smp_call*, call_queue);
+static DEFINE_PER_CPU(uint64_t, calls_run);
+
+/* Statistics */
+static uint64_t calls_queued = 0;
+static uint64_t calls_ipis = 0;
+static uint64_t calls_broadcasts = 0;
+
+/* Run the calls queued on this core, interrupts are disabled */
+static void smp_call_run_queue(void) {
+	struct smp_call* list = __atomic_exchange_n(this_cpu_ptr(call_queue), NULL, __ATOMIC_ACQUIRE);
+
+	/* Pushed newest first */
+	struct smp_call* ordered = NULL;
+	while(list != NULL) {
+		struct smp_call* next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	while(ordered != NULL) {
+		struct smp_call* call = ordered;
+		ordered = call->next;
+		smp_call_func_t func = call->func;
+		void* arg = call->arg;
+		this_cpu_inc(calls_run);
+
+		/* An asynchronous caller may reuse the slot as soon as it is copied */
+		if(call->flags & SMP_CALL_SYNC) {
+			func(arg);
+			__atomic_store_n(&call->flags, 0, __ATOMIC_RELEASE);
+		} else {
+			__atomic_store_n(&call->flags, 0, __ATOMIC_RELEASE);
+			func(arg);
+		}
+	}
+}
+
+/* Run the calls queued on this core, for callers spinning on other cores and for a core coming online */
+void smp_call_flush(void) {
+	bool int_state = interrupt_toggle(false);
+	smp_call_run_queue();
+	interrupt_toggle(int_state);
+}
+
+static struct regs* smp_call_ipi_handler(struct regs* r) {
+	/* A call pushed after the exchange sends another IPI, so acknowledge first */
+	lapic_write(LAPIC_REG_EOI, LAPIC_EOI_ACK);
+	smp_call_run_queue();
+	return r;
+}
+
+/* Wait for a slot of this core to be unlocked */
+static void smp_call_wait(struct smp_call* call) {
+	while(__atomic_load_n(&call->flags, __ATOMIC_ACQUIRE) & SMP_CALL_LOCKED) {
+		smp_call_flush();
+		asm volatile ("pause");
+	}
+}
+
+/* Put a call in the slot for dst and queue it, returns true if dst needs the IPI */
+static bool smp_call_queue(core_t* self, uint64_t dst, smp_call_func_t func, void* arg, bool wait) {
+	struct smp_call* call = &call_slots[self->id * coreCount + dst];
+
+	/* An interrupt handler of this core calling too would take the slot between the wait and the push */
+	bool int_state = interrupt_toggle(false);
+	smp_call_wait(call);
+
+	call->func = func;
+	call->arg = arg;
+	call->flags = SMP_CALL_LOCKED | (wait ? SMP_CALL_SYNC : 0);
+
+	struct smp_call** queue = per_cpu_ptr(call_queue, dst);
+	struct smp_call* head = __atomic_load_n(queue, __ATOMIC_RELAXED);
+	do {
+		call->next = head;
+	} while(!__atomic_compare_exchange_n(queue, &head, call, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	interrupt_toggle(int_state);
+
+	__atomic_add_fetch(&calls_queued, 1, __ATOMIC_RELAXED);
+	return head == NULL;
+}
+
+/**
+ * smp_call_function_many: Run a function on every core in a mask
+ *
+ * The function runs in interrupt context on the other cores, and with
+ * interrupts disabled on this one if it is in the mask. It must not sleep.
+ * May be called from interrupt handlers when wait is not set
+ *
+ * @param mask: Cores to run it on
+ * @param func: The function
+ * @param arg: Argument passed to func
+ * @param wait: Return only once it returned on all of them
+ */
+void smp_call_function_many(const cpumask_t* mask, smp_call_func_t func, void* arg, bool wait) {
+	/* The slots belong to this core until the calls are queued */
+	preempt_disable();
+	core_t* self = this_core();
+
+	cpumask_t ipi;
+	cpumask_clear_all(&ipi);
+	uint64_t targets = 0;
+	uint64_t needed = 0;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		if(i == self->id || !cpumask_test(mask, i)) {
+			continue;
+		}
+
+		targets++;
+		if(smp_call_queue(self, i, func, arg, wait)) {
+			cpumask_set(&ipi, i);
+			needed++;
+		}
+	}
+
+	/* One write for all others, unless only one of them needs it */
+	if(targets == coreCount - 1 && needed > 1) {
+		lapic_issue_ipi(0, SMP_CALL_VECTOR, LAPIC_IPI_ALL_BUT_SELF, 0);
+		__atomic_add_fetch(&calls_broadcasts, 1, __ATOMIC_RELAXED);
+	} else {
+		for(uint64_t i = 0; i < coreCount && needed != 0; i++) {
+			if(cpumask_test(&ipi, i)) {
+				lapic_issue_ipi(cpu_core(i)->lapic_id, SMP_CALL_VECTOR, 0, 0);
+				__atomic_add_fetch(&calls_ipis, 1, __ATOMIC_RELAXED);
+				needed--;
+			}
+		}
+	}
+
+	if(cpumask_test(mask, self->id)) {
+		bool int_state = interrupt_toggle(false);
+		func(arg);
+		interrupt_toggle(int_state);
+	}
+
+	if(wait) {
+		for(uint64_t i = 0; i < coreCount; i++) {
+			if(i != self->id && cpumask_test(mask, i)) {
+				smp_call_wait(&call_slots[self->id * coreCount + i]);
+			}
+		}
+	}
+	preempt_enable();
+}
+
+/* Run a function on one core, see smp_call_function_many() */
+void smp_call_function_single(uint64_t core, smp_call_func_t func, void* arg, bool wait) {
+	cpumask_t mask;
+	cpumask_clear_all(&mask);
+	cpumask_set(&mask, core);
+	smp_call_function_many(&mask, func, arg, wait);
+}
+
+/* Run a function on every other core, see smp_call_function_many() */
+void smp_call_function(smp_call_func_t func, void* arg, bool wait) {
+	cpumask_t mask;
+	cpumask_set_all(&mask);
+	preempt_disable();
+	cpumask_clear(&mask, this_core()->id);
+	smp_call_function_many(&mask, func, arg, wait);
+	preempt_enable();
+}
+
+/* Allocate the call slots, called before the APs start */
+void __init smp_call_init(void) {
+	call_slots = malloc(sizeof(struct smp_call) * coreCount * coreCount);
+	if(call_slots == NULL) {
+		panic("smp: Out of memory for call slots", NULL);
+	}
+	memset(call_slots, 0, sizeof(struct smp_call) * coreCount * coreCount);
+
+	irq_install(smp_call_ipi_handler, SMP_CALL_VECTOR);
+}
+
+void smp_call_print_stats(void) {
+	kprintf("smp: %lu calls queued, %lu IPIs, %lu broadcasts\n",
+		__atomic_load_n(&calls_queued, __ATOMIC_RELAXED), __atomic_load_n(&calls_ipis, __ATOMIC_RELAXED),
+		__atomic_load_n(&calls_broadcasts, __ATOMIC_RELAXED));
+	for(uint64_t i = 0; i < coreCount; i++) {
+		kprintf("smp: core %lu: %lu calls run\n", i, per_cpu(calls_run, i));
+	}
+}
@@ -0,0 +1,182 @@
+/**
+ * topology.c: Package, die, core and SMT sibling of every core
+ *
+ * The APIC id of a core is split into fields for every level of the
+ * topology, CPUID leaf 0x1F or 0xB gives the width of each. Leaf 4 (or
+ * 0x8000001D on AMD) gives how many APIC ids share every cache, so cores
+ * sharing one have the same APIC id once the bits of the sharers are shifted
+ * out. All cores report the same widths, so they are read once on the BSP
+ * and applied to the APIC id of every core.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <cpuid.h>
+#include <kernel/topology.h>
+#include <kernel/cpu.h>
+#include <kernel/cpufeature.h>
+#include <kernel/kprintf.h>
+#include <kernel/macros.h>
+
+/* Bits of the APIC id below the core, die and package ids */
+static uint32_t smt_shift = 0;
+static uint32_t core_shift = 0;
+static uint32_t pkg_shift = 0;
+
+/* Bits of the APIC id of the sharers of the L2 and the last level cache */
+static uint32_t l2_shift = 0;
+static uint32_t llc_shift = 0;
+
+/* Bits needed to count to n - 1 */
+static uint32_t count_order(uint32_t n) {
+	return n <= 1 ? 0 : 64 - __builtin_clzll((uint64_t)n - 1);
+}
+
+/* Read the field widths from leaf 0x1F or 0xB, false if the CPU has neither */
+static bool topology_read_leaf(uint32_t leaf) {
+	uint32_t eax, ebx, ecx, edx;
+	if(__get_cpuid_max(0, NULL) < leaf) {
+		return false;
+	}
+
+	__cpuid_count(leaf, 0, eax, ebx, ecx, edx);
+	if(ebx == 0) {
+		return false;
+	}
+
+	bool die = false;
+	for(uint32_t level = 0; ; level++) {
+		__cpuid_count(leaf, level, eax, ebx, ecx, edx);
+		uint32_t type = (ecx >> 8) & 0xFF;
+		if(type == TOPOLOGY_LEVEL_INVALID) {
+			break;
+		}
+
+		/* The shift of a level gets the id of the level above it */
+		uint32_t shift = eax & 0x1F;
+		if(type == TOPOLOGY_LEVEL_SMT) {
+			smt_shift = shift;
+		} else if(type < TOPOLOGY_LEVEL_DIE) {
+			core_shift = shift;
+		} else {
+			die = true;
+		}
+		pkg_shift = shift;
+	}
+
+	if(core_shift < smt_shift) {
+		core_shift = smt_shift;
+	}
+	if(!die) {
+		core_shift = pkg_shift;
+	}
+	return true;
+}
+
+/* Guess the field widths from the logical and core counts of leaves 1 and 4 */
+static void topology_read_legacy(void) {
+	uint32_t eax, ebx, ecx, edx;
+	__cpuid(1, eax, ebx, ecx, edx);
+	uint32_t logical = cpu_has_feature(CPU_FEATURE_HTT) ? (ebx >> 16) & 0xFF : 1;
+
+	uint32_t cores = logical;
+	if(__get_cpuid_max(0, NULL) >= CPUID_LEAF_CACHE) {
+		__cpuid_count(CPUID_LEAF_CACHE, 0, eax, ebx, ecx, edx);
+		if((eax & 0x1F) != 0) {
+			cores = ((eax >> 26) & 0x3F) + 1;
+		}
+	}
+
+	pkg_shift = count_order(logical);
+	core_shift = pkg_shift;
+	smt_shift = cores < logical ? count_order(logical / cores) : 0;
+}
+
+/* Read the sharers of the L2 and the last level cache from leaf 4 or 0x8000001D */
+static bool topology_read_caches(uint32_t leaf) {
+	uint32_t eax, ebx, ecx, edx;
+	uint32_t max = leaf >= 0x80000000 ? __get_cpuid_max(0x80000000, NULL) : __get_cpuid_max(0, NULL);
+	if(max < leaf) {
+		return false;
+	}
+
+	uint32_t llc_level = 0;
+	bool found = false;
+	for(uint32_t index = 0; ; index++) {
+		__cpuid_count(leaf, index, eax, ebx, ecx, edx);
+		uint32_t type = eax & 0x1F;
+		if(type == 0) {
+			break;
+		}
+
+		/* Instruction caches don't decide where data is shared */
+		if(type == 2) {
+			continue;
+		}
+
+		uint32_t level = (eax >> 5) & 0x7;
+		uint32_t shift = count_order(((eax >> 14) & 0xFFF) + 1);
+		if(level == 2) {
+			l2_shift = shift;
+		}
+		if(level >= llc_level) {
+			llc_level = level;
+			llc_shift = shift;
+		}
+		found = true;
+	}
+	return found;
+}
+
+/* Count the different values of a topology id over all cores */
+static uint64_t topology_count(uint64_t offset) {
+	uint64_t count = 0;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		uint32_t id = *(uint32_t*)((uint8_t*)&cpu_core(i)->topo + offset);
+		bool seen = false;
+		for(uint64_t j = 0; j < i && !seen; j++) {
+			seen = *(uint32_t*)((uint8_t*)&cpu_core(j)->topo + offset) == id;
+		}
+		count += !seen;
+	}
+	return count;
+}
+
+/**
+ * topology_init: Fill in the topology of all cores
+ *
+ * Called on the BSP once the APIC ids of all cores are known
+ */
+void __init topology_init(void) {
+	if(!topology_read_leaf(CPUID_LEAF_TOPOLOGY_V2) && !topology_read_leaf(CPUID_LEAF_TOPOLOGY)) {
+		topology_read_legacy();
+	}
+
+	/* Without cache information an L2 per core and a last level cache per die are assumed */
+	l2_shift = smt_shift;
+	llc_shift = core_shift;
+	if(!topology_read_caches(CPUID_LEAF_CACHE)) {
+		topology_read_caches(CPUID_LEAF_AMD_CACHE);
+	}
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		uint32_t apic = core->lapic_id;
+		struct cpu_topology* topo = &core->topo;
+
+		topo->thread = apic & ((1u << smt_shift) - 1);
+		topo->core = (apic >> smt_shift) & ((1u << (core_shift - smt_shift)) - 1);
+		topo->die = (apic >> core_shift) & ((1u << (pkg_shift - core_shift)) - 1);
+		topo->package = apic >> pkg_shift;
+		topo->core_uid = apic >> smt_shift;
+		topo->die_uid = apic >> core_shift;
+		topo->l2 = apic >> l2_shift;
+		topo->llc = apic >> llc_shift;
+	}
+
+	cpu_info->coreCount = topology_count(offsetof(struct cpu_topology, core_uid));
+	kprintf("topology: %lu packages, %lu dies, %u cores, %lu threads, %lu L2 and %lu last level caches\n",
+		topology_count(offsetof(struct cpu_topology, package)), topology_count(offsetof(struct cpu_topology, die_uid)),
+		cpu_info->coreCount, coreCount,
+		topology_count(offsetof(struct cpu_topology, l2)), topology_count(offsetof(struct cpu_topology, llc)));
+}
@@ -0,0 +1,206 @@
+/**
+ * cputime.c: Where the CPU time of every core and thread goes
+ *
+ * Every core is in one state at a time, and charges the TSC ticks since its
+ * last change to that state when it changes: on interrupt entry and exit,
+ * around timer functions and on every context switch. The ticks are added to
+ * counters of the core and of the running thread. Only the core writes its
+ * own counters, so they need no lock and may be read from anywhere.
+ *
+ * Under KVM the hypervisor reports how long the vCPU was not running. That
+ * time passed on the TSC too, so on every charge it is moved from the
+ * current state to steal time.
+ */
+
+#include <stdint.h>
+#include <cpuid.h>
+#include <memory.h>
+#include <kernel/cputime.h>
+#include <kernel/cpu.h>
+#include <kernel/cpufeature.h>
+#include <kernel/scheduler.h>
+#include <kernel/apic.h>
+#include <kernel/mmu.h>
+#include <kernel/msr.h>
+#include <kernel/kprintf.h>
+
+static const char* cputime_names[CPUTIME_STATES] = {
+	[CPUTIME_USER] = "user",
+	[CPUTIME_KERNEL] = "kernel",
+	[CPUTIME_HARDIRQ] = "hardirq",
+	[CPUTIME_SOFTIRQ] = "softirq",
+	[CPUTIME_IDLE] = "idle",
+	[CPUTIME_STEAL] = "steal",
+};
+
+/* Time of the last cputime_print_stats() */
+static uint64_t stats_last_tsc = 0;
+
+/* If the hypervisor is KVM and offers steal time */
+static bool kvm_has_steal_time(void) {
+	if(!cpu_has_feature(CPU_FEATURE_HYPERVISOR)) {
+		return false;
+	}
+
+	uint32_t eax, ebx, ecx, edx;
+	__cpuid(KVM_CPUID_SIGNATURE, eax, ebx, ecx, edx);
+	if(ebx != 0x4b4d564b || ecx != 0x564b4d56 || edx != 0x4d || eax < KVM_CPUID_FEATURES) {
+		return false;
+	}
+
+	__cpuid(KVM_CPUID_FEATURES, eax, ebx, ecx, edx);
+	return eax & KVM_FEATURE_STEAL_TIME;
+}
+
+/* Start accounting on this core, called on every core once it has its core structure */
+void cputime_init_core(void) {
+	core_t* core = this_core();
+	core->cputime_state = CPUTIME_KERNEL;
+	core->cputime_stamp = rdtsc();
+
+	if(!kvm_has_steal_time()) {
+		return;
+	}
+
+	struct kvm_steal_time* steal = aligned_alloc(64, sizeof(struct kvm_steal_time));
+	if(steal == NULL) {
+		return;
+	}
+	memset(steal, 0, sizeof(struct kvm_steal_time));
+	core->steal_time = steal;
+	wrmsr(MSR_KVM_STEAL_TIME, ((uintptr_t)steal - HHDM_HIGHER_HALF) | KVM_MSR_ENABLED);
+	core->steal_ns = steal->steal;
+}
+
+/* Ticks the hypervisor took from the core since the last call */
+static uint64_t cputime_steal(core_t* core) {
+	struct kvm_steal_time* area = core->steal_time;
+	uint64_t khz = tsc_get_khz();
+	if(area == NULL || khz == 0) {
+		return 0;
+	}
+
+	uint32_t version;
+	uint64_t steal;
+	do {
+		version = __atomic_load_n(&area->version, __ATOMIC_ACQUIRE);
+		steal = __atomic_load_n(&area->steal, __ATOMIC_ACQUIRE);
+	} while((version & 1) || version != __atomic_load_n(&area->version, __ATOMIC_ACQUIRE));
+
+	uint64_t ns = steal - core->steal_ns;
+	core->steal_ns = steal;
+	return (ns / 1000000) * khz + (ns % 1000000) * khz / 1000000;
+}
+
+/* Charge the ticks since the last change to state, interrupts are disabled */
+static void cputime_charge(core_t* core, uint32_t state) {
+	uint64_t now = rdtsc();
+	uint64_t delta = now - core->cputime_stamp;
+	core->cputime_stamp = now;
+
+	uint64_t steal = cputime_steal(core);
+	if(steal > delta) {
+		steal = delta;
+	}
+	delta -= steal;
+
+	core->cputime[state] += delta;
+	core->cputime[CPUTIME_STEAL] += steal;
+
+	struct thread* thread = core->current_thread;
+	if(thread != NULL) {
+		thread->cputime[state] += delta;
+		thread->cputime[CPUTIME_STEAL] += steal;
+	}
+}
+
+/* Switch this core to another state, returns the previous one for cputime_exit() */
+uint32_t cputime_enter(uint32_t state) {
+	core_t* core = this_core();
+	uint32_t prev = core->cputime_state;
+	cputime_charge(core, prev);
+	core->cputime_state = state;
+	return prev;
+}
+
+/* Go back to the state before cputime_enter() */
+void cputime_exit(uint32_t prev) {
+	core_t* core = this_core();
+	cputime_charge(core, core->cputime_state);
+	core->cputime_state = prev;
+}
+
+/* Called when an interrupt arrives, r is the interrupted frame */
+void cputime_irq_enter(struct regs* r) {
+	core_t* core = this_core();
+	cputime_charge(core, (r->cs & 0x3) == 0x3 ? CPUTIME_USER : core->cputime_state);
+	core->cputime_irq_prev = core->cputime_state;
+	core->cputime_state = CPUTIME_HARDIRQ;
+}
+
+/* Called when an interrupt returns, also when it leaves for another thread for good */
+void cputime_irq_exit(void) {
+	core_t* core = this_core();
+	cputime_charge(core, CPUTIME_HARDIRQ);
+	core->cputime_state = core->cputime_irq_prev;
+}
+
+/**
+ * cputime_switch: Charge the thread switched away from
+ *
+ * Called before current_thread changes. In an interrupt the new thread's
+ * state only starts once the interrupt returns
+ *
+ * @param next: The thread switched to
+ * @param idle: If it is the idle thread
+ */
+void cputime_switch(struct thread* next, bool idle) {
+	core_t* core = this_core();
+	cputime_charge(core, core->cputime_state);
+
+	uint32_t state = idle ? CPUTIME_IDLE : CPUTIME_KERNEL;
+	if(core->cputime_state == CPUTIME_HARDIRQ) {
+		core->cputime_irq_prev = state;
+	} else {
+		core->cputime_state = state;
+	}
+}
+
+uint64_t cputime_to_ns(uint64_t ticks) {
+	uint64_t khz = tsc_get_khz();
+	if(khz == 0) {
+		return 0;
+	}
+	return (ticks / khz) * 1000000 + (ticks % khz) * 1000000 / khz;
+}
+
+/* Print the share of every state on every core since the last call */
+void cputime_print_stats(void) {
+	uint64_t now = rdtsc();
+	uint64_t elapsed = now - stats_last_tsc;
+	stats_last_tsc = now;
+	kprintf("cputime: %lu ms since the last report\n", cputime_to_ns(elapsed) / 1000000);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		uint64_t delta[CPUTIME_STATES];
+		uint64_t total = 0;
+		for(int state = 0; state < CPUTIME_STATES; state++) {
+			uint64_t ticks = __atomic_load_n(&core->cputime[state], __ATOMIC_RELAXED);
+			delta[state] = ticks - core->cputime_last[state];
+			core->cputime_last[state] = ticks;
+			total += delta[state];
+		}
+		if(total == 0) {
+			continue;
+		}
+
+		uint64_t busy = total - delta[CPUTIME_IDLE] - delta[CPUTIME_STEAL];
+		kprintf("cputime: core %lu: %lu.%lu%% busy,", i, busy * 100 / total, busy * 1000 / total % 10);
+		for(int state = 0; state < CPUTIME_STATES; state++) {
+			uint64_t permille = delta[state] * 1000 / total;
+			kprintf(" %s %lu.%lu%%", cputime_names[state], permille / 10, permille % 10);
+		}
+		kprintf("\n");
+	}
+}
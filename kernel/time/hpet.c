@@ -78,25 +78,18 @@ void __init hpet_init(void) {
 
 /**
  * Use HPET to sleep, making it highly precise
+ *
+ * Only reads the main counter, so any number of cores may sleep at once
  * 
  * @param ns: Nanoseconds to sleep
 */
 void hpet_sleep(uint64_t ns) {
-	uint64_t original = hpet_get_count();
-
 	uint64_t ticks = (ns * 1000000) / hpetTickPeriod;
+	uint64_t start = hpet_get_count();
 
-	hpet_write(0x10, hpet_read(0x10) & ~(1u << 0));
-	hpet_write(0xF0, 0);
-	hpet_write(0x10, hpet_read(0x10) || (1u << 0));
-
-	while(hpet_read(0xF0) <= ticks) {
+	while(hpet_get_count() - start <= ticks) {
 		asm ("pause");
 	}
-
-	hpet_write(0x10, hpet_read(0x10) & ~(1u << 0));
-	hpet_write(0xF0, original + ticks);
-	hpet_write(0x10, hpet_read(0x10) || (1u << 0));
 }
 
 /* Reset HPET Counter */
@@ -3,6 +3,13 @@
  * 
  * Uses HPET to calibrate
  * Calibrates, initializes, and resets lapic timer. Irq handler and sleep functions are present here
+ *
+ * The BSP calibrates once, the LAPIC bus clock and the TSC run at the same
+ * rate on every core, so the other cores only set up their timer with it
+ *
+ * The timer runs in one-shot mode and is only armed when something is due, so
+ * idle cores take no timer interrupts. TSC-deadline mode is used when the CPU
+ * has it, it needs no conversion to bus clock ticks and has no 32 bit range limit
  */
 
 #include <kernel/acpi.h>
@@ -14,40 +21,107 @@
 #include <kernel/cpufeature.h>
 #include <kernel/int.h>
 #include <kernel/kprintf.h>
+#include <kernel/scheduler.h>
+#include <kernel/timer.h>
+
+bool x2apic_enabled = false;
 
 /* Frequency at which lapic ticks */
 uint64_t frequency = 0;
 
-/* How many kernel ticks have passed since lapic has been initialized, increased every 10ms */
-uint64_t kernel_ticks = 0;
-
 /* How many times the lapic timer ticks in 10ms */
 uint32_t ticksIn10ms = 0;
 
-/* Calibrate the LAPIC timer  */
+/* LAPIC timer and TSC ticks per millisecond */
+static uint64_t lapic_khz = 0;
+static uint64_t tsc_khz = 0;
+
+/* If the timer is armed with the TSC deadline MSR */
+static bool tsc_deadline = false;
+
+/* Time of the last lapic_timer_print_stats() */
+static uint64_t stats_last_ns = 0;
+
+/* Convert ns to ticks of a clock running at khz without overflowing */
+static uint64_t ns_to_ticks(uint64_t ns, uint64_t khz) {
+	return (ns / 1000000) * khz + (ns % 1000000) * khz / 1000000;
+}
+
+/* Calibrate the LAPIC timer and the TSC on the BSP, before any other core starts */
 void __init lapic_timer_calibrate(uint64_t ns) {
 	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);
 	lapic_write(LAPIC_REG_TIMER_INITCNT, 0xFFFFFFFF);
 
-	/* Use the HPET timer to calibrate the LAPIC */
+	/* Use the HPET timer to calibrate the LAPIC and the TSC */
+	uint64_t tsc_start = rdtsc();
 	hpet_sleep(ns);
+	uint64_t tsc_ticks = rdtsc() - tsc_start;
 	ticksIn10ms = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURCNT);
 
-	lapic_write(LAPIC_REG_LVT_TIMER, 32 | LAPIC_TIMER_PERIODIC);
-	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);
-	lapic_write(LAPIC_REG_TIMER_INITCNT, ticksIn10ms);
-
 	/* Calculate frequency */
 	frequency = ticksIn10ms * 1000;
+	lapic_khz = (uint64_t)ticksIn10ms * 1000000 / ns;
+	tsc_khz = tsc_ticks * 1000000 / ns;
+	tsc_deadline = cpu_has_feature(CPU_FEATURE_ECX_TSC);
+
+	lapic_timer_init();
 }
 
-/* IRQ Issued by LAPIC once every 10ms */
+/* Set up the timer of this core with the calibration of the BSP */
+void lapic_timer_init(void) {
+	/* Leave the timer stopped until something arms it */
+	lapic_write(LAPIC_REG_TIMER_DIV, 0x3);
+	lapic_write(LAPIC_REG_TIMER_INITCNT, 0);
+	if(tsc_deadline) {
+		lapic_write(LAPIC_REG_LVT_TIMER, 32 | LAPIC_TIMER_TSC_DEADLINE);
+
+		/* The LVT write has to land before the MSR is written */
+		asm volatile ("mfence" ::: "memory");
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		lapic_write(LAPIC_REG_LVT_TIMER, 32 | LAPIC_TIMER_ONESHOT);
+	}
+}
+
+/**
+ * lapic_timer_oneshot: Arm the timer of this core
+ *
+ * Replaces the previous deadline, the timer interrupt comes once
+ *
+ * @param ns: Nanoseconds from now the interrupt comes in
+ */
+void lapic_timer_oneshot(uint64_t ns) {
+	if(tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, rdtsc() + ns_to_ticks(ns, tsc_khz));
+		return;
+	}
+
+	uint64_t count = ns_to_ticks(ns, lapic_khz);
+	if(count == 0) {
+		count = 1;
+	} else if(count > 0xFFFFFFFF) {
+		count = 0xFFFFFFFF;
+	}
+	lapic_write(LAPIC_REG_TIMER_INITCNT, (uint32_t)count);
+}
+
+/* Disarm the timer of this core */
+void lapic_timer_stop(void) {
+	if(tsc_deadline) {
+		wrmsr(MSR_TSC_DEADLINE, 0);
+	} else {
+		lapic_write(LAPIC_REG_TIMER_INITCNT, 0);
+	}
+}
+
+/* IRQ Issued by LAPIC when the armed deadline passes, may switch to another thread */
 struct regs* lapic_irq_handler(struct regs* r) {
-	kernel_ticks += ticksIn10ms;
+	this_core()->timer_irqs++;
 
-	/* Send signal saying interrupt has ended */
+	/* Send signal saying interrupt has ended, before sched_tick() leaves for another thread */
 	lapic_write(LAPIC_REG_EOI, LAPIC_EOI_ACK);
-	return r;
+	timer_interrupt();
+	return sched_tick(r);
 }
 
 /* Getter functions */
@@ -59,34 +133,85 @@ uint64_t lapic_get_frequency() {
 	return frequency;
 }
 
-uint64_t get_kernel_ticks(void) {
-	return kernel_ticks;
+uint64_t tsc_get_khz(void) {
+	return tsc_khz;
+}
+
+/* Print the timer interrupts and idle wakeups per second of every core since the last call */
+void lapic_timer_print_stats(void) {
+	uint64_t now = hpet_timer_since();
+	uint64_t elapsed = now - stats_last_ns;
+	stats_last_ns = now;
+	if(elapsed == 0) {
+		return;
+	}
+
+	kprintf("lapic: %s timer, %lu ms since the last report\n",
+		tsc_deadline ? "TSC-deadline" : "one-shot", elapsed / 1000000);
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		uint64_t irqs = core->timer_irqs - core->timer_irqs_last;
+		uint64_t wakeups = core->idle_wakeups - core->idle_wakeups_last;
+		core->timer_irqs_last = core->timer_irqs;
+		core->idle_wakeups_last = core->idle_wakeups;
+
+		kprintf("lapic: core %lu: %lu timer interrupts/s, %lu idle wakeups/s\n",
+			i, irqs * 1000000000 / elapsed, wakeups * 1000000000 / elapsed);
+	}
 }
 
 /**
  * lapic_issue_ipi: Issues IPIs
  * 
- * Interrupts another code no the desired vector
+ * Interrupts another code no the desired vector. A fixed IPI to this core
+ * goes through lapic_self_ipi()
  * 
- * @param core: The code to issue IPI on
+ * @param core: The APIC id of the core to issue IPI on, 32 bits in x2APIC mode and 8 bits otherwise
  * @param vector: The vector on which interrupt is issued
  * @param shorthand: See section 11.6.1 Intel Software developer manual Volume 3
  * @param delivery: See section 11.6.1 Intel Software developer manual Volume 3
  */
-void lapic_issue_ipi(uint16_t core, uint8_t vector, uint8_t shorthand, uint8_t delivery) {
-	uint64_t ipi_value = 0;
-	ipi_value |= (shorthand & 0x03) << 18;
-	ipi_value |= ((uint64_t)(core & 0xFF) << 56);
-	ipi_value |= ((delivery & 0x07) << 8);
-	ipi_value |= (vector & 0xFF);
-	lapic_write(LAPIC_ICR_LOW, (uint32_t)ipi_value);
-	lapic_write(LAPIC_ICR_HIGH, (uint32_t)(ipi_value >> 32));
+void lapic_issue_ipi(uint32_t core, uint8_t vector, uint8_t shorthand, uint8_t delivery) {
+	uint32_t low = ((shorthand & 0x03) << 18) | ((delivery & 0x07) << 8) | vector;
+
+	if(x2apic_enabled) {
+		if(shorthand == 0 && delivery == 0 && core == this_core()->lapic_id) {
+			lapic_self_ipi(vector);
+			return;
+		}
+
+		/* MSR writes to the ICR don't wait for earlier stores, the target must see them */
+		asm volatile ("mfence; lfence" ::: "memory");
+		wrmsr(X2APIC_MSR_ICR, ((uint64_t)core << 32) | low);
+		return;
+	}
+
+	/* Writing the low half sends the IPI, so the destination goes first, and no interrupt may send one in between */
+	bool int_state = interrupt_toggle(false);
+	while(lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+		asm volatile ("pause");
+	}
+	lapic_write(LAPIC_ICR_HIGH, (core & 0xFF) << 24);
+	lapic_write(LAPIC_ICR_LOW, low);
+	interrupt_toggle(int_state);
+}
+
+/* Interrupt this core on a vector, x2APIC has a register just for that */
+void lapic_self_ipi(uint8_t vector) {
+	if(x2apic_enabled) {
+		asm volatile ("mfence; lfence" ::: "memory");
+		wrmsr(X2APIC_MSR_SELF_IPI, vector);
+		return;
+	}
+	lapic_issue_ipi(0, vector, LAPIC_IPI_SELF, 0);
 }
 
 /* Assume all local apics are enabled */
 void __init lapic_init(void) {
-	/* We get the lapic address with HHDM_HIGHER_HALF already added */
-	mmu_map_page(mmu_kernel_pagemap, lapic_address, lapic_address - HHDM_HIGHER_HALF, PTE_PRESENT | PTE_WRITABLE);
+	/* We get the lapic address with HHDM_HIGHER_HALF already added, x2APIC mode needs no mapping */
+	if(!x2apic_enabled) {
+		mmu_map_page(mmu_kernel_pagemap, lapic_address, lapic_address - HHDM_HIGHER_HALF, PTE_PRESENT | PTE_WRITABLE);
+	}
 
 	lapic_write(LAPIC_REG_SPURIOUS, lapic_read(LAPIC_REG_SPURIOUS) | (1 << 8) | 0xff);
 }
\ No newline at end of file
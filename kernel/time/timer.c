@@ -0,0 +1,553 @@
+/**
+ * timer.c: Per core timer wheel
+ *
+ * Every core has a hierarchical timer wheel with TIMER_WHEEL_LEVELS levels of
+ * TIMER_WHEEL_SIZE slots. Level 0 has a slot per TIMER_TICK_NS, every level
+ * above is 2^TIMER_LEVEL_SHIFT times coarser. A timer goes into the finest
+ * level that reaches its deadline, rounded up to the slot, and stays there
+ * until it expires, so inserting and cancelling are O(1). With enough slack it
+ * goes into a coarser level instead, where it expires together with others.
+ *
+ * Deadlines closer than a tick and TIMER_HRES timers go on a sorted list and
+ * expire exactly. The LAPIC timer is armed one-shot for the earliest deadline
+ * of either, and is stopped when there is none.
+ *
+ * A core going idle hands its timers that are not pinned to a busy core, so it
+ * is not woken for them.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory.h>
+#include <kernel/timer.h>
+#include <kernel/wait.h>
+#include <kernel/scheduler.h>
+#include <kernel/cpu.h>
+#include <kernel/apic.h>
+#include <kernel/mmu.h>
+#include <kernel/macros.h>
+#include <kernel/kprintf.h>
+#include <kernel/isolation.h>
+
+/* timer->index of timers that are not in a wheel slot */
+#define TIMER_INDEX_HRES 0xFFFF0000
+#define TIMER_INDEX_EXPIRED 0xFFFF0001
+
+/* timer->base while timer_arm() moves the timer to a base, timer_lock_base() waits for it to get there */
+#define TIMER_BASE_MIGRATING ((struct timer_base*)1)
+
+static struct timer_base* timer_bases = NULL;
+
+/* TSC at timer_init(), clock_ns() counts from there */
+static uint64_t tsc_boot = 0;
+
+/* Nanoseconds since timer_init(), 0 until the TSC is calibrated */
+uint64_t clock_ns(void) {
+	uint64_t khz = tsc_get_khz();
+	if(khz == 0) {
+		return 0;
+	}
+
+	uint64_t ticks = rdtsc() - tsc_boot;
+	return (ticks / khz) * 1000000 + (ticks % khz) * 1000000 / khz;
+}
+
+static inline struct timer_base* this_base(void) {
+	return &timer_bases[this_core()->id];
+}
+
+static inline uint64_t level_shift(uint64_t level) {
+	return level * TIMER_LEVEL_SHIFT;
+}
+
+/* First slot index of a level that has not expired yet */
+static inline uint64_t level_cur(struct timer_base* base, uint64_t level) {
+	return (base->clk + (1ull << level_shift(level)) - 1) >> level_shift(level);
+}
+
+/* Slot index of a level that expires at or after tick */
+static inline uint64_t level_index(uint64_t tick, uint64_t level) {
+	return (tick + (1ull << level_shift(level)) - 1) >> level_shift(level);
+}
+
+static void timer_link(struct timer** head, struct timer* timer) {
+	timer->next = *head;
+	if(*head) {
+		(*head)->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void timer_unlink(struct timer_base* base, struct timer* timer) {
+	*timer->pprev = timer->next;
+	if(timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+
+	uint32_t index = timer->index;
+	if(index < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE && base->slots[index] == NULL) {
+		base->pending[index / TIMER_WHEEL_SIZE] &= ~(1ull << (index % TIMER_WHEEL_SIZE));
+	}
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* First tick a wheel slot expires at, UINT64_MAX if the wheel is empty */
+static uint64_t wheel_next_tick(struct timer_base* base) {
+	uint64_t next = UINT64_MAX;
+	for(uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint64_t pending = base->pending[level];
+		if(pending == 0) {
+			continue;
+		}
+
+		uint64_t cur = level_cur(base, level);
+		uint64_t pos = cur % TIMER_WHEEL_SIZE;
+		if(pos != 0) {
+			pending = (pending >> pos) | (pending << (TIMER_WHEEL_SIZE - pos));
+		}
+
+		uint64_t tick = (cur + __builtin_ctzll(pending)) << level_shift(level);
+		if(tick < next) {
+			next = tick;
+		}
+	}
+	return next;
+}
+
+static void wheel_insert(struct timer_base* base, struct timer* timer) {
+	uint64_t expires = (timer->expires + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+	uint64_t latest = (timer->expires + timer->slack) / TIMER_TICK_NS;
+	if(expires < base->clk) {
+		expires = base->clk;
+	}
+
+	/* Finest level that reaches the deadline */
+	uint64_t level = TIMER_WHEEL_LEVELS - 1;
+	for(uint64_t i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		if(level_index(expires, i) - level_cur(base, i) < TIMER_WHEEL_SIZE) {
+			level = i;
+			break;
+		}
+	}
+
+	/* Coarser slots are shared by more timers, use them while the slack allows */
+	while(level + 1 < TIMER_WHEEL_LEVELS) {
+		uint64_t index = level_index(expires, level + 1);
+		if(index - level_cur(base, level + 1) >= TIMER_WHEEL_SIZE || (index << level_shift(level + 1)) > latest) {
+			break;
+		}
+		level++;
+	}
+
+	/* Beyond the wheel, it is queued again when the last slot expires */
+	uint64_t index = level_index(expires, level);
+	if(index - level_cur(base, level) >= TIMER_WHEEL_SIZE) {
+		index = level_cur(base, level) + TIMER_WHEEL_SIZE - 1;
+	}
+
+	uint64_t slot = index % TIMER_WHEEL_SIZE;
+	timer->index = level * TIMER_WHEEL_SIZE + slot;
+	timer_link(&base->slots[timer->index], timer);
+	base->pending[level] |= 1ull << slot;
+}
+
+/* Queue a timer on a base, the lock of the base is held */
+static void timer_enqueue(struct timer_base* base, struct timer* timer, uint64_t now) {
+	timer->base = base;
+
+	if((timer->flags & TIMER_HRES) || (timer->slack < TIMER_TICK_NS && timer->expires < now + TIMER_TICK_NS)) {
+		struct timer** pos = &base->hres;
+		while(*pos && (*pos)->expires <= timer->expires) {
+			pos = &(*pos)->next;
+		}
+		timer->index = TIMER_INDEX_HRES;
+		timer_link(pos, timer);
+		return;
+	}
+
+	/* Move the wheel up to now if it was idle, without passing a pending slot */
+	uint64_t now_tick = now / TIMER_TICK_NS;
+	if(base->clk < now_tick) {
+		uint64_t next = wheel_next_tick(base);
+		base->clk = next < now_tick ? next : now_tick;
+	}
+	wheel_insert(base, timer);
+}
+
+/* Move the timers of the slots expiring at tick to expired, the lock of the base is held */
+static void wheel_expire(struct timer_base* base, uint64_t tick, struct timer** expired) {
+	for(uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if(tick & ((1ull << level_shift(level)) - 1)) {
+			break;
+		}
+
+		uint64_t slot = level * TIMER_WHEEL_SIZE + ((tick >> level_shift(level)) % TIMER_WHEEL_SIZE);
+		while(base->slots[slot]) {
+			struct timer* timer = base->slots[slot];
+			timer_unlink(base, timer);
+
+			if(timer->expires > tick * TIMER_TICK_NS) {
+				wheel_insert(base, timer);
+			} else {
+				timer->index = TIMER_INDEX_EXPIRED;
+				timer_link(expired, timer);
+			}
+		}
+	}
+}
+
+static uint64_t timer_next_event(struct timer_base* base) {
+	uint64_t next = base->hres ? base->hres->expires : UINT64_MAX;
+	uint64_t tick = wheel_next_tick(base);
+	if(tick != UINT64_MAX && tick * TIMER_TICK_NS < next) {
+		next = tick * TIMER_TICK_NS;
+	}
+	return next;
+}
+
+/* Arm the LAPIC timer of this core for the next deadline, the lock of the base is held */
+static void timer_program(struct timer_base* base, uint64_t now) {
+	uint64_t next = timer_next_event(base);
+	if(next == base->programmed) {
+		return;
+	}
+
+	base->programmed = next;
+	if(next == UINT64_MAX) {
+		lapic_timer_stop();
+	} else {
+		lapic_timer_oneshot(next > now ? next - now : 1);
+	}
+}
+
+/* Lock the base the timer was last armed on, NULL if it never was */
+static struct timer_base* timer_lock_base(struct timer* timer, bool* int_state) {
+	for(;;) {
+		struct timer_base* base = timer->base;
+		if(base == NULL) {
+			return NULL;
+		}
+		if(base == TIMER_BASE_MIGRATING) {
+			asm volatile ("pause");
+			continue;
+		}
+
+		*int_state = spinlock_acquire_irqsave(&base->lock);
+		if(timer->base == base) {
+			return base;
+		}
+		spinlock_release_irqrestore(&base->lock, *int_state);
+	}
+}
+
+/**
+ * timer_setup: Initialize a timer
+ *
+ * @param timer: The timer
+ * @param func: Called with arg from the timer interrupt when the timer expires
+ * @param arg: Argument of func
+ * @param flags: TIMER_PINNED, TIMER_HRES
+ */
+void timer_setup(struct timer* timer, void (*func)(void* arg), void* arg, uint32_t flags) {
+	memset(timer, 0, sizeof(struct timer));
+	timer->func = func;
+	timer->arg = arg;
+	timer->flags = flags;
+}
+
+/**
+ * Take a timer off its base for timer_arm(), returns with interrupts disabled
+ * and the previous interrupt state. The timer is then on no base and its base
+ * is TIMER_BASE_MIGRATING, so other timer_arm() and timer_cancel() calls wait
+ * until it was queued again instead of queueing it a second time.
+ */
+static bool timer_detach(struct timer* timer) {
+	for(;;) {
+		bool int_state;
+		struct timer_base* base = timer_lock_base(timer, &int_state);
+		if(base) {
+			if(timer->pprev) {
+				timer_unlink(base, timer);
+			}
+			timer->base = TIMER_BASE_MIGRATING;
+			spinlock_release_irqrestore(&base->lock, false);
+			return int_state;
+		}
+
+		/* Never armed, only one of the callers gets it */
+		int_state = interrupt_state();
+		disable_interrupts();
+		struct timer_base* expected = NULL;
+		if(__atomic_compare_exchange_n(&timer->base, &expected, TIMER_BASE_MIGRATING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return int_state;
+		}
+		if(int_state) {
+			enable_interrupts();
+		}
+	}
+}
+
+/**
+ * timer_arm: Start a timer on this core, or move its deadline if it is pending
+ *
+ * May be called on the same timer from several cores at once, and from its
+ * own function. The timer then ends up pending once, with the deadline of
+ * the call that queued it last.
+ *
+ * @param timer: The timer
+ * @param expires: Deadline in clock_ns() time
+ * @param slack: How much later than the deadline it may expire
+ */
+void timer_arm(struct timer* timer, uint64_t expires, uint64_t slack) {
+	bool int_state = timer_detach(timer);
+
+	/* Interrupts stay disabled, so this is still the core that detached it */
+	struct timer_base* base = this_base();
+	spinlock_acquire_irqsave(&base->lock);
+	uint64_t now = clock_ns();
+	timer->expires = expires;
+	timer->slack = slack;
+	timer_enqueue(base, timer, now);
+	timer_program(base, now);
+	spinlock_release_irqrestore(&base->lock, int_state);
+}
+
+/**
+ * timer_cancel: Stop a timer
+ *
+ * If its function is running on another core, waits for it to return
+ *
+ * @return true if the timer was pending
+ */
+bool timer_cancel(struct timer* timer) {
+	bool int_state;
+	struct timer_base* base = timer_lock_base(timer, &int_state);
+	if(base == NULL) {
+		return false;
+	}
+
+	bool pending = timer->pprev != NULL;
+	if(pending) {
+		timer_unlink(base, timer);
+	}
+
+	bool own = base == this_base();
+	if(own && pending) {
+		timer_program(base, clock_ns());
+	}
+	spinlock_release_irqrestore(&base->lock, int_state);
+
+	if(!own) {
+		while(base->running == timer) {
+			asm volatile ("pause");
+		}
+	}
+	return pending;
+}
+
+bool timer_pending(struct timer* timer) {
+	return timer->pprev != NULL;
+}
+
+/**
+ * timer_interrupt: Run the expired timers of this core
+ *
+ * Called from the LAPIC timer interrupt, arms the LAPIC timer for the next deadline
+ */
+void timer_interrupt(void) {
+	if(timer_bases == NULL) {
+		return;
+	}
+
+	struct timer_base* base = this_base();
+	uint64_t now = clock_ns();
+	struct timer* expired = NULL;
+
+	bool int_state = spinlock_acquire_irqsave(&base->lock);
+	base->programmed = UINT64_MAX;
+	base->interrupts++;
+
+	while(base->hres && base->hres->expires <= now) {
+		struct timer* timer = base->hres;
+		timer_unlink(base, timer);
+		timer->index = TIMER_INDEX_EXPIRED;
+		timer_link(&expired, timer);
+	}
+
+	/* Skip over empty ticks, an idle core may not have run its wheel for a while */
+	uint64_t now_tick = now / TIMER_TICK_NS;
+	while(base->clk <= now_tick) {
+		uint64_t next = wheel_next_tick(base);
+		if(next > now_tick) {
+			base->clk = now_tick + 1;
+			break;
+		}
+
+		base->clk = next;
+		wheel_expire(base, next, &expired);
+		base->clk = next + 1;
+	}
+
+	/* The lock is dropped while a function runs so it can arm timers */
+	uint32_t cputime_prev = cputime_enter(CPUTIME_SOFTIRQ);
+	while(expired) {
+		struct timer* timer = expired;
+		timer_unlink(base, timer);
+		base->running = timer;
+		base->fired++;
+
+		spinlock_release_irqrestore(&base->lock, false);
+		timer->func(timer->arg);
+		spinlock_acquire_irqsave(&base->lock);
+
+		base->running = NULL;
+	}
+	cputime_exit(cputime_prev);
+
+	timer_program(base, clock_ns());
+	spinlock_release_irqrestore(&base->lock, int_state);
+}
+
+/* Arm the LAPIC timer of this core again, after another core moved timers to it */
+void timer_program_next(void) {
+	if(timer_bases == NULL) {
+		return;
+	}
+
+	struct timer_base* base = this_base();
+	bool int_state = spinlock_acquire_irqsave(&base->lock);
+	timer_program(base, clock_ns());
+	spinlock_release_irqrestore(&base->lock, int_state);
+}
+
+/* Move the timers that are not pinned from src to dst, both locks are held */
+static uint64_t timer_migrate(struct timer_base* src, struct timer_base* dst, uint64_t now) {
+	uint64_t moved = 0;
+
+	for(struct timer* timer = src->hres, *next; timer; timer = next) {
+		next = timer->next;
+		if(!(timer->flags & TIMER_PINNED)) {
+			timer_unlink(src, timer);
+			timer_enqueue(dst, timer, now);
+			moved++;
+		}
+	}
+
+	for(uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(uint64_t pending = src->pending[level]; pending; pending &= pending - 1) {
+			uint64_t slot = level * TIMER_WHEEL_SIZE + __builtin_ctzll(pending);
+			for(struct timer* timer = src->slots[slot], *next; timer; timer = next) {
+				next = timer->next;
+				if(!(timer->flags & TIMER_PINNED)) {
+					timer_unlink(src, timer);
+					timer_enqueue(dst, timer, now);
+					moved++;
+				}
+			}
+		}
+	}
+
+	src->migrated += moved;
+	return moved;
+}
+
+/**
+ * timer_core_idle: Called when this core switches to its idle thread or stops its tick
+ *
+ * Hands the timers that are not pinned to a housekeeping core running a
+ * thread, so the core sleeps until its own next deadline. An isolated core
+ * hands them to a housekeeping core even if none is busy
+ */
+void timer_core_idle(void) {
+	core_t* self = this_core();
+	core_t* target = NULL;
+	for(uint64_t i = 0; i < coreCount; i++) {
+		core_t* core = cpu_core(i);
+		if(i != self->id && !core_isolated(i) && core->rq->online && core->current_thread != core->rq->idle) {
+			target = core;
+			break;
+		}
+	}
+	if(target == NULL && core_isolated(self->id)) {
+		target = cpu_core(cpumask_first(&cpu_housekeeping));
+	}
+	if(target == NULL) {
+		return;
+	}
+
+	struct timer_base* src = this_base();
+	struct timer_base* dst = &timer_bases[target->id];
+	struct timer_base* first = src->core < dst->core ? src : dst;
+	struct timer_base* second = src->core < dst->core ? dst : src;
+
+	bool int_state = spinlock_acquire_irqsave(&first->lock);
+	spinlock_acquire_irqsave(&second->lock);
+
+	uint64_t now = clock_ns();
+	uint64_t moved = timer_migrate(src, dst, now);
+	bool earlier = moved && timer_next_event(dst) < dst->programmed;
+	timer_program(src, now);
+
+	spinlock_release_irqrestore(&second->lock, false);
+	spinlock_release_irqrestore(&first->lock, int_state);
+
+	/* Only the target can arm its LAPIC timer */
+	if(earlier) {
+		lapic_issue_ipi(target->lapic_id, SCHED_IPI_VECTOR, 0, 0);
+	}
+}
+
+static void timer_sleep_expired(void* arg) {
+	complete(arg);
+}
+
+/**
+ * timer_sleep_slack: Sleep the running thread
+ *
+ * @param ns: Nanoseconds to sleep at least
+ * @param slack: Nanoseconds it may sleep longer, so the wakeup can be shared
+ */
+void timer_sleep_slack(uint64_t ns, uint64_t slack) {
+	struct completion done;
+	struct timer timer;
+	completion_init(&done);
+	timer_setup(&timer, timer_sleep_expired, &done, 0);
+
+	timer_arm(&timer, clock_ns() + ns, slack);
+	wait_for_completion(&done);
+
+	/* complete() may still be using done on another core */
+	timer_cancel(&timer);
+}
+
+void timer_sleep(uint64_t ns) {
+	timer_sleep_slack(ns, TIMER_SLEEP_SLACK_NS);
+}
+
+/* Allocate the timer wheels of all cores */
+void __init timer_init(void) {
+	timer_bases = malloc(sizeof(struct timer_base) * coreCount);
+	if(timer_bases == NULL) {
+		panic("timer: Out of memory for timer wheels", NULL);
+	}
+	memset(timer_bases, 0, sizeof(struct timer_base) * coreCount);
+
+	for(uint64_t i = 0; i < coreCount; i++) {
+		timer_bases[i].core = i;
+		timer_bases[i].programmed = UINT64_MAX;
+	}
+
+	tsc_boot = rdtsc();
+}
+
+/* Print how many timers expired per timer interrupt on every core */
+void timer_print_stats(void) {
+	for(uint64_t i = 0; i < coreCount; i++) {
+		struct timer_base* base = &timer_bases[i];
+		kprintf("timer: core %lu: %lu timers in %lu interrupts, %lu migrated away\n",
+			i, base->fired, base->interrupts, base->migrated);
+	}
+}